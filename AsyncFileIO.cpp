@@ -0,0 +1,573 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#include "AsyncFileIO.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// io_uring through the system calls, without liburing.
+#ifdef HAVE_IO_URING
+static int IoUringSetup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int IoUringEnter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int IoUringRegister(int ringFd, unsigned opcode, const void* arg, unsigned numArgs)
+{
+    return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, numArgs);
+}
+
+static void ReleaseIoUring(AsyncFileIO* io)
+{
+    if (io->sqes)
+        munmap(io->sqes, io->sqesSize);
+    if (io->cqRing && io->cqRing != io->sqRing)
+        munmap(io->cqRing, io->cqRingSize);
+    if (io->sqRing)
+        munmap(io->sqRing, io->sqRingSize);
+    if (io->ringFd >= 0)
+        close(io->ringFd);     // also unregisters the buffers
+
+    io->sqes = NULL;
+    io->cqRing = NULL;
+    io->sqRing = NULL;
+    io->ringFd = -1;
+}
+
+// Whether the kernel supports both operations. Kernels before 5.6 can not be
+// probed and support neither of the plain read and write.
+static bool HasRingOperations(AsyncFileIO* io, int first, int second)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, size);
+    bool supported = false;
+
+    if (probe && 0 == IoUringRegister(io->ringFd, IORING_REGISTER_PROBE, probe, 256))
+    {
+        supported = first <= probe->last_op && second <= probe->last_op &&
+                    (probe->ops[first].flags & IO_URING_OP_SUPPORTED) &&
+                    (probe->ops[second].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+
+    return supported;
+}
+
+// Creates a ring with a submission entry for every buffer and maps its
+// queues. The completion queue the kernel sizes is twice as large, so it
+// can not overflow.
+static bool InitIoUring(AsyncFileIO* io)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    io->ringFd = IoUringSetup(io->numBuffers, &params);
+    if (io->ringFd < 0)
+        return false;
+
+    io->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (io->cqRingSize > io->sqRingSize)
+            io->sqRingSize = io->cqRingSize;
+        io->cqRingSize = io->sqRingSize;
+    }
+
+    io->sqRing = mmap(NULL, io->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringFd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == io->sqRing)
+    {
+        io->sqRing = NULL;
+        ReleaseIoUring(io);
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        io->cqRing = io->sqRing;
+    }
+    else
+    {
+        io->cqRing = mmap(NULL, io->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringFd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == io->cqRing)
+        {
+            io->cqRing = NULL;
+            ReleaseIoUring(io);
+            return false;
+        }
+    }
+
+    io->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = (struct io_uring_sqe*)mmap(NULL, io->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringFd, IORING_OFF_SQES);
+    if (MAP_FAILED == (void*)io->sqes)
+    {
+        io->sqes = NULL;
+        ReleaseIoUring(io);
+        return false;
+    }
+
+    char* sq = (char*)io->sqRing;
+    char* cq = (char*)io->cqRing;
+    io->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    io->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    io->sqArray = (unsigned*)(sq + params.sq_off.array);
+    io->cqHead = (unsigned*)(cq + params.cq_off.head);
+    io->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    io->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // Registered buffers are pinned once instead of for every request. The
+    // locked memory limit may not allow it, then the plain operations work
+    // where the kernel has them (5.6+, which also added the probe).
+    bool plainOperations = HasRingOperations(io, IORING_OP_READ, IORING_OP_WRITE);
+    struct iovec iovecs[MAX_FILE_IO_BUFFERS];
+    for (int i = 0; i < io->numBuffers; i++)
+    {
+        iovecs[i].iov_base = io->buffers + i * io->bufferSize;
+        iovecs[i].iov_len = io->bufferSize;
+    }
+    io->fixedBuffers = (0 == IoUringRegister(io->ringFd, IORING_REGISTER_BUFFERS, iovecs, io->numBuffers));
+    if (!io->fixedBuffers && !plainOperations)
+    {
+        ReleaseIoUring(io);
+        return false;
+    }
+
+    return true;
+}
+
+// Queues the rest of the request's transfer and submits it. Only this thread
+// writes the submission queue, and every request has at most one entry in
+// it, so there is always a free entry.
+static bool QueueRingRequest(AsyncFileIO* io, int buffer)
+{
+    FileIORequest* request = &io->requests[buffer];
+    unsigned tail = *io->sqTail;
+    unsigned index = tail & *io->sqMask;
+    struct io_uring_sqe* sqe = &io->sqes[index];
+    bool isRead = (FILE_IO_READ == request->type);
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (io->fixedBuffers)
+    {
+        sqe->opcode = isRead ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = buffer;
+    }
+    else
+    {
+        sqe->opcode = isRead ? IORING_OP_READ : IORING_OP_WRITE;
+    }
+    sqe->fd = request->fd;
+    sqe->off = request->done;
+    sqe->addr = (unsigned long)(GetFileIOBuffer(io, buffer) + request->done);
+    sqe->len = (unsigned)(request->size - request->done);
+    sqe->user_data = buffer;
+    io->sqArray[index] = index;
+
+    // The entry must be visible before the new tail
+    __atomic_store_n(io->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    for (;;)
+    {
+        int submitted = IoUringEnter(io->ringFd, 1, 0, 0);
+        if (submitted >= 0)
+            return true;
+        if (EINTR != errno && EAGAIN != errno && EBUSY != errno)
+        {
+            printf("\nio_uring_enter failed: %s", strerror(errno));
+            return false;
+        }
+    }
+}
+
+// Takes the next completion entry, waiting for one if there is none.
+static bool WaitRingCompletion(AsyncFileIO* io, int* buffer, int* result)
+{
+    for (;;)
+    {
+        unsigned head = *io->cqHead;
+        if (head != __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe* cqe = &io->cqes[head & *io->cqMask];
+            *buffer = (int)cqe->user_data;
+            *result = cqe->res;
+            __atomic_store_n(io->cqHead, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        if (IoUringEnter(io->ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && EINTR != errno)
+        {
+            printf("\nio_uring_enter failed: %s", strerror(errno));
+            return false;
+        }
+    }
+}
+
+// Takes the completions of the requests still in flight from the ring
+// without entering the kernel, for when waiting failed. Returns false if
+// they do not all come within a few seconds.
+static bool DrainIoUring(AsyncFileIO* io)
+{
+    for (int wait = 0; wait < 5000 && io->numInFlight > 0; wait++)
+    {
+        unsigned head = *io->cqHead;
+        while (io->numInFlight > 0 && head != __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe* cqe = &io->cqes[head & *io->cqMask];
+            close(io->requests[cqe->user_data].fd);
+            io->numInFlight--;
+            __atomic_store_n(io->cqHead, ++head, __ATOMIC_RELEASE);
+        }
+        if (io->numInFlight > 0)
+            usleep(1000);
+    }
+
+    return 0 == io->numInFlight;
+}
+#else
+// Built without io_uring headers: always the threads.
+static void ReleaseIoUring(AsyncFileIO*)
+{
+}
+
+static bool InitIoUring(AsyncFileIO*)
+{
+    return false;
+}
+
+static bool QueueRingRequest(AsyncFileIO*, int)
+{
+    return false;
+}
+
+static bool WaitRingCompletion(AsyncFileIO*, int*, int*)
+{
+    return false;
+}
+
+static bool DrainIoUring(AsyncFileIO*)
+{
+    return true;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Fallback: threads transfer the pending requests with pread and pwrite.
+static void* FileIOThreadMain(void* arg)
+{
+    AsyncFileIO* io = (AsyncFileIO*)arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&io->lock);
+        while (0 == io->numPending && !io->stop)
+            pthread_cond_wait(&io->submitted, &io->lock);
+        if (0 == io->numPending)
+        {
+            pthread_mutex_unlock(&io->lock);
+            break;
+        }
+        int buffer = io->pending[io->firstPending];
+        io->firstPending = (io->firstPending + 1) % MAX_FILE_IO_BUFFERS;
+        io->numPending--;
+        pthread_mutex_unlock(&io->lock);
+
+        FileIORequest* request = &io->requests[buffer];
+        unsigned char* data = GetFileIOBuffer(io, buffer);
+        while (request->done < request->size)
+        {
+            ssize_t count = (FILE_IO_READ == request->type)
+                ? pread(request->fd, data + request->done, request->size - request->done, request->done)
+                : pwrite(request->fd, data + request->done, request->size - request->done, request->done);
+            if (count < 0 && EINTR == errno)
+                continue;
+            if (count <= 0)
+            {
+                request->error = (count < 0) ? errno : EIO;
+                break;
+            }
+            request->done += count;
+        }
+
+        pthread_mutex_lock(&io->lock);
+        io->finished[(io->firstFinished + io->numFinished) % MAX_FILE_IO_BUFFERS] = buffer;
+        io->numFinished++;
+        pthread_cond_signal(&io->completed);
+        pthread_mutex_unlock(&io->lock);
+    }
+
+    return NULL;
+}
+
+static bool InitFileIOThreads(AsyncFileIO* io)
+{
+    io->firstPending = 0;
+    io->numPending = 0;
+    io->firstFinished = 0;
+    io->numFinished = 0;
+    io->stop = false;
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->submitted, NULL);
+    pthread_cond_init(&io->completed, NULL);
+
+    for (int i = 0; i < FILE_IO_THREADS; i++)
+    {
+        if (0 != pthread_create(&io->threads[i], NULL, FileIOThreadMain, io))
+        {
+            printf("\nUnable to start the file I/O threads");
+            pthread_mutex_lock(&io->lock);
+            io->stop = true;
+            pthread_cond_broadcast(&io->submitted);
+            pthread_mutex_unlock(&io->lock);
+            for (int j = 0; j < i; j++)
+                pthread_join(io->threads[j], NULL);
+            pthread_mutex_destroy(&io->lock);
+            pthread_cond_destroy(&io->submitted);
+            pthread_cond_destroy(&io->completed);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool InitAsyncFileIO(AsyncFileIO* io, int numBuffers, size_t bufferSize, bool allowIoUring)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+    void* buffers = NULL;
+
+    memset(io, 0, sizeof(*io));
+    io->ringFd = -1;
+
+    if (numBuffers < 1)
+        numBuffers = 1;
+    if (numBuffers > MAX_FILE_IO_BUFFERS)
+        numBuffers = MAX_FILE_IO_BUFFERS;
+    io->numBuffers = numBuffers;
+    io->bufferSize = (bufferSize + pageSize - 1) / pageSize * pageSize;
+
+    if (0 != posix_memalign(&buffers, pageSize, io->numBuffers * io->bufferSize))
+    {
+        printf("\nUnable to allocate %d file buffers of %zu bytes", io->numBuffers, io->bufferSize);
+        return false;
+    }
+    io->buffers = (unsigned char*)buffers;
+
+    io->useIoUring = allowIoUring && InitIoUring(io);
+    if (!io->useIoUring && !InitFileIOThreads(io))
+    {
+        free(io->buffers);
+        io->buffers = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ReleaseAsyncFileIO(AsyncFileIO* io)
+{
+    FileIOCompletion completion;
+
+    if (!io->buffers)
+        return;
+
+    while (WaitFileIO(io, &completion))
+        ReleaseFileIOBuffer(io, completion.buffer);
+
+    if (io->useIoUring)
+    {
+        // The kernel may still transfer into buffers of requests that were
+        // never completed, so those buffers are not freed
+        bool drained = DrainIoUring(io);
+        ReleaseIoUring(io);
+        if (!drained)
+        {
+            printf("\n%d file requests did not complete, keeping their buffers", io->numInFlight);
+            io->buffers = NULL;
+            return;
+        }
+    }
+    else
+    {
+        pthread_mutex_lock(&io->lock);
+        io->stop = true;
+        pthread_cond_broadcast(&io->submitted);
+        pthread_mutex_unlock(&io->lock);
+
+        for (int i = 0; i < FILE_IO_THREADS; i++)
+            pthread_join(io->threads[i], NULL);
+        pthread_mutex_destroy(&io->lock);
+        pthread_cond_destroy(&io->submitted);
+        pthread_cond_destroy(&io->completed);
+    }
+
+    free(io->buffers);
+    io->buffers = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int AcquireFileIOBuffer(AsyncFileIO* io)
+{
+    for (int i = 0; i < io->numBuffers; i++)
+    {
+        if (!io->requests[i].acquired)
+        {
+            io->requests[i].acquired = true;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void ReleaseFileIOBuffer(AsyncFileIO* io, int buffer)
+{
+    io->requests[buffer].acquired = false;
+}
+
+unsigned char* GetFileIOBuffer(const AsyncFileIO* io, int buffer)
+{
+    return io->buffers + buffer * io->bufferSize;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static bool SubmitFileRequest(AsyncFileIO* io, int buffer, FileIOType type, int fd, size_t size, void* user)
+{
+    FileIORequest* request = &io->requests[buffer];
+
+    request->type = type;
+    request->fd = fd;
+    request->size = size;
+    request->done = 0;
+    request->error = 0;
+    request->user = user;
+
+    if (io->useIoUring)
+    {
+        if (!QueueRingRequest(io, buffer))
+        {
+            close(fd);
+            return false;
+        }
+    }
+    else
+    {
+        pthread_mutex_lock(&io->lock);
+        io->pending[(io->firstPending + io->numPending) % MAX_FILE_IO_BUFFERS] = buffer;
+        io->numPending++;
+        pthread_cond_signal(&io->submitted);
+        pthread_mutex_unlock(&io->lock);
+    }
+
+    io->numInFlight++;
+    return true;
+}
+
+bool SubmitFileRead(AsyncFileIO* io, int buffer, const char* path, void* user)
+{
+    struct stat fileStat;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return false;
+    if (0 != fstat(fd, &fileStat) || (size_t)fileStat.st_size > io->bufferSize)
+    {
+        close(fd);
+        return false;
+    }
+
+    return SubmitFileRequest(io, buffer, FILE_IO_READ, fd, fileStat.st_size, user);
+}
+
+bool SubmitFileWrite(AsyncFileIO* io, int buffer, const char* path, size_t size, void* user)
+{
+    if (size > io->bufferSize)
+        return false;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    return SubmitFileRequest(io, buffer, FILE_IO_WRITE, fd, size, user);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool WaitFileIO(AsyncFileIO* io, FileIOCompletion* completion)
+{
+    int buffer = -1;
+
+    if (0 == io->numInFlight)
+        return false;
+
+    if (io->useIoUring)
+    {
+        // Short transfers are continued until the request is complete
+        for (;;)
+        {
+            int result;
+            if (!WaitRingCompletion(io, &buffer, &result))
+                return false;
+
+            FileIORequest* request = &io->requests[buffer];
+            if (-EINTR == result || -EAGAIN == result)
+            {
+                if (QueueRingRequest(io, buffer))
+                    continue;
+                request->error = EIO;
+            }
+            else if (result < 0)
+            {
+                request->error = -result;
+            }
+            else if (0 == result && request->done < request->size)
+            {
+                request->error = EIO;
+            }
+            else
+            {
+                request->done += result;
+                if (request->done < request->size && QueueRingRequest(io, buffer))
+                    continue;
+            }
+            break;
+        }
+    }
+    else
+    {
+        pthread_mutex_lock(&io->lock);
+        while (0 == io->numFinished)
+            pthread_cond_wait(&io->completed, &io->lock);
+        buffer = io->finished[io->firstFinished];
+        io->firstFinished = (io->firstFinished + 1) % MAX_FILE_IO_BUFFERS;
+        io->numFinished--;
+        pthread_mutex_unlock(&io->lock);
+    }
+
+    FileIORequest* request = &io->requests[buffer];
+    bool closed = (0 == close(request->fd));
+    io->numInFlight--;
+
+    completion->buffer = buffer;
+    completion->data = GetFileIOBuffer(io, buffer);
+    completion->size = request->done;
+    completion->type = request->type;
+    completion->user = request->user;
+    completion->ok = (0 == request->error && request->done == request->size && closed);
+
+    return true;
+}
@@ -0,0 +1,117 @@
+#ifndef ASYNCFILEIO_H
+#define ASYNCFILEIO_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Asynchronous reads and writes of whole files with many requests in flight.
+// Requests go to io_uring, set up with the raw system calls, and transfer
+// into and out of a set of page aligned buffers that are registered with the
+// kernel once. A read completes in the memory the decoder parses, a write is
+// sent from the memory the encoder filled, so there are no copies besides
+// decoding and encoding. Where io_uring is not available (old kernels or
+// kernel headers, seccomp filters) a few threads do the same with pread and
+// pwrite.
+//
+// Every request uses one buffer: acquire a free buffer, submit a read into it
+// or a write from it, take its completion with WaitFileIO and release the
+// buffer. Files are opened and closed synchronously by the calling thread.
+// An AsyncFileIO belongs to one thread.
+#define MAX_FILE_IO_BUFFERS 64
+#define FILE_IO_THREADS 2
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+typedef enum
+{
+    FILE_IO_READ,
+    FILE_IO_WRITE
+} FileIOType;
+
+typedef struct
+{
+    FileIOType type;
+    int fd;
+    size_t size;                // bytes to transfer
+    size_t done;                // bytes transferred
+    int error;                  // errno of a failed transfer, 0 if none
+    void* user;
+    bool acquired;
+} FileIORequest;
+
+typedef struct
+{
+    int buffer;
+    unsigned char* data;
+    size_t size;                // bytes read or written
+    FileIOType type;
+    void* user;                 // as passed to the submit call
+    bool ok;
+} FileIOCompletion;
+
+typedef struct
+{
+    bool useIoUring;
+    unsigned char* buffers;     // numBuffers buffers of bufferSize bytes
+    size_t bufferSize;
+    int numBuffers;
+    FileIORequest requests[MAX_FILE_IO_BUFFERS];    // one per buffer
+    int numInFlight;
+
+    // io_uring
+    int ringFd;
+    bool fixedBuffers;          // buffers registered, *_FIXED operations
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;               // same as sqRing with a single mapping
+    size_t cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+
+    // Threads of the fallback and the rings of buffer indices they share
+    pthread_t threads[FILE_IO_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;
+    pthread_cond_t completed;
+    int pending[MAX_FILE_IO_BUFFERS];
+    int firstPending;
+    int numPending;
+    int finished[MAX_FILE_IO_BUFFERS];
+    int firstFinished;
+    int numFinished;
+    bool stop;
+} AsyncFileIO;
+
+// Allocates numBuffers (at most MAX_FILE_IO_BUFFERS) buffers of bufferSize
+// bytes and sets up io_uring or, if it is not available or allowIoUring is
+// false, the threads.
+bool InitAsyncFileIO(AsyncFileIO* io, int numBuffers, size_t bufferSize, bool allowIoUring);
+
+// Waits for the requests in flight and frees everything.
+void ReleaseAsyncFileIO(AsyncFileIO* io);
+
+// Index of a free buffer, or -1 if all are in use.
+int AcquireFileIOBuffer(AsyncFileIO* io);
+void ReleaseFileIOBuffer(AsyncFileIO* io, int buffer);
+unsigned char* GetFileIOBuffer(const AsyncFileIO* io, int buffer);
+
+// Submit the read of a whole file into the buffer or the write of size bytes
+// of the buffer to a new file. Return false, with the buffer still acquired,
+// if the file can not be opened or does not fit into the buffer.
+bool SubmitFileRead(AsyncFileIO* io, int buffer, const char* path, void* user);
+bool SubmitFileWrite(AsyncFileIO* io, int buffer, const char* path, size_t size, void* user);
+
+// Waits for the next completed request, in any order. Returns false if no
+// request is in flight.
+bool WaitFileIO(AsyncFileIO* io, FileIOCompletion* completion);
+
+#endif // ASYNCFILEIO_H
@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "FrameSource.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Bytes of one frame in the RgbImage layout.
+static long GetFrameSizeInBytes(const FrameSource* source, long height)
+{
+    return (((source->numChannels * source->width + 3) >> 2) << 2) * height;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Decodes the next frame into frame->pixels. Returns false at the end of the
+// stream or on errors.
+static bool DecodeFrame(FrameSource* source, Frame* frame)
+{
+    frame->index = source->nextIndex++;
+
+    if (FRAME_SOURCE_BMP_SEQUENCE == source->type)
+    {
+        char filePath[1100];
+        long numRows = 0;
+        long numCols = 0;
+
+        snprintf(filePath, sizeof(filePath), source->path, frame->index);
+
+        // A missing file is the regular end of the sequence
+        if (0 != access(filePath, R_OK))
+            return false;
+        if (!RgbImage::ReadImageFileSize(filePath, &numRows, &numCols))
+            return false;
+
+        if (numRows != source->height || numCols != source->width)
+        {
+            printf("\n%s is %ldx%ld pixels instead of %ldx%ld, ending the sequence", filePath, numCols, numRows, source->width, source->height);
+            return false;
+        }
+
+        return frame->image.LoadImageFile(filePath, frame->pixels, GetFrameSizeInBytes(source, source->height), source->numChannels);
+    }
+
+    // Raw frames are stored top-down without padding
+    long bytesPerRow = GetFrameSizeInBytes(source, 1);
+    long pixelBytesPerRow = source->numChannels * source->width;
+    for (long row = source->height - 1; row >= 0; row--)
+    {
+        unsigned char* dst = frame->pixels + row * bytesPerRow;
+        if (fread(dst, source->numChannels, source->width, source->rawFile) != (size_t)source->width)
+        {
+            if (row != source->height - 1)
+                printf("\nIncomplete frame %ld in %s", frame->index, source->path);
+            return false;
+        }
+        memset(dst + pixelBytesPerRow, 0, bytesPerRow - pixelBytesPerRow);
+    }
+    frame->image.AttachImageData(frame->pixels, source->height, source->width, source->numChannels);
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Decoder thread: takes free frames, decodes into them and queues them.
+static void* FrameSourceMain(void* arg)
+{
+    FrameSource* source = (FrameSource*)arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&source->lock);
+        while (0 == source->numFreeFrames && !source->stop)
+        {
+            source->decoderWaits++;
+            pthread_cond_wait(&source->frameFree, &source->lock);
+        }
+        if (source->stop)
+        {
+            pthread_mutex_unlock(&source->lock);
+            break;
+        }
+        Frame* frame = source->freeFrames[--source->numFreeFrames];
+        pthread_mutex_unlock(&source->lock);
+
+        // Decoding runs without the lock
+        bool decoded = DecodeFrame(source, frame);
+
+        pthread_mutex_lock(&source->lock);
+        if (decoded)
+        {
+            source->readyFrames[(source->firstReady + source->numReady) % MAX_QUEUED_FRAMES] = frame;
+            source->numReady++;
+        }
+        else
+        {
+            source->freeFrames[source->numFreeFrames++] = frame;
+            source->endOfStream = true;
+        }
+        pthread_cond_signal(&source->frameReady);
+        pthread_mutex_unlock(&source->lock);
+
+        if (!decoded)
+            break;
+    }
+
+    return NULL;
+}
+
+static void FreeFrames(FrameSource* source)
+{
+    for (int i = 0; i < source->numFrames; i++)
+    {
+        source->frames[i].image.Reset();
+        free(source->frames[i].pixels);
+        source->frames[i].pixels = NULL;
+    }
+    source->numFrames = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocates the frame buffers and starts the decoder thread.
+static bool StartFrameSource(FrameSource* source, int numFrames)
+{
+    long sizeInBytes = GetFrameSizeInBytes(source, source->height);
+
+    if (numFrames < 1)
+        numFrames = 1;
+    if (numFrames > MAX_QUEUED_FRAMES)
+        numFrames = MAX_QUEUED_FRAMES;
+
+    source->numFrames = 0;
+    source->numFreeFrames = 0;
+    source->firstReady = 0;
+    source->numReady = 0;
+    source->endOfStream = false;
+    source->stop = false;
+    source->decoderWaits = 0;
+    source->consumerWaits = 0;
+
+    for (int i = 0; i < numFrames; i++)
+    {
+        Frame* frame = &source->frames[i];
+        frame->pixels = (unsigned char*)malloc(sizeInBytes);
+        if (!frame->pixels)
+        {
+            printf("\nUnable to allocate %d frames of %ldx%ld pixels", numFrames, source->width, source->height);
+            FreeFrames(source);
+            return false;
+        }
+        frame->index = -1;
+        source->freeFrames[source->numFreeFrames++] = frame;
+        source->numFrames++;
+    }
+
+    pthread_mutex_init(&source->lock, NULL);
+    pthread_cond_init(&source->frameReady, NULL);
+    pthread_cond_init(&source->frameFree, NULL);
+
+    if (0 != pthread_create(&source->thread, NULL, FrameSourceMain, source))
+    {
+        printf("\nUnable to start the frame decoder thread");
+        pthread_mutex_destroy(&source->lock);
+        pthread_cond_destroy(&source->frameReady);
+        pthread_cond_destroy(&source->frameFree);
+        FreeFrames(source);
+        return false;
+    }
+
+    return true;
+}
+
+static void ClearFrameSource(FrameSource* source)
+{
+    source->rawFile = NULL;
+    source->numFrames = 0;
+    source->stop = true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool OpenBmpSequence(FrameSource* source, const char* pattern, long firstIndex, int numFrames, int numChannels)
+{
+    char filePath[1100];
+
+    ClearFrameSource(source);
+    source->type = FRAME_SOURCE_BMP_SEQUENCE;
+    source->numChannels = numChannels;
+    strncpy(source->path, pattern, sizeof(source->path) - 1);
+    source->path[sizeof(source->path) - 1] = 0;
+    source->nextIndex = firstIndex;
+
+    snprintf(filePath, sizeof(filePath), pattern, firstIndex);
+    if (!RgbImage::ReadImageFileSize(filePath, &source->height, &source->width))
+    {
+        printf("\nUnable to read the first frame %s", filePath);
+        return false;
+    }
+
+    return StartFrameSource(source, numFrames);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool OpenRawFrameFile(FrameSource* source, const char* path, long width, long height, int numFrames, int numChannels)
+{
+    ClearFrameSource(source);
+    source->type = FRAME_SOURCE_RAW_FILE;
+    source->numChannels = numChannels;
+    strncpy(source->path, path, sizeof(source->path) - 1);
+    source->path[sizeof(source->path) - 1] = 0;
+    source->nextIndex = 0;
+    source->width = width;
+    source->height = height;
+
+    if (width <= 0 || height <= 0)
+    {
+        printf("\nInvalid raw frame size %ldx%ld", width, height);
+        return false;
+    }
+
+    source->rawFile = fopen(path, "rb");
+    if (!source->rawFile)
+    {
+        printf("\nUnable to open %s", path);
+        return false;
+    }
+
+    // Large stdio buffer: frames are read sequentially
+    setvbuf(source->rawFile, NULL, _IOFBF, 1 << 20);
+
+    return StartFrameSource(source, numFrames);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+Frame* AcquireFrame(FrameSource* source)
+{
+    Frame* frame = NULL;
+
+    if (0 == source->numFrames)
+        return NULL;
+
+    pthread_mutex_lock(&source->lock);
+    while (0 == source->numReady && !source->endOfStream)
+    {
+        source->consumerWaits++;
+        pthread_cond_wait(&source->frameReady, &source->lock);
+    }
+    if (source->numReady > 0)
+    {
+        frame = source->readyFrames[source->firstReady];
+        source->firstReady = (source->firstReady + 1) % MAX_QUEUED_FRAMES;
+        source->numReady--;
+    }
+    pthread_mutex_unlock(&source->lock);
+
+    return frame;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ReleaseFrame(FrameSource* source, Frame* frame)
+{
+    if (!frame)
+        return;
+
+    pthread_mutex_lock(&source->lock);
+    source->freeFrames[source->numFreeFrames++] = frame;
+    pthread_cond_signal(&source->frameFree);
+    pthread_mutex_unlock(&source->lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void CloseFrameSource(FrameSource* source)
+{
+    if (source->numFrames > 0)
+    {
+        pthread_mutex_lock(&source->lock);
+        source->stop = true;
+        pthread_cond_signal(&source->frameFree);
+        pthread_mutex_unlock(&source->lock);
+
+        pthread_join(source->thread, NULL);
+        pthread_mutex_destroy(&source->lock);
+        pthread_cond_destroy(&source->frameReady);
+        pthread_cond_destroy(&source->frameFree);
+    }
+
+    FreeFrames(source);
+
+    if (source->rawFile)
+        fclose(source->rawFile);
+    ClearFrameSource(source);
+}
@@ -0,0 +1,84 @@
+#ifndef FRAMESOURCE_H
+#define FRAMESOURCE_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include "RgbImage.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Streaming input of frame sequences. A background thread decodes frames into
+// a fixed set of pre-allocated frame buffers and queues them for the consumer.
+// When all buffers are queued or in use the decoder waits for the consumer to
+// release one, so a slow device throttles decoding instead of growing memory.
+//
+// Two inputs are supported:
+//  - numbered BMP or QOI files named by a printf pattern, e.g.
+//    "frames/%05d.qoi", read from the first number until a file is missing
+//  - a raw file of packed, top-down RGB24 (or gray8) frames of a given size
+//
+// Frames are delivered in the RgbImage layout: bottom-up rows of RGB (or with
+// numChannels 1 gray) pixels padded to 4 bytes, so frame->image can be passed
+// wherever the filter expects an RgbImage.
+#define MAX_QUEUED_FRAMES 8
+
+typedef enum
+{
+    FRAME_SOURCE_BMP_SEQUENCE,
+    FRAME_SOURCE_RAW_FILE
+} FrameSourceType;
+
+typedef struct
+{
+    RgbImage image;             // wraps pixels, which the source owns
+    unsigned char* pixels;
+    long index;                 // number of the frame in the sequence
+} Frame;
+
+typedef struct
+{
+    FrameSourceType type;
+    char path[1024];            // BMP file pattern or raw file path
+    FILE* rawFile;
+    long width;
+    long height;
+    int numChannels;            // 3 for RGB, 1 for gray frames
+    long nextIndex;             // index of the next frame to decode
+
+    Frame frames[MAX_QUEUED_FRAMES];
+    int numFrames;
+    Frame* freeFrames[MAX_QUEUED_FRAMES];
+    int numFreeFrames;
+    Frame* readyFrames[MAX_QUEUED_FRAMES];  // ring of decoded frames
+    int firstReady;
+    int numReady;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t frameReady;  // signalled when a frame is queued or at end
+    pthread_cond_t frameFree;   // signalled when the consumer returns a frame
+    bool endOfStream;
+    bool stop;
+
+    long decoderWaits;          // times the decoder blocked on a full queue
+    long consumerWaits;         // times the consumer blocked on an empty queue
+} FrameSource;
+
+// Opens a sequence of numbered BMP or QOI files and starts decoding. The size of the
+// first file sets the frame size, a file of another size ends the stream.
+// With numChannels 1 the files are loaded as gray images.
+bool OpenBmpSequence(FrameSource* source, const char* pattern, long firstIndex, int numFrames, int numChannels);
+
+// Opens a raw file of width x height RGB24 (numChannels 3) or gray8
+// (numChannels 1) frames and starts decoding.
+bool OpenRawFrameFile(FrameSource* source, const char* path, long width, long height, int numFrames, int numChannels);
+
+// Returns the next decoded frame, blocking until one is available, or NULL at
+// the end of the stream. Every frame must be returned with ReleaseFrame.
+Frame* AcquireFrame(FrameSource* source);
+
+void ReleaseFrame(FrameSource* source, Frame* frame);
+
+// Stops the decoder and frees the frame buffers.
+void CloseFrameSource(FrameSource* source);
+
+#endif // FRAMESOURCE_H
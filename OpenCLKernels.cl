@@ -3,21 +3,106 @@
  * www.streamcomputing.eu
  ******************************************************************************/
 
+// Filter radius, the weights are a (FILTER_SIZE*2 + 1)^2 matrix. The host can
+// override it in the build options.
+#ifndef FILTER_SIZE
 #define FILTER_SIZE 1
+#endif
+
+// With FILTER_CROSS only the taps of the centre row and column are read and
+// weighted, the corner weights are ignored: 4*FILTER_SIZE + 1 taps instead
+// of (FILTER_SIZE*2 + 1)^2, for the degraded filter of the real-time mode.
+#ifdef FILTER_CROSS
+#define FILTER_TAP(x, y) ((x) == 0 || (y) == 0)
+#else
+#define FILTER_TAP(x, y) 1
+#endif
+
+// Number of horizontally adjacent output pixels computed by one work-item of
+// FilterRow. Normally set by the host through the build options.
+#ifndef PIXELS_PER_WI
+#define PIXELS_PER_WI 4
+#endif
 
 #pragma OPENCL EXTENSION cl_khr_byte_addressable_store : enable
 #pragma OPENCL EXTENSION CL_KHR_gl_sharing : enable
- 
-__constant sampler_t sampler =
-  CLK_NORMALIZED_COORDS_FALSE
-| CLK_ADDRESS_CLAMP_TO_EDGE
-| CLK_FILTER_NEAREST;
 
 inline float FilterValue (__constant const float* filterWeights, const int x, const int y)
 {
 	return filterWeights[(x+FILTER_SIZE) + (y+FILTER_SIZE)*(FILTER_SIZE*2 + 1)];
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Optional colour stages of the float filter kernels, selected by the host in
+// the build options. They run in registers around the convolution instead of
+// as separate passes:
+//  - LINEARIZE_SRGB: texels are decoded from sRGB to linear light before they
+//    are weighted and the sum is encoded to sRGB again
+//  - OUTPUT_YCBCR: the result is converted to full range BT.601 Y'CbCr
+//  - OUTPUT_LUMINANCE: the result is reduced to BT.709 luma in the first
+//    channel, the buffer kernels then write a single byte per pixel
+// PRE_STAGE and POST_STAGE work on normalized values, the _UNORM8 variants on
+// the 0-255 values of the buffer kernels. Without stages all are no-ops.
+inline float4 SrgbToLinear (const float4 c)
+{
+    const float3 rgb = select(powr((c.xyz + 0.055f) / 1.055f, (float3)(2.4f)), c.xyz / 12.92f, isless(c.xyz, (float3)(0.04045f)));
+    return (float4)(rgb, c.w);
+}
+
+inline float4 LinearToSrgb (const float4 c)
+{
+    const float3 rgb = max(c.xyz, 0.0f);
+    return (float4)(select(1.055f * powr(rgb, (float3)(1.0f / 2.4f)) - 0.055f, rgb * 12.92f, isless(rgb, (float3)(0.0031308f))), c.w);
+}
+
+inline float4 RgbToYCbCr (const float4 c)
+{
+    return (float4)(dot(c.xyz, (float3)(0.299f, 0.587f, 0.114f)),
+                    dot(c.xyz, (float3)(-0.168736f, -0.331264f, 0.5f)) + 0.5f,
+                    dot(c.xyz, (float3)(0.5f, -0.418688f, -0.081312f)) + 0.5f,
+                    c.w);
+}
+
+inline float4 RgbToLuminance (const float4 c)
+{
+    const float luma = dot(c.xyz, (float3)(0.2126f, 0.7152f, 0.0722f));
+    return (float4)(luma, luma, luma, c.w);
+}
+
+#ifdef LINEARIZE_SRGB
+#define PRE_STAGE(c) SrgbToLinear(c)
+#define ENCODE_STAGE(c) LinearToSrgb(c)
+#else
+#define PRE_STAGE(c) (c)
+#define ENCODE_STAGE(c) (c)
+#endif
+
+#if defined(OUTPUT_LUMINANCE)
+#define POST_STAGE(c) RgbToLuminance(ENCODE_STAGE(c))
+#elif defined(OUTPUT_YCBCR)
+#define POST_STAGE(c) RgbToYCbCr(ENCODE_STAGE(c))
+#else
+#define POST_STAGE(c) ENCODE_STAGE(c)
+#endif
+
+#if defined(LINEARIZE_SRGB) || defined(OUTPUT_LUMINANCE) || defined(OUTPUT_YCBCR)
+#define PRE_STAGE_UNORM8(c) (PRE_STAGE((c) * (1.0f / 255.0f)) * 255.0f)
+#define POST_STAGE_UNORM8(c) (POST_STAGE((c) * (1.0f / 255.0f)) * 255.0f)
+#else
+#define PRE_STAGE_UNORM8(c) (c)
+#define POST_STAGE_UNORM8(c) (c)
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Image based kernels. Only compiled for devices with image support, the
+// buffer based kernels below are used otherwise.
+#ifdef __IMAGE_SUPPORT__
+ 
+__constant sampler_t sampler =
+  CLK_NORMALIZED_COORDS_FALSE
+| CLK_ADDRESS_CLAMP_TO_EDGE
+| CLK_FILTER_NEAREST;
+
 __kernel void Filter (__read_only image2d_t input,
 					  __constant float* filterWeights,
 					  __write_only image2d_t output)
@@ -28,9 +113,430 @@ __kernel void Filter (__read_only image2d_t input,
     float4 sum = (float4)(0.0f);
     for(int y = -FILTER_SIZE; y <= FILTER_SIZE; y++) {
         for(int x = -FILTER_SIZE; x <= FILTER_SIZE; x++) {
-            sum += FilterValue(filterWeights, x, y) * read_imagef(input, sampler, pos + (int2)(x,y));
+            if (!FILTER_TAP(x, y))
+                continue;
+            sum += FilterValue(filterWeights, x, y) * PRE_STAGE(read_imagef(input, sampler, pos + (int2)(x,y)));
+        }
+    }
+
+    write_imagef (output, (int2)(pos.x, pos.y), POST_STAGE(sum));
+}
+
+// Same convolution as Filter, but each work-item produces PIXELS_PER_WI
+// adjacent pixels of a row. Every input row of the footprint is walked once
+// with a sliding window of FILTER_SIZE*2 + 1 texels kept in registers, so the
+// texels shared by neighbouring outputs are loaded only once.
+__kernel void FilterRow (__read_only image2d_t input,
+						 __constant float* filterWeights,
+						 __write_only image2d_t output)
+{
+    const int x0 = get_global_id(0) * PIXELS_PER_WI;
+    const int y = get_global_id(1);
+    const int width = get_image_width(output);
+
+    float4 sum[PIXELS_PER_WI];
+    for(int i = 0; i < PIXELS_PER_WI; i++) {
+        sum[i] = (float4)(0.0f);
+    }
+
+    for(int dy = -FILTER_SIZE; dy <= FILTER_SIZE; dy++) {
+#ifdef FILTER_CROSS
+        // Off the centre row only the texels of the centre column are read
+        if (dy != 0) {
+            for(int i = 0; i < PIXELS_PER_WI; i++) {
+                sum[i] += FilterValue(filterWeights, 0, dy) * PRE_STAGE(read_imagef(input, sampler, (int2)(x0 + i, y + dy)));
+            }
+            continue;
+        }
+#endif
+        float4 window[FILTER_SIZE*2 + 1];
+
+        // Preload the left part of the window
+        for(int i = 0; i < FILTER_SIZE*2; i++) {
+            window[i] = PRE_STAGE(read_imagef(input, sampler, (int2)(x0 - FILTER_SIZE + i, y + dy)));
+        }
+
+        for(int i = 0; i < PIXELS_PER_WI; i++) {
+            window[FILTER_SIZE*2] = PRE_STAGE(read_imagef(input, sampler, (int2)(x0 + i + FILTER_SIZE, y + dy)));
+
+            for(int dx = -FILTER_SIZE; dx <= FILTER_SIZE; dx++) {
+                sum[i] += FilterValue(filterWeights, dx, dy) * window[dx + FILTER_SIZE];
+            }
+
+            // Slide the window one texel to the right
+            for(int j = 0; j < FILTER_SIZE*2; j++) {
+                window[j] = window[j + 1];
+            }
+        }
+    }
+
+    for(int i = 0; i < PIXELS_PER_WI; i++) {
+        if (x0 + i < width) {
+            write_imagef (output, (int2)(x0 + i, y), POST_STAGE(sum[i]));
+        }
+    }
+}
+
+// Single channel variant of Filter for CL_R images (8-bit gray input). Only
+// the first channel is read and accumulated; the colour stages see the gray
+// value in all three colour channels. The result is written to every colour
+// channel, so RGBA and single channel outputs both receive the gray value.
+__kernel void FilterGray (__read_only image2d_t input,
+						  __constant float* filterWeights,
+						  __write_only image2d_t output)
+{
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+
+    float sum = 0.0f;
+    for(int y = -FILTER_SIZE; y <= FILTER_SIZE; y++) {
+        for(int x = -FILTER_SIZE; x <= FILTER_SIZE; x++) {
+            if (!FILTER_TAP(x, y))
+                continue;
+            sum += FilterValue(filterWeights, x, y) * PRE_STAGE((float4)(read_imagef(input, sampler, pos + (int2)(x,y)).x)).x;
+        }
+    }
+
+    const float gray = POST_STAGE((float4)(sum)).x;
+    write_imagef (output, pos, (float4)(gray, gray, gray, 1.0f));
+}
+
+// Builds the next level of an image pyramid with a Gaussian prefilter: the
+// 2x2 block of input pixels is widened to a 4x4 footprint weighted with the
+// separable binomial [1 3 3 1] / 8, which suppresses aliasing much better
+// than a 2x2 box filter.
+__kernel void DownsampleGaussian (__read_only image2d_t input,
+								  __write_only image2d_t output)
+{
+    const float weights[4] = {0.125f, 0.375f, 0.375f, 0.125f};
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+
+    if (pos.x >= get_image_width(output) || pos.y >= get_image_height(output))
+        return;
+
+    const int2 src = pos * 2;
+    float4 sum = (float4)(0.0f);
+    for(int y = -1; y <= 2; y++) {
+        for(int x = -1; x <= 2; x++) {
+            sum += weights[y + 1] * weights[x + 1] * read_imagef(input, sampler, src + (int2)(x, y));
+        }
+    }
+
+    write_imagef (output, pos, sum);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Kernels for YUV 4:2:0 frames with the planes in separate images: luma as a
+// CL_R image, chroma at half resolution either as two CL_R images (planar
+// I420) or one interleaved CL_RG image (NV12). Every work-item handles one
+// chroma sample and the 2x2 luma block it covers. The luma footprint of the
+// block is loaded once into registers and shared by the four outputs. Chroma
+// is filtered at its native resolution when filterChroma is set and copied
+// otherwise.
+#define LUMA_SPAN (FILTER_SIZE*2 + 2)
+
+inline void FilterLumaBlock (__read_only image2d_t inputY,
+							 __constant float* filterWeights,
+							 __write_only image2d_t outputY,
+							 const int2 block)
+{
+    float window[LUMA_SPAN][LUMA_SPAN];
+    for(int y = 0; y < LUMA_SPAN; y++) {
+        for(int x = 0; x < LUMA_SPAN; x++) {
+            window[y][x] = read_imagef(inputY, sampler, block + (int2)(x - FILTER_SIZE, y - FILTER_SIZE)).x;
+        }
+    }
+
+    for(int i = 0; i < 4; i++) {
+        const int bx = i & 1;
+        const int by = i >> 1;
+        float sum = 0.0f;
+        for(int y = -FILTER_SIZE; y <= FILTER_SIZE; y++) {
+            for(int x = -FILTER_SIZE; x <= FILTER_SIZE; x++) {
+                if (!FILTER_TAP(x, y))
+                    continue;
+                sum += FilterValue(filterWeights, x, y) * window[by + y + FILTER_SIZE][bx + x + FILTER_SIZE];
+            }
+        }
+        write_imagef (outputY, block + (int2)(bx, by), (float4)(sum, 0.0f, 0.0f, 1.0f));
+    }
+}
+
+inline float4 FilterChroma (__read_only image2d_t input,
+							__constant float* filterWeights,
+							const int2 pos,
+							const int filterChroma)
+{
+    if (!filterChroma)
+        return read_imagef(input, sampler, pos);
+
+    float4 sum = (float4)(0.0f);
+    for(int y = -FILTER_SIZE; y <= FILTER_SIZE; y++) {
+        for(int x = -FILTER_SIZE; x <= FILTER_SIZE; x++) {
+            if (!FILTER_TAP(x, y))
+                continue;
+            sum += FilterValue(filterWeights, x, y) * read_imagef(input, sampler, pos + (int2)(x, y));
+        }
+    }
+    return sum;
+}
+
+__kernel void FilterYUV420 (__read_only image2d_t inputY,
+							__read_only image2d_t inputU,
+							__read_only image2d_t inputV,
+							__constant float* filterWeights,
+							__write_only image2d_t outputY,
+							__write_only image2d_t outputU,
+							__write_only image2d_t outputV,
+							const int filterChroma)
+{
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+
+    if (pos.x >= get_image_width(outputU) || pos.y >= get_image_height(outputU))
+        return;
+
+    FilterLumaBlock(inputY, filterWeights, outputY, pos * 2);
+    write_imagef (outputU, pos, FilterChroma(inputU, filterWeights, pos, filterChroma));
+    write_imagef (outputV, pos, FilterChroma(inputV, filterWeights, pos, filterChroma));
+}
+
+__kernel void FilterNV12 (__read_only image2d_t inputY,
+						  __read_only image2d_t inputUV,
+						  __constant float* filterWeights,
+						  __write_only image2d_t outputY,
+						  __write_only image2d_t outputUV,
+						  const int filterChroma)
+{
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+
+    if (pos.x >= get_image_width(outputUV) || pos.y >= get_image_height(outputUV))
+        return;
+
+    FilterLumaBlock(inputY, filterWeights, outputY, pos * 2);
+    write_imagef (outputUV, pos, FilterChroma(inputUV, filterWeights, pos, filterChroma));
+}
+
+#endif // __IMAGE_SUPPORT__
+
+///////////////////////////////////////////////////////////////////////////////
+// Buffer based kernels for devices without image support. Pixels are stored
+// as packed 8-bit channels in linear buffers, clamp-to-edge addressing is done
+// explicitly. The output is RGBA with a pitch of outputWidth pixels, packed
+// RGB when the host builds with -DOUTPUT_RGB (e.g. for raw RGB24 streams) or
+// a single channel with OUTPUT_LUMINANCE. The colour stages are only applied
+// by the float kernels, the fixed-point kernels below ignore them.
+#if defined(OUTPUT_LUMINANCE)
+#define OUTPUT_PIXEL uchar
+#define STORE_PIXEL(value, index, output) ((output)[index] = (value).x)
+#elif defined(OUTPUT_RGB)
+#define OUTPUT_PIXEL uchar
+#define STORE_PIXEL(value, index, output) vstore3((value).xyz, (index), (output))
+#else
+#define OUTPUT_PIXEL uchar4
+#define STORE_PIXEL(value, index, output) ((output)[index] = (value))
+#endif
+
+// Input is packed RGB (uchar3) with rows inputPitch bytes apart, which is the
+// layout of RgbImage::ImageData().
+__kernel void FilterBufferRGB (__global const uchar* input,
+							   const int inputWidth,
+							   const int inputHeight,
+							   const int inputPitch,
+							   __constant float* filterWeights,
+							   __global OUTPUT_PIXEL* output,
+							   const int outputWidth,
+							   const int outputHeight)
+{
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+
+    if (pos.x >= outputWidth || pos.y >= outputHeight)
+        return;
+
+    float3 sum = (float3)(0.0f);
+    for(int y = -FILTER_SIZE; y <= FILTER_SIZE; y++) {
+        const int row = clamp(pos.y + y, 0, inputHeight - 1);
+        __global const uchar* rowPtr = input + row * inputPitch;
+        for(int x = -FILTER_SIZE; x <= FILTER_SIZE; x++) {
+            if (!FILTER_TAP(x, y))
+                continue;
+            const int col = clamp(pos.x + x, 0, inputWidth - 1);
+            sum += FilterValue(filterWeights, x, y) * PRE_STAGE_UNORM8((float4)(convert_float3(vload3(col, rowPtr)), 255.0f)).xyz;
+        }
+    }
+
+    sum = POST_STAGE_UNORM8((float4)(sum, 255.0f)).xyz;
+    STORE_PIXEL((uchar4)(convert_uchar3_sat_rte(sum), 255), pos.y * outputWidth + pos.x, output);
+}
+
+// Input is packed RGBA (uchar4) with a pitch of inputWidth pixels.
+__kernel void FilterBufferRGBA (__global const uchar4* input,
+								const int inputWidth,
+								const int inputHeight,
+								__constant float* filterWeights,
+								__global OUTPUT_PIXEL* output,
+								const int outputWidth,
+								const int outputHeight)
+{
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+
+    if (pos.x >= outputWidth || pos.y >= outputHeight)
+        return;
+
+    float4 sum = (float4)(0.0f);
+    for(int y = -FILTER_SIZE; y <= FILTER_SIZE; y++) {
+        __global const uchar4* rowPtr = input + clamp(pos.y + y, 0, inputHeight - 1) * inputWidth;
+        for(int x = -FILTER_SIZE; x <= FILTER_SIZE; x++) {
+            if (!FILTER_TAP(x, y))
+                continue;
+            sum += FilterValue(filterWeights, x, y) * PRE_STAGE_UNORM8(convert_float4(rowPtr[clamp(pos.x + x, 0, inputWidth - 1)]));
+        }
+    }
+
+    STORE_PIXEL(convert_uchar4_sat_rte(POST_STAGE_UNORM8(sum)), pos.y * outputWidth + pos.x, output);
+}
+
+// Input is 8-bit gray with rows inputPitch bytes apart (RgbImage::ImageData()
+// of a single channel image), the output one byte per pixel independent of
+// OUTPUT_RGB and OUTPUT_LUMINANCE.
+__kernel void FilterBufferGray (__global const uchar* input,
+								const int inputWidth,
+								const int inputHeight,
+								const int inputPitch,
+								__constant float* filterWeights,
+								__global uchar* output,
+								const int outputWidth,
+								const int outputHeight)
+{
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+
+    if (pos.x >= outputWidth || pos.y >= outputHeight)
+        return;
+
+    float sum = 0.0f;
+    for(int y = -FILTER_SIZE; y <= FILTER_SIZE; y++) {
+        __global const uchar* rowPtr = input + clamp(pos.y + y, 0, inputHeight - 1) * inputPitch;
+        for(int x = -FILTER_SIZE; x <= FILTER_SIZE; x++) {
+            if (!FILTER_TAP(x, y))
+                continue;
+            sum += FilterValue(filterWeights, x, y) * PRE_STAGE_UNORM8((float4)(convert_float(rowPtr[clamp(pos.x + x, 0, inputWidth - 1)]))).x;
         }
     }
 
-    write_imagef (output, (int2)(pos.x, pos.y), sum);
-}
\ No newline at end of file
+    output[pos.y * outputWidth + pos.x] = convert_uchar_sat_rte(POST_STAGE_UNORM8((float4)(sum)).x);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fixed-point variants of the buffer based kernels, used when every filter
+// weight is an integer scaled by a power of two (e.g. the binomial kernels).
+// Pixels stay 8-bit, products are accumulated as FIXED_ACCUM integers with the
+// integer weights and the sum is normalized with a rounding right shift.
+// The host selects ushort when the accumulation can not overflow 16 bits and
+// int otherwise (large or negative weights).
+#ifndef FIXED_ACCUM
+#define FIXED_ACCUM int
+#endif
+
+#define VEC_TYPE_(type, n) type##n
+#define VEC_TYPE(type, n) VEC_TYPE_(type, n)
+#define ACCUM4 VEC_TYPE(FIXED_ACCUM, 4)
+#define CONVERT_ACCUM4 VEC_TYPE(convert_, ACCUM4)
+
+inline FIXED_ACCUM FixedFilterValue (__constant const int* filterWeights, const int x, const int y)
+{
+	return (FIXED_ACCUM)filterWeights[(x+FILTER_SIZE) + (y+FILTER_SIZE)*(FILTER_SIZE*2 + 1)];
+}
+
+inline uchar4 FixedNormalize (const ACCUM4 sum, const int shift)
+{
+    const FIXED_ACCUM rounding = (shift > 0) ? (FIXED_ACCUM)(1 << (shift - 1)) : (FIXED_ACCUM)0;
+    return convert_uchar4_sat((sum + rounding) >> (ACCUM4)shift);
+}
+
+// Input is packed RGB (uchar3) with rows inputPitch bytes apart.
+__kernel void FilterBufferRGBFixed (__global const uchar* input,
+									const int inputWidth,
+									const int inputHeight,
+									const int inputPitch,
+									__constant int* filterWeights,
+									__global OUTPUT_PIXEL* output,
+									const int outputWidth,
+									const int outputHeight,
+									const int shift)
+{
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+
+    if (pos.x >= outputWidth || pos.y >= outputHeight)
+        return;
+
+    ACCUM4 sum = (ACCUM4)(0);
+    for(int y = -FILTER_SIZE; y <= FILTER_SIZE; y++) {
+        __global const uchar* rowPtr = input + clamp(pos.y + y, 0, inputHeight - 1) * inputPitch;
+        for(int x = -FILTER_SIZE; x <= FILTER_SIZE; x++) {
+            if (!FILTER_TAP(x, y))
+                continue;
+            const uchar4 pixel = (uchar4)(vload3(clamp(pos.x + x, 0, inputWidth - 1), rowPtr), 0);
+            sum += FixedFilterValue(filterWeights, x, y) * CONVERT_ACCUM4(pixel);
+        }
+    }
+
+    uchar4 result = FixedNormalize(sum, shift);
+    result.w = 255;
+    STORE_PIXEL(result, pos.y * outputWidth + pos.x, output);
+}
+
+// Input is packed RGBA (uchar4) with a pitch of inputWidth pixels.
+__kernel void FilterBufferRGBAFixed (__global const uchar4* input,
+									 const int inputWidth,
+									 const int inputHeight,
+									 __constant int* filterWeights,
+									 __global OUTPUT_PIXEL* output,
+									 const int outputWidth,
+									 const int outputHeight,
+									 const int shift)
+{
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+
+    if (pos.x >= outputWidth || pos.y >= outputHeight)
+        return;
+
+    ACCUM4 sum = (ACCUM4)(0);
+    for(int y = -FILTER_SIZE; y <= FILTER_SIZE; y++) {
+        __global const uchar4* rowPtr = input + clamp(pos.y + y, 0, inputHeight - 1) * inputWidth;
+        for(int x = -FILTER_SIZE; x <= FILTER_SIZE; x++) {
+            if (!FILTER_TAP(x, y))
+                continue;
+            sum += FixedFilterValue(filterWeights, x, y) * CONVERT_ACCUM4(rowPtr[clamp(pos.x + x, 0, inputWidth - 1)]);
+        }
+    }
+
+    STORE_PIXEL(FixedNormalize(sum, shift), pos.y * outputWidth + pos.x, output);
+}
+
+
+// Input is 8-bit gray with rows inputPitch bytes apart, one byte per pixel out.
+__kernel void FilterBufferGrayFixed (__global const uchar* input,
+									 const int inputWidth,
+									 const int inputHeight,
+									 const int inputPitch,
+									 __constant int* filterWeights,
+									 __global uchar* output,
+									 const int outputWidth,
+									 const int outputHeight,
+									 const int shift)
+{
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+
+    if (pos.x >= outputWidth || pos.y >= outputHeight)
+        return;
+
+    FIXED_ACCUM sum = 0;
+    for(int y = -FILTER_SIZE; y <= FILTER_SIZE; y++) {
+        __global const uchar* rowPtr = input + clamp(pos.y + y, 0, inputHeight - 1) * inputPitch;
+        for(int x = -FILTER_SIZE; x <= FILTER_SIZE; x++) {
+            if (!FILTER_TAP(x, y))
+                continue;
+            sum += FixedFilterValue(filterWeights, x, y) * (FIXED_ACCUM)rowPtr[clamp(pos.x + x, 0, inputWidth - 1)];
+        }
+    }
+
+    output[pos.y * outputWidth + pos.x] = FixedNormalize((ACCUM4)(sum), shift).x;
+}
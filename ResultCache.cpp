@@ -0,0 +1,535 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "ResultCache.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// MurmurHash3 x64 128 (Austin Appleby, public domain) with a 128-bit seed, so
+// that the parts of a key can be hashed one after the other.
+static inline uint64_t RotateLeft64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t MixFinal64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+void HashResultKey(ResultKey* key, const void* data, size_t size)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    const unsigned char* bytes = (const unsigned char*)data;
+    size_t numBlocks = size / 16;
+    uint64_t h1 = key->h1;
+    uint64_t h2 = key->h2;
+    uint64_t k1;
+    uint64_t k2;
+
+    for (size_t i = 0; i < numBlocks; i++)
+    {
+        memcpy(&k1, bytes + i * 16, 8);
+        memcpy(&k2, bytes + i * 16 + 8, 8);
+
+        k1 *= c1; k1 = RotateLeft64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = RotateLeft64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = RotateLeft64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = RotateLeft64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    // The tail, zero padded, gives the same values as the byte-wise switch
+    // of the reference implementation
+    unsigned char tail[16];
+    size_t tailSize = size & 15;
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, bytes + numBlocks * 16, tailSize);
+    memcpy(&k1, tail, 8);
+    memcpy(&k2, tail + 8, 8);
+    if (tailSize > 8)
+    {
+        k2 *= c2; k2 = RotateLeft64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    if (tailSize > 0)
+    {
+        k1 *= c1; k1 = RotateLeft64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = MixFinal64(h1);
+    h2 = MixFinal64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    key->h1 = h1;
+    key->h2 = h2;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Results in memory: a hash table of entries chained per bucket, and a list
+// from the most to the least recently used entry. The data follows the entry
+// in the same allocation.
+struct ResultCacheEntry
+{
+    ResultKey key;
+    size_t size;
+    ResultCacheEntry* nextInBucket;
+    ResultCacheEntry* newer;
+    ResultCacheEntry* older;
+};
+
+#define MIN_RESULT_CACHE_BUCKETS 256
+
+// Memory charged against the limit for an entry with size bytes of data: the
+// entry itself and two bucket slots, the most the table has per entry once
+// it has grown past its minimum size.
+static inline size_t GetEntryMemorySize(size_t size)
+{
+    return sizeof(ResultCacheEntry) + 2 * sizeof(ResultCacheEntry*) + size;
+}
+
+static inline unsigned char* GetEntryData(ResultCacheEntry* entry)
+{
+    return (unsigned char*)(entry + 1);
+}
+
+static inline bool KeysEqual(const ResultKey* a, const ResultKey* b)
+{
+    return a->h1 == b->h1 && a->h2 == b->h2;
+}
+
+static ResultCacheEntry** FindEntry(ResultCache* cache, const ResultKey* key)
+{
+    ResultCacheEntry** link = &cache->buckets[key->h1 & (cache->numBuckets - 1)];
+
+    while (*link && !KeysEqual(&(*link)->key, key))
+        link = &(*link)->nextInBucket;
+
+    return link;
+}
+
+static void UnlinkEntry(ResultCache* cache, ResultCacheEntry* entry)
+{
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        cache->newest = entry->older;
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        cache->oldest = entry->newer;
+}
+
+static void LinkNewest(ResultCache* cache, ResultCacheEntry* entry)
+{
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest)
+        cache->newest->newer = entry;
+    else
+        cache->oldest = entry;
+    cache->newest = entry;
+}
+
+static void RemoveOldestEntry(ResultCache* cache)
+{
+    ResultCacheEntry* entry = cache->oldest;
+    ResultCacheEntry** link = FindEntry(cache, &entry->key);
+
+    *link = entry->nextInBucket;
+    UnlinkEntry(cache, entry);
+    cache->memorySize -= GetEntryMemorySize(entry->size);
+    cache->numEntries--;
+    free(entry);
+}
+
+// Doubles the buckets once there are more entries than buckets.
+static void GrowBuckets(ResultCache* cache)
+{
+    size_t numBuckets = cache->numBuckets * 2;
+    ResultCacheEntry** buckets = (ResultCacheEntry**)calloc(numBuckets, sizeof(ResultCacheEntry*));
+
+    if (!buckets)
+        return;
+
+    for (size_t i = 0; i < cache->numBuckets; i++)
+    {
+        ResultCacheEntry* entry = cache->buckets[i];
+        while (entry)
+        {
+            ResultCacheEntry* next = entry->nextInBucket;
+            ResultCacheEntry** bucket = &buckets[entry->key.h1 & (numBuckets - 1)];
+            entry->nextInBucket = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->numBuckets = numBuckets;
+}
+
+static void StoreInMemory(ResultCache* cache, const ResultKey* key, const void* data, size_t size)
+{
+    if (GetEntryMemorySize(size) > cache->memoryLimit)
+        return;
+
+    ResultCacheEntry* entry = (ResultCacheEntry*)malloc(sizeof(ResultCacheEntry) + size);
+    if (!entry)
+        return;
+    entry->key = *key;
+    entry->size = size;
+    memcpy(GetEntryData(entry), data, size);
+
+    pthread_mutex_lock(&cache->lock);
+    if (*FindEntry(cache, key))
+    {
+        // Stored by another thread meanwhile
+        pthread_mutex_unlock(&cache->lock);
+        free(entry);
+        return;
+    }
+    while (cache->memorySize + GetEntryMemorySize(size) > cache->memoryLimit)
+        RemoveOldestEntry(cache);
+    if (cache->numEntries >= cache->numBuckets)
+        GrowBuckets(cache);
+
+    ResultCacheEntry** bucket = &cache->buckets[key->h1 & (cache->numBuckets - 1)];
+    entry->nextInBucket = *bucket;
+    *bucket = entry;
+    LinkNewest(cache, entry);
+    cache->memorySize += GetEntryMemorySize(size);
+    cache->numEntries++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Result files: a header of "FRES", the version, the size of the data and the
+// key, then the data.
+#define RESULT_FILE_VERSION 1
+#define RESULT_FILE_HEADER_SIZE 32
+
+// Temporary files not renamed for this long were left by writers that died
+#define STALE_TEMP_FILE_SECONDS 3600
+
+typedef struct
+{
+    struct timespec modified;
+    size_t size;
+    char name[40];
+} ResultFileInfo;
+
+static void GetResultFilePath(const ResultCache* cache, const ResultKey* key, char* path, size_t pathSize)
+{
+    snprintf(path, pathSize, "%s/%016llx%016llx.res", cache->directory, (unsigned long long)key->h1, (unsigned long long)key->h2);
+}
+
+static bool IsResultFileName(const char* name)
+{
+    size_t length = strlen(name);
+    return 36 == length && 0 == strcmp(name + 32, ".res");
+}
+
+// Temporary names are the result file name, the writer and ".tmp".
+static bool IsTempResultFileName(const char* name)
+{
+    size_t length = strlen(name);
+    return length > 40 && 0 == strncmp(name + 32, ".res.", 5) && 0 == strcmp(name + length - 4, ".tmp");
+}
+
+static bool ReadFully(int fd, void* buffer, size_t size, off_t offset)
+{
+    unsigned char* bytes = (unsigned char*)buffer;
+
+    while (size > 0)
+    {
+        ssize_t count = pread(fd, bytes, size, offset);
+        if (count < 0 && EINTR == errno)
+            continue;
+        if (count <= 0)
+            return false;
+        bytes += count;
+        size -= count;
+        offset += count;
+    }
+
+    return true;
+}
+
+static bool WriteFully(int fd, const void* buffer, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)buffer;
+
+    while (size > 0)
+    {
+        ssize_t count = write(fd, bytes, size);
+        if (count < 0 && EINTR == errno)
+            continue;
+        if (count <= 0)
+            return false;
+        bytes += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+static int CompareResultFiles(const void* a, const void* b)
+{
+    const struct timespec* timeA = &((const ResultFileInfo*)a)->modified;
+    const struct timespec* timeB = &((const ResultFileInfo*)b)->modified;
+    if (timeA->tv_sec != timeB->tv_sec)
+        return (timeA->tv_sec < timeB->tv_sec) ? -1 : 1;
+    return (timeA->tv_nsec < timeB->tv_nsec) ? -1 : ((timeA->tv_nsec > timeB->tv_nsec) ? 1 : 0);
+}
+
+// Sums the sizes of the result files and, if they exceed the limit, removes
+// the least recently used ones until 90% of the limit is left. Stale
+// temporary files are removed on the way.
+static void TrimResultDirectory(ResultCache* cache)
+{
+    time_t staleTime = time(NULL) - STALE_TEMP_FILE_SECONDS;
+    DIR* dir = opendir(cache->directory);
+    ResultFileInfo* files = NULL;
+    size_t numFiles = 0;
+    size_t capacity = 0;
+    size_t totalSize = 0;
+    char path[1100];
+
+    if (!dir)
+        return;
+
+    struct dirent* dirEntry;
+    while ((dirEntry = readdir(dir)) != NULL)
+    {
+        struct stat fileStat;
+        bool isTemp = IsTempResultFileName(dirEntry->d_name);
+        if (!isTemp && !IsResultFileName(dirEntry->d_name))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", cache->directory, dirEntry->d_name);
+        if (0 != stat(path, &fileStat))
+            continue;
+        if (isTemp)
+        {
+            if (fileStat.st_mtime < staleTime)
+                unlink(path);
+            continue;
+        }
+
+        if (numFiles == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            ResultFileInfo* grown = (ResultFileInfo*)realloc(files, capacity * sizeof(ResultFileInfo));
+            if (!grown)
+                break;
+            files = grown;
+        }
+        files[numFiles].modified = fileStat.st_mtim;
+        files[numFiles].size = fileStat.st_size;
+        strcpy(files[numFiles].name, dirEntry->d_name);
+        numFiles++;
+        totalSize += fileStat.st_size;
+    }
+    closedir(dir);
+
+    if (totalSize > cache->diskLimit)
+    {
+        size_t targetSize = cache->diskLimit / 10 * 9;
+        qsort(files, numFiles, sizeof(ResultFileInfo), CompareResultFiles);
+        for (size_t i = 0; i < numFiles && totalSize > targetSize; i++)
+        {
+            snprintf(path, sizeof(path), "%s/%s", cache->directory, files[i].name);
+            if (0 == unlink(path) || ENOENT == errno)
+                totalSize -= files[i].size;
+        }
+    }
+    free(files);
+
+    pthread_mutex_lock(&cache->lock);
+    cache->diskSize = totalSize;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static bool LoadFromDisk(ResultCache* cache, const ResultKey* key, void* output, size_t size)
+{
+    char path[1100];
+    unsigned char header[RESULT_FILE_HEADER_SIZE];
+    struct stat fileStat;
+
+    GetResultFilePath(cache, key, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    bool ok = 0 == fstat(fd, &fileStat) && (size_t)fileStat.st_size == RESULT_FILE_HEADER_SIZE + size
+        && ReadFully(fd, header, RESULT_FILE_HEADER_SIZE, 0);
+    if (ok)
+    {
+        uint32_t version;
+        uint64_t dataSize;
+        ResultKey fileKey;
+        memcpy(&version, header + 4, 4);
+        memcpy(&dataSize, header + 8, 8);
+        memcpy(&fileKey.h1, header + 16, 8);
+        memcpy(&fileKey.h2, header + 24, 8);
+        ok = 0 == memcmp(header, "FRES", 4) && RESULT_FILE_VERSION == version && dataSize == size && KeysEqual(&fileKey, key)
+            && ReadFully(fd, output, size, RESULT_FILE_HEADER_SIZE);
+    }
+
+    // The modification time orders the files for eviction
+    if (ok)
+        futimens(fd, NULL);
+    close(fd);
+
+    return ok;
+}
+
+static void StoreOnDisk(ResultCache* cache, const ResultKey* key, const void* data, size_t size)
+{
+    char path[1100];
+    char tempPath[1200];
+    unsigned char header[RESULT_FILE_HEADER_SIZE];
+    uint32_t version = RESULT_FILE_VERSION;
+    uint64_t dataSize = size;
+
+    if (RESULT_FILE_HEADER_SIZE + size > cache->diskLimit)
+        return;
+
+    memcpy(header, "FRES", 4);
+    memcpy(header + 4, &version, 4);
+    memcpy(header + 8, &dataSize, 8);
+    memcpy(header + 16, &key->h1, 8);
+    memcpy(header + 24, &key->h2, 8);
+
+    GetResultFilePath(cache, key, path, sizeof(path));
+    snprintf(tempPath, sizeof(tempPath), "%s.%d.%lx.tmp", path, (int)getpid(), (unsigned long)pthread_self());
+    int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return;
+
+    bool ok = WriteFully(fd, header, RESULT_FILE_HEADER_SIZE) && WriteFully(fd, data, size);
+    ok = (0 == close(fd)) && ok;
+    if (!ok || 0 != rename(tempPath, path))
+    {
+        unlink(tempPath);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->diskSize += RESULT_FILE_HEADER_SIZE + size;
+    bool overLimit = cache->diskSize > cache->diskLimit;
+    pthread_mutex_unlock(&cache->lock);
+
+    // Threads that find another one trimming go on
+    if (overLimit && 0 == pthread_mutex_trylock(&cache->evictLock))
+    {
+        TrimResultDirectory(cache);
+        pthread_mutex_unlock(&cache->evictLock);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool InitResultCache(ResultCache* cache, size_t memoryLimit, const char* directory, size_t diskLimit)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->memoryLimit = memoryLimit;
+    cache->diskLimit = diskLimit;
+    cache->numBuckets = MIN_RESULT_CACHE_BUCKETS;
+    cache->buckets = (ResultCacheEntry**)calloc(cache->numBuckets, sizeof(ResultCacheEntry*));
+    if (!cache->buckets)
+        return false;
+
+    if (directory && directory[0])
+    {
+        if (strlen(directory) >= sizeof(cache->directory) || (0 != mkdir(directory, 0755) && EEXIST != errno))
+        {
+            printf("\nUnable to use %s as the result cache directory", directory);
+            free(cache->buckets);
+            cache->buckets = NULL;
+            return false;
+        }
+        strcpy(cache->directory, directory);
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_mutex_init(&cache->evictLock, NULL);
+
+    if (cache->directory[0])
+        TrimResultDirectory(cache);
+
+    return true;
+}
+
+void ReleaseResultCache(ResultCache* cache)
+{
+    if (!cache->buckets)
+        return;
+
+    while (cache->oldest)
+        RemoveOldestEntry(cache);
+    free(cache->buckets);
+    cache->buckets = NULL;
+
+    pthread_mutex_destroy(&cache->lock);
+    pthread_mutex_destroy(&cache->evictLock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool LookupResult(ResultCache* cache, const ResultKey* key, void* output, size_t size)
+{
+    pthread_mutex_lock(&cache->lock);
+    ResultCacheEntry* entry = *FindEntry(cache, key);
+    if (entry && entry->size == size)
+    {
+        UnlinkEntry(cache, entry);
+        LinkNewest(cache, entry);
+        memcpy(output, GetEntryData(entry), size);
+        cache->memoryHits++;
+        pthread_mutex_unlock(&cache->lock);
+        return true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (cache->directory[0] && LoadFromDisk(cache, key, output, size))
+    {
+        StoreInMemory(cache, key, output, size);
+        pthread_mutex_lock(&cache->lock);
+        cache->diskHits++;
+        pthread_mutex_unlock(&cache->lock);
+        return true;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return false;
+}
+
+void StoreResult(ResultCache* cache, const ResultKey* key, const void* data, size_t size)
+{
+    StoreInMemory(cache, key, data, size);
+
+    if (cache->directory[0])
+        StoreOnDisk(cache, key, data, size);
+}
+
+void PrintResultCacheStats(const ResultCache* cache)
+{
+    printf("\nResult cache: %ld hits in memory, %ld on disk, %ld misses\n", cache->memoryHits, cache->diskHits, cache->misses);
+}
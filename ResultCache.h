@@ -0,0 +1,70 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Content-addressed cache of filter results. A result is found by a 128-bit
+// key hashed from everything it depends on: the input pixels and size, the
+// filter weights, the kernel source and build options and the output format.
+// A hit copies the stored result and skips the device work.
+//
+// Results are kept in memory up to a size limit, least recently used first
+// out, and optionally in a directory that is shared between runs and
+// processes, one file per key, also bounded in size: once it is exceeded the
+// files used longest ago (by modification time, which hits refresh) are
+// removed until 90% of the limit is left. Files are written to a temporary
+// name and renamed, so readers never see partial results; temporary files
+// left for an hour by writers that died are removed when the files are summed.
+//
+// All functions are safe to call from several threads at once.
+typedef struct
+{
+    uint64_t h1;
+    uint64_t h2;
+} ResultKey;
+
+// Continues key with size bytes of data (MurmurHash3 x64 128 seeded with the
+// key). Start from a zero key.
+void HashResultKey(ResultKey* key, const void* data, size_t size);
+
+typedef struct ResultCacheEntry ResultCacheEntry;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    ResultCacheEntry** buckets;
+    size_t numBuckets;          // power of two
+    size_t numEntries;
+    ResultCacheEntry* newest;   // LRU list
+    ResultCacheEntry* oldest;
+    size_t memorySize;
+    size_t memoryLimit;
+
+    char directory[1024];       // empty without a disk cache
+    size_t diskSize;            // estimate, corrected by every eviction scan
+    size_t diskLimit;
+    pthread_mutex_t evictLock;  // one thread scans the directory at a time
+
+    long memoryHits;
+    long diskHits;
+    long misses;
+} ResultCache;
+
+// memoryLimit bytes of results and their entries in memory; directory (NULL for none) keeps up
+// to diskLimit bytes of result files, it is created if needed.
+bool InitResultCache(ResultCache* cache, size_t memoryLimit, const char* directory, size_t diskLimit);
+void ReleaseResultCache(ResultCache* cache);
+
+// Copies the result of key to output if it is cached with size bytes.
+bool LookupResult(ResultCache* cache, const ResultKey* key, void* output, size_t size);
+
+// Adds a result to memory and the directory.
+void StoreResult(ResultCache* cache, const ResultKey* key, const void* data, size_t size);
+
+// Prints the hit counts.
+void PrintResultCacheStats(const ResultCache* cache);
+
+#endif // RESULTCACHE_H
@@ -18,16 +18,27 @@
 *
 */
 
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "RgbImage.h"
 
 #ifndef RGBIMAGE_DONT_USE_OPENGL
 #include "GL/gl.h"
 #endif
 
-RgbImage::RgbImage( int numRows, int numCols )
+RgbImage::RgbImage( int numRows, int numCols, int numChannels )
 {
    NumRows = numRows;
    NumCols = numCols;
+   NumChannels = numChannels;
+   RowStride = 0;
+   MappedFile = 0;
+   MappedSize = 0;
+   OwnsImagePtr = true;
    ImagePtr = new unsigned char[NumRows*GetNumBytesPerRow()];
    if ( !ImagePtr ) {
       fprintf(stderr, "Unable to allocate memory for %ld x %ld bitmap.\n",
@@ -54,6 +65,18 @@ RgbImage::RgbImage( int numRows, int numCols )
 **********************************************************************/
 
 bool RgbImage::LoadBmpFile( const char* filename )
+{ 
+   return LoadBmpFile( filename, 0, 0 );
+}
+
+/* ********************************************************************
+*  LoadBmpFile
+*  Same as above, but if pixelBuffer is not null the image data is
+*     read into it instead of newly allocated memory. pixelBuffer must
+*     hold at least bufferSize bytes and remains owned by the caller.
+**********************************************************************/
+
+bool RgbImage::LoadBmpFile( const char* filename, unsigned char* pixelBuffer, long bufferSize )
 { 
    Reset();
    FILE* infile = fopen( filename, "rb" );      // Open for reading binary data
@@ -62,68 +85,276 @@ bool RgbImage::LoadBmpFile( const char* filename )
       ErrorCode = OpenError;
       return false;
    }
+   bool ok = loadBmp( infile, filename, pixelBuffer, bufferSize );
+   fclose( infile );   // Close the file
+   return ok;
+}
 
-   bool fileFormatOK = false;
-   int bChar = fgetc( infile );
-   int mChar = fgetc( infile );
-   if ( bChar=='B' && mChar=='M' ) {         // If starts with "BM" for "BitMap"
-      skipChars( infile, 4+2+2+4+4 );         // Skip 4 fields we don't care about
-      NumCols = readLong( infile );
-      NumRows = readLong( infile );
-      skipChars( infile, 2 );               // Skip one field
-      int bitsPerPixel = readShort( infile );
-      skipChars( infile, 4+4+4+4+4+4 );      // Skip 6 more fields
-
-      if ( NumCols>0 && NumCols<=100000 && NumRows>0 && NumRows<=100000 
-         && bitsPerPixel==24 && !feof(infile) ) {
-         fileFormatOK = true;
-      }
-   }
-   if ( !fileFormatOK ) {
+// Reads the BMP file from infile, filename is for messages only.
+bool RgbImage::loadBmp( FILE* infile, const char* filename, unsigned char* pixelBuffer, long bufferSize )
+{
+   if ( !readBmpHeader( infile ) ) {
       Reset();
       ErrorCode = FileFormatError;
       fprintf(stderr, "Not a valid 24-bit bitmap file: %s.\n", filename);
-      fclose ( infile );
       return false;
    }
 
-   // Allocate memory
-   ImagePtr = new unsigned char[NumRows*GetNumBytesPerRow()];
+   if ( pixelBuffer ) {
+      if ( NumRows*GetNumBytesPerRow() > bufferSize ) {
+         fprintf(stderr, "Buffer too small for %ld x %ld bitmap: %s.\n",
+               NumRows, NumCols, filename);
+         Reset();
+         ErrorCode = MemoryError;
+         return false;
+      }
+      ImagePtr = pixelBuffer;
+      OwnsImagePtr = false;
+   }
+   else {
+      // Allocate memory
+      ImagePtr = new unsigned char[NumRows*GetNumBytesPerRow()];
+   }
    if ( !ImagePtr ) {
       fprintf(stderr, "Unable to allocate memory for %ld x %ld bitmap: %s.\n",
             NumRows, NumCols, filename);
       Reset();
       ErrorCode = MemoryError;
-      fclose ( infile );
       return false;
    }
 
+   // File rows have the same padding as ImagePtr rows, so every row is read
+   //   with one call and the BGR values are swapped in place.
    unsigned char* cPtr = ImagePtr;
-   for ( int i=0; i<NumRows; i++ ) {
+   long rowsRead = 0;
+   for ( ; rowsRead<NumRows; rowsRead++ ) {
+      if ( fread( cPtr, 1, GetNumBytesPerRow(), infile ) != (size_t)GetNumBytesPerRow() ) {
+         break;
+      }
       int j;
       for ( j=0; j<NumCols; j++ ) {
-         *(cPtr+2) = fgetc( infile );   // Blue color value
-         *(cPtr+1) = fgetc( infile );   // Green color value
-         *cPtr = fgetc( infile );      // Red color value
+         unsigned char blue = *cPtr;   // Blue color value
+         *cPtr = *(cPtr+2);            // Red color value
+         *(cPtr+2) = blue;
          cPtr += 3;
       }
-      int k=3*NumCols;               // Num bytes already read
+      int k=3*NumCols;
       for ( ; k<GetNumBytesPerRow(); k++ ) {
-         fgetc( infile );            // Read and ignore padding;
-         *(cPtr++) = 0;
+         *(cPtr++) = 0;               // Clear the padding
       }
    }
-   if ( feof( infile ) ) {
+   if ( rowsRead<NumRows ) {
       fprintf( stderr, "Premature end of file: %s.\n", filename );
       Reset();
       ErrorCode = ReadError;
-      fclose ( infile );
       return false;
    }
+   return true;
+}
+
+/* ********************************************************************
+*  LoadGrayBmpFile
+*  Read into memory a single channel image from an uncompressed 24 bit
+*     or 8 bit palette BMP file. Colors are converted to gray values with
+*     the BT.709 luma weights: palette entries once, 24 bit pixels one
+*     by one, so files with a gray palette are loaded exactly.
+*     pixelBuffer and bufferSize as for LoadBmpFile.
+*  Return true for success, false for failure.
+**********************************************************************/
+
+bool RgbImage::LoadGrayBmpFile( const char* filename, unsigned char* pixelBuffer, long bufferSize )
+{
+   Reset();
+   FILE* infile = fopen( filename, "rb" );      // Open for reading binary data
+   if ( !infile ) {
+      fprintf(stderr, "Unable to open file: %s\n", filename);
+      ErrorCode = OpenError;
+      return false;
+   }
+   bool ok = loadGrayBmp( infile, filename, pixelBuffer, bufferSize );
    fclose( infile );   // Close the file
+   return ok;
+}
+
+bool RgbImage::loadGrayBmp( FILE* infile, const char* filename, unsigned char* pixelBuffer, long bufferSize )
+{
+   int bitsPerPixel;
+   long dataOffset, numColors;
+   if ( !readBmpHeader( infile, &bitsPerPixel, &dataOffset, &numColors ) ) {
+      Reset();
+      ErrorCode = FileFormatError;
+      fprintf(stderr, "Not a valid 24-bit or 8-bit bitmap file: %s.\n", filename);
+      return false;
+   }
+   NumChannels = 1;
+
+   // The pixels must not start within the palette
+   long paletteEnd = ftell( infile ) + (bitsPerPixel==8 ? 4*numColors : 0);
+   if ( dataOffset>0 && dataOffset<paletteEnd ) {
+      Reset();
+      ErrorCode = FileFormatError;
+      fprintf(stderr, "Pixel data overlaps the palette: %s.\n", filename);
+      return false;
+   }
+
+   // Gray value of every palette entry (stored as blue, green, red, unused)
+   unsigned char grayOfIndex[256];
+   int i;
+   for ( i=0; i<256; i++ ) {
+      grayOfIndex[i] = 0;
+   }
+   for ( i=0; bitsPerPixel==8 && i<numColors; i++ ) {
+      int blue = fgetc( infile );
+      int green = fgetc( infile );
+      int red = fgetc( infile );
+      fgetc( infile );
+      grayOfIndex[i] = (unsigned char)((2126*red + 7152*green + 722*blue + 5000)/10000);
+   }
+   if ( dataOffset>0 ) {
+      fseek( infile, dataOffset, SEEK_SET );
+   }
+
+   if ( pixelBuffer ) {
+      if ( NumRows*GetNumBytesPerRow() > bufferSize ) {
+         fprintf(stderr, "Buffer too small for %ld x %ld bitmap: %s.\n",
+               NumRows, NumCols, filename);
+         Reset();
+         ErrorCode = MemoryError;
+         return false;
+      }
+      ImagePtr = pixelBuffer;
+      OwnsImagePtr = false;
+   }
+   else {
+      ImagePtr = new unsigned char[NumRows*GetNumBytesPerRow()];
+   }
+
+   // File rows are padded to 4 bytes like the rows of ImagePtr
+   long fileBytesPerRow = ((bitsPerPixel/8*NumCols+3)>>2)<<2;
+   unsigned char* fileRow = new unsigned char[fileBytesPerRow];
+   long rowsRead = 0;
+   for ( ; rowsRead<NumRows; rowsRead++ ) {
+      if ( fread( fileRow, 1, fileBytesPerRow, infile ) != (size_t)fileBytesPerRow ) {
+         break;
+      }
+      unsigned char* cPtr = ImagePtr + rowsRead*GetNumBytesPerRow();
+      const unsigned char* src = fileRow;
+      int j;
+      for ( j=0; j<NumCols; j++ ) {
+         if ( bitsPerPixel==8 ) {
+            *(cPtr++) = grayOfIndex[*(src++)];
+         }
+         else {
+            *(cPtr++) = (unsigned char)((722*src[0] + 7152*src[1] + 2126*src[2] + 5000)/10000);
+            src += 3;
+         }
+      }
+      for ( ; j<GetNumBytesPerRow(); j++ ) {
+         *(cPtr++) = 0;               // Clear the padding
+      }
+   }
+   delete[] fileRow;
+
+   if ( rowsRead<NumRows ) {
+      fprintf( stderr, "Premature end of file: %s.\n", filename );
+      Reset();
+      ErrorCode = ReadError;
+      return false;
+   }
    return true;
 }
 
+/* ********************************************************************
+*  AttachImageData
+*     Uses caller owned memory of numRows rows of GetNumBytesPerRow() bytes
+*     as the image data, e.g. frames decoded by another reader.
+*     The memory is not freed by RgbImage.
+*
+*********************************************************************/
+
+void RgbImage::AttachImageData( unsigned char* pixelBuffer, long numRows, long numCols, int numChannels, long rowStride )
+{
+   Reset();
+   NumRows = numRows;
+   NumCols = numCols;
+   NumChannels = numChannels;
+   RowStride = rowStride;
+   ImagePtr = pixelBuffer;
+   OwnsImagePtr = false;
+}
+
+/* ********************************************************************
+*  ReadBmpFileSize
+*  Reads the dimensions of an uncompressed 24 bit or 8 bit BMP file without
+*     loading the pixel data, e.g. to size a buffer for LoadBmpFile.
+**********************************************************************/
+
+bool RgbImage::ReadBmpFileSize( const char* filename, long* numRows, long* numCols )
+{
+   FILE* infile = fopen( filename, "rb" );
+   if ( !infile ) {
+      fprintf(stderr, "Unable to open file: %s\n", filename);
+      return false;
+   }
+
+   RgbImage header;
+   int bitsPerPixel;
+   long dataOffset, numColors;
+   bool ok = header.readBmpHeader( infile, &bitsPerPixel, &dataOffset, &numColors );
+   fclose( infile );
+   if ( !ok ) {
+      fprintf(stderr, "Not a valid 24-bit or 8-bit bitmap file: %s.\n", filename);
+      return false;
+   }
+   *numRows = header.NumRows;
+   *numCols = header.NumCols;
+   return true;
+}
+
+// Reads the BMP header up to the pixel data and sets NumRows and NumCols.
+// Returns false if it is not a 24 bit bitmap.
+bool RgbImage::readBmpHeader( FILE* infile )
+{
+   int bitsPerPixel;
+   long dataOffset, numColors;
+   return readBmpHeader( infile, &bitsPerPixel, &dataOffset, &numColors )
+      && bitsPerPixel==24;
+}
+
+// Reads the file and info headers (54 bytes) and sets NumRows and NumCols.
+// Returns false if it is not an uncompressed 24 bit or 8 bit bitmap.
+bool RgbImage::readBmpHeader( FILE* infile, int* bitsPerPixel, long* dataOffset, long* numColors )
+{
+   bool fileFormatOK = false;
+   int bChar = fgetc( infile );
+   int mChar = fgetc( infile );
+   if ( bChar=='B' && mChar=='M' ) {         // If starts with "BM" for "BitMap"
+      skipChars( infile, 4+2+2 );            // Skip 2 fields we don't care about
+      *dataOffset = readLong( infile );
+      long infoHeaderSize = readLong( infile );   // 40, 108 (V4) or 124 (V5)
+      NumCols = readLong( infile );
+      NumRows = readLong( infile );
+      skipChars( infile, 2 );               // Skip one field
+      *bitsPerPixel = readShort( infile );
+      long compression = readLong( infile );
+      skipChars( infile, 4+4+4 );            // Skip 3 more fields
+      *numColors = readLong( infile );
+      skipChars( infile, 4 );               // Skip one more field
+      if ( *numColors==0 && *bitsPerPixel==8 ) {
+         *numColors = 256;               // 0 means all colors
+      }
+
+      if ( NumCols>0 && NumCols<=100000 && NumRows>0 && NumRows<=100000 
+         && (*bitsPerPixel==24 || (*bitsPerPixel==8 && *numColors<=256))
+         && compression==0 && infoHeaderSize>=40 && infoHeaderSize<=1024 && !feof(infile) ) {
+         // Leave the file at the palette, after the fields of later versions
+         skipChars( infile, infoHeaderSize-40 );
+         fileFormatOK = !feof(infile);
+      }
+   }
+   return fileFormatOK;
+}
+
 short RgbImage::readShort( FILE* infile )
 {
    // read a 16 bit integer
@@ -181,30 +412,59 @@ bool RgbImage::WriteBmpFile( const char* filename )
       ErrorCode = OpenError;
       return false;
    }
+   bool ok = writeBmp( outfile );
+   if ( fclose( outfile )!=0 ) {   // Close the file
+      ok = false;
+   }
+   if ( !ok ) {
+      ErrorCode = WriteError;
+   }
+   return ok;
+}
 
+bool RgbImage::writeBmp( FILE* outfile )
+{
    fputc('B',outfile);
    fputc('M',outfile);
-   int rowLen = GetNumBytesPerRow();
-   writeLong( 40+14+NumRows*rowLen, outfile );   // Length of file
+   int rowLen = ((NumChannels*NumCols+3)>>2)<<2;   // BMP rows, ImagePtr rows may have a larger stride
+   int paletteLen = (NumChannels==1) ? 4*256 : 0;   // gray palette of 8 bit files
+   writeLong( 40+14+paletteLen+NumRows*rowLen, outfile );   // Length of file
    writeShort( 0, outfile );               // Reserved for future use
    writeShort( 0, outfile );
-   writeLong( 40+14, outfile );            // Offset to pixel data
+   writeLong( 40+14+paletteLen, outfile );   // Offset to pixel data
    writeLong( 40, outfile );               // header length
    writeLong( NumCols, outfile );            // width in pixels
    writeLong( NumRows, outfile );            // height in pixels (pos for bottom up)
    writeShort( 1, outfile );      // number of planes
-   writeShort( 24, outfile );      // bits per pixel
+   writeShort( 8*NumChannels, outfile );      // bits per pixel
    writeLong( 0, outfile );      // no compression
    writeLong( 0, outfile );      // not used if no compression
    writeLong( 0, outfile );      // Pixels per meter
    writeLong( 0, outfile );      // Pixels per meter
-   writeLong( 0, outfile );      // unused for 24 bits/pixel
-   writeLong( 0, outfile );      // unused for 24 bits/pixel
+   writeLong( paletteLen/4, outfile );      // palette entries, 0 for 24 bits/pixel
+   writeLong( 0, outfile );      // all colors important
+
+   if ( NumChannels==1 ) {
+      // Gray palette, then the rows with zero padding
+      for ( int i=0; i<256; i++ ) {
+         fputc( i, outfile );      // Blue, green, red, unused
+         fputc( i, outfile );
+         fputc( i, outfile );
+         fputc( 0, outfile );
+      }
+      static const unsigned char padding[4] = { 0, 0, 0, 0 };
+      bool ok = true;
+      for ( long i=0; i<NumRows && ok; i++ ) {
+         ok = fwrite( ImagePtr + i*GetNumBytesPerRow(), 1, NumCols, outfile )==(size_t)NumCols
+              && fwrite( padding, 1, rowLen-NumCols, outfile )==(size_t)(rowLen-NumCols);
+      }
+      return ok;
+   }
 
    // Now write out the pixel data:
-   unsigned char* cPtr = ImagePtr;
    for ( int i=0; i<NumRows; i++ ) {
       // Write out i-th row's data
+      unsigned char* cPtr = ImagePtr + i*GetNumBytesPerRow();
       int j;
       for ( j=0; j<NumCols; j++ ) {
          fputc( *(cPtr+2), outfile);      // Blue color value
@@ -214,16 +474,667 @@ bool RgbImage::WriteBmpFile( const char* filename )
       }
       // Pad row to word boundary
       int k=3*NumCols;               // Num bytes already read
-      for ( ; k<GetNumBytesPerRow(); k++ ) {
+      for ( ; k<rowLen; k++ ) {
          fputc( 0, outfile );            // Read and ignore padding;
-         cPtr++;
       }
    }
 
-   fclose( outfile );   // Close the file
+   return !ferror( outfile );
+}
+
+/* ********************************************************************
+*  WriteRawFile
+*  Write the pixels as top-down rows of NumChannels*NumCols bytes without
+*     padding, i.e. one raw rgb24 or gray8 video frame.
+*  Return true for success, false for failure.
+**********************************************************************/
+
+bool RgbImage::WriteRawFile( const char* filename )
+{
+   FILE* outfile = fopen( filename, "wb" );
+   if ( !outfile ) {
+      fprintf(stderr, "Unable to open file: %s\n", filename);
+      ErrorCode = OpenError;
+      return false;
+   }
+   bool ok = writeRaw( outfile );
+   if ( fclose( outfile )!=0 ) {
+      ok = false;
+   }
+   if ( !ok ) {
+      ErrorCode = WriteError;
+   }
+   return ok;
+}
+
+bool RgbImage::writeRaw( FILE* outfile )
+{
+   bool ok = true;
+   for ( long i=NumRows-1; i>=0 && ok; i-- ) {
+      ok = fwrite( ImagePtr + i*GetNumBytesPerRow(), NumChannels, NumCols, outfile ) == (size_t)NumCols;
+   }
+   return ok;
+}
+
+/* ********************************************************************
+*  QOI files ("Quite OK Image" format, qoiformat.org)
+*  A 14 byte header (magic "qoif", big endian width and height, number
+*     of channels, colorspace), the pixels top-down as a stream of byte
+*     aligned chunks and an 8 byte end marker. Every chunk refers to the
+*     previous pixel or to a 64 entry index of recently seen pixels, so
+*     the stream is decoded in one sequential pass; frames of a sequence
+*     are decoded in parallel by the frame source thread instead.
+*  The decoder works on the whole file in memory and writes the pixels
+*     straight to their place in the bottom-up, padded rows of ImagePtr.
+**********************************************************************/
+
+#define QOI_OP_INDEX  0x00
+#define QOI_OP_DIFF   0x40
+#define QOI_OP_LUMA   0x80
+#define QOI_OP_RUN    0xc0
+#define QOI_OP_RGB    0xfe
+#define QOI_OP_RGBA   0xff
+#define QOI_MASK_2    0xc0
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+#define QOI_HASH(r,g,b,a) (((r)*3 + (g)*5 + (b)*7 + (a)*11) & 63)
+
+static long readBigEndianLong( const unsigned char* bytes )
+{
+   return ((long)bytes[0]<<24) | ((long)bytes[1]<<16) | ((long)bytes[2]<<8) | (long)bytes[3];
+}
+
+static void writeBigEndianLong( unsigned char* bytes, long data )
+{
+   bytes[0] = (unsigned char)((data>>24)&0xff);
+   bytes[1] = (unsigned char)((data>>16)&0xff);
+   bytes[2] = (unsigned char)((data>>8)&0xff);
+   bytes[3] = (unsigned char)(data&0xff);
+}
+
+bool RgbImage::IsQoiFileName( const char* filename )
+{
+   size_t length = strlen( filename );
+   if ( length<4 ) {
+      return false;
+   }
+   const char* ext = filename + length - 4;
+   return ext[0]=='.' && (ext[1]|0x20)=='q' && (ext[2]|0x20)=='o' && (ext[3]|0x20)=='i';
+}
+
+// Returns the contents of a file in memory allocated with malloc, or 0.
+unsigned char* RgbImage::readWholeFile( const char* filename, long* fileSize )
+{
+   FILE* infile = fopen( filename, "rb" );
+   if ( !infile ) {
+      fprintf(stderr, "Unable to open file: %s\n", filename);
+      return 0;
+   }
+   fseek( infile, 0, SEEK_END );
+   *fileSize = ftell( infile );
+   fseek( infile, 0, SEEK_SET );
+
+   unsigned char* data = (*fileSize>0) ? (unsigned char*)malloc( *fileSize ) : 0;
+   if ( data && fread( data, 1, *fileSize, infile ) != (size_t)*fileSize ) {
+      free( data );
+      data = 0;
+   }
+   fclose( infile );
+   return data;
+}
+
+bool RgbImage::ReadQoiFileSize( const char* filename, long* numRows, long* numCols )
+{
+   FILE* infile = fopen( filename, "rb" );
+   if ( !infile ) {
+      fprintf(stderr, "Unable to open file: %s\n", filename);
+      return false;
+   }
+   unsigned char header[QOI_HEADER_SIZE];
+   bool ok = fread( header, 1, QOI_HEADER_SIZE, infile )==QOI_HEADER_SIZE
+      && 0==memcmp( header, "qoif", 4 );
+   fclose( infile );
+   if ( ok ) {
+      *numCols = readBigEndianLong( header+4 );
+      *numRows = readBigEndianLong( header+8 );
+      ok = *numCols>0 && *numCols<=100000 && *numRows>0 && *numRows<=100000
+         && (header[12]==3 || header[12]==4);
+   }
+   if ( !ok ) {
+      fprintf(stderr, "Not a valid QOI file: %s.\n", filename);
+   }
+   return ok;
+}
+
+/* ********************************************************************
+*  LoadQoiFile
+*  Read into memory an RGB image, or with numChannels 1 a gray image
+*     (BT.709 luma), from a QOI file. If pixelBuffer is not null the
+*     image data is decoded into it as with LoadBmpFile.
+*  Return true for success, false for failure.
+**********************************************************************/
+
+bool RgbImage::LoadQoiFile( const char* filename, unsigned char* pixelBuffer, long bufferSize, int numChannels )
+{
+   Reset();
+   long fileSize = 0;
+   unsigned char* data = readWholeFile( filename, &fileSize );
+   if ( !data ) {
+      ErrorCode = OpenError;
+      return false;
+   }
+   bool ok = loadQoi( data, fileSize, filename, pixelBuffer, bufferSize, numChannels );
+   free( data );
+   return ok;
+}
+
+// Decodes the QOI file contents in data, filename is for messages only.
+bool RgbImage::loadQoi( const unsigned char* data, long fileSize, const char* filename,
+                        unsigned char* pixelBuffer, long bufferSize, int numChannels )
+{
+   if ( fileSize<QOI_HEADER_SIZE+QOI_PADDING_SIZE || 0!=memcmp( data, "qoif", 4 )
+      || (data[12]!=3 && data[12]!=4) ) {
+      fprintf(stderr, "Not a valid QOI file: %s.\n", filename);
+      ErrorCode = FileFormatError;
+      return false;
+   }
+   NumCols = readBigEndianLong( data+4 );
+   NumRows = readBigEndianLong( data+8 );
+   NumChannels = numChannels;
+   if ( NumCols<=0 || NumCols>100000 || NumRows<=0 || NumRows>100000 ) {
+      fprintf(stderr, "Not a valid QOI file: %s.\n", filename);
+      Reset();
+      ErrorCode = FileFormatError;
+      return false;
+   }
+
+   if ( pixelBuffer ) {
+      if ( NumRows*GetNumBytesPerRow() > bufferSize ) {
+         fprintf(stderr, "Buffer too small for %ld x %ld image: %s.\n",
+               NumRows, NumCols, filename);
+         Reset();
+         ErrorCode = MemoryError;
+         return false;
+      }
+      ImagePtr = pixelBuffer;
+      OwnsImagePtr = false;
+   }
+   else {
+      ImagePtr = new unsigned char[NumRows*GetNumBytesPerRow()];
+   }
+
+   unsigned char index[64][4];
+   memset( index, 0, sizeof(index) );
+   unsigned char r = 0, g = 0, b = 0, a = 255;
+   int run = 0;
+   const unsigned char* p = data + QOI_HEADER_SIZE;
+   const unsigned char* chunksEnd = data + fileSize - QOI_PADDING_SIZE;
+   bool ok = true;
+
+   // The file is top-down, the image bottom-up. The padding guarantees that
+   //   the bytes of a chunk starting before chunksEnd can be read.
+   for ( long row=NumRows-1; row>=0 && ok; row-- ) {
+      unsigned char* cPtr = ImagePtr + row*GetNumBytesPerRow();
+      for ( long col=0; col<NumCols; col++ ) {
+         if ( run>0 ) {
+            run--;
+         }
+         else if ( p<chunksEnd ) {
+            int b1 = *(p++);
+            if ( b1==QOI_OP_RGB ) {
+               r = p[0]; g = p[1]; b = p[2];
+               p += 3;
+            }
+            else if ( b1==QOI_OP_RGBA ) {
+               r = p[0]; g = p[1]; b = p[2]; a = p[3];
+               p += 4;
+            }
+            else if ( (b1&QOI_MASK_2)==QOI_OP_INDEX ) {
+               r = index[b1][0]; g = index[b1][1]; b = index[b1][2]; a = index[b1][3];
+            }
+            else if ( (b1&QOI_MASK_2)==QOI_OP_DIFF ) {
+               r += ((b1>>4)&0x03) - 2;
+               g += ((b1>>2)&0x03) - 2;
+               b += (b1&0x03) - 2;
+            }
+            else if ( (b1&QOI_MASK_2)==QOI_OP_LUMA ) {
+               int b2 = *(p++);
+               int vg = (b1&0x3f) - 32;
+               r += vg - 8 + ((b2>>4)&0x0f);
+               g += vg;
+               b += vg - 8 + (b2&0x0f);
+            }
+            else {
+               run = b1&0x3f;         // QOI_OP_RUN, repeats the pixel run+1 times
+            }
+            unsigned char* entry = index[QOI_HASH(r,g,b,a)];
+            entry[0] = r; entry[1] = g; entry[2] = b; entry[3] = a;
+         }
+         else {
+            ok = false;
+            break;
+         }
+
+         if ( NumChannels==1 ) {
+            *(cPtr++) = (unsigned char)((2126*r + 7152*g + 722*b + 5000)/10000);
+         }
+         else {
+            *(cPtr++) = r;
+            *(cPtr++) = g;
+            *(cPtr++) = b;
+         }
+      }
+      for ( long k=NumChannels*NumCols; k<GetNumBytesPerRow(); k++ ) {
+         *(cPtr++) = 0;               // Clear the padding
+      }
+   }
+
+   if ( !ok ) {
+      fprintf( stderr, "Premature end of file: %s.\n", filename );
+      Reset();
+      ErrorCode = ReadError;
+      return false;
+   }
+   return true;
+}
+
+/* ********************************************************************
+*  WriteQoiFile
+*  Write the image to a 3 channel QOI file, gray images with equal red,
+*     green and blue values. The file is encoded in memory and written
+*     with a single call.
+*  Return true for success, false for failure.
+**********************************************************************/
+
+bool RgbImage::WriteQoiFile( const char* filename )
+{
+   FILE* outfile = fopen( filename, "wb" );
+   if ( !outfile ) {
+      fprintf(stderr, "Unable to open file: %s\n", filename);
+      ErrorCode = OpenError;
+      return false;
+   }
+   bool ok = writeQoi( outfile );
+   if ( fclose( outfile )!=0 ) {
+      ok = false;
+   }
+   if ( !ok && ErrorCode!=MemoryError ) {
+      ErrorCode = WriteError;
+   }
+   return ok;
+}
+
+bool RgbImage::writeQoi( FILE* outfile )
+{
+   // Worst case is a QOI_OP_RGB chunk for every pixel
+   long maxSize = QOI_HEADER_SIZE + NumRows*NumCols*4 + QOI_PADDING_SIZE;
+   unsigned char* data = (unsigned char*)malloc( maxSize );
+   if ( !data ) {
+      ErrorCode = MemoryError;
+      return false;
+   }
+
+   memcpy( data, "qoif", 4 );
+   writeBigEndianLong( data+4, NumCols );
+   writeBigEndianLong( data+8, NumRows );
+   data[12] = 3;                  // channels
+   data[13] = 0;                  // sRGB with linear alpha
+   unsigned char* p = data + QOI_HEADER_SIZE;
+
+   // The index holds RGBA like the decoder's: its never written entries are
+   //   transparent black and must not match an opaque black pixel
+   unsigned char index[64][4];
+   memset( index, 0, sizeof(index) );
+   unsigned char pr = 0, pg = 0, pb = 0;   // previous pixel, alpha is always 255
+   int run = 0;
+
+   for ( long row=NumRows-1; row>=0; row-- ) {
+      const unsigned char* cPtr = ImagePtr + row*GetNumBytesPerRow();
+      for ( long col=0; col<NumCols; col++ ) {
+         unsigned char r, g, b;
+         if ( NumChannels==1 ) {
+            r = g = b = *(cPtr++);
+         }
+         else {
+            r = *(cPtr++);
+            g = *(cPtr++);
+            b = *(cPtr++);
+         }
+         bool lastPixel = (row==0 && col==NumCols-1);
+
+         if ( r==pr && g==pg && b==pb ) {
+            run++;
+            if ( run==62 || lastPixel ) {
+               *(p++) = (unsigned char)(QOI_OP_RUN | (run-1));
+               run = 0;
+            }
+            continue;
+         }
+         if ( run>0 ) {
+            *(p++) = (unsigned char)(QOI_OP_RUN | (run-1));
+            run = 0;
+         }
+
+         int hash = QOI_HASH( r, g, b, 255 );
+         unsigned char* entry = index[hash];
+         if ( entry[0]==r && entry[1]==g && entry[2]==b && entry[3]==255 ) {
+            *(p++) = (unsigned char)(QOI_OP_INDEX | hash);
+         }
+         else {
+            entry[0] = r; entry[1] = g; entry[2] = b; entry[3] = 255;
+            signed char vr = (signed char)(r - pr);
+            signed char vg = (signed char)(g - pg);
+            signed char vb = (signed char)(b - pb);
+            signed char vgr = (signed char)(vr - vg);
+            signed char vgb = (signed char)(vb - vg);
+            if ( vr>-3 && vr<2 && vg>-3 && vg<2 && vb>-3 && vb<2 ) {
+               *(p++) = (unsigned char)(QOI_OP_DIFF | (vr+2)<<4 | (vg+2)<<2 | (vb+2));
+            }
+            else if ( vgr>-9 && vgr<8 && vg>-33 && vg<32 && vgb>-9 && vgb<8 ) {
+               *(p++) = (unsigned char)(QOI_OP_LUMA | (vg+32));
+               *(p++) = (unsigned char)((vgr+8)<<4 | (vgb+8));
+            }
+            else {
+               *(p++) = QOI_OP_RGB;
+               *(p++) = r;
+               *(p++) = g;
+               *(p++) = b;
+            }
+         }
+         pr = r; pg = g; pb = b;
+      }
+   }
+   memset( p, 0, QOI_PADDING_SIZE-1 );   // End marker: seven 0x00 and 0x01
+   p[QOI_PADDING_SIZE-1] = 1;
+   p += QOI_PADDING_SIZE;
+
+   size_t size = p - data;
+   bool ok = fwrite( data, 1, size, outfile )==size;
+   free( data );
+   return ok;
+}
+
+/* ********************************************************************
+*  Raw image container files (".rimg")
+*  Little endian header at offset 0:
+*      0  "RIMG"          16  channels (1 or 3)   32  data offset (64 bit)
+*      4  version (1)     20  row stride          40  data size (64 bit)
+*      8  width           24  row order (0 = bottom-up)
+*     12  height          28  reserved
+*  The header is zero padded to the data offset, a multiple of the page
+*     size (at least 4096). Rows are stored bottom-up like ImagePtr, each
+*     padded with zeros to the stride, a multiple of 64 bytes.
+**********************************************************************/
+
+#define RAW_IMAGE_VERSION 1
+#define RAW_IMAGE_ROW_ALIGNMENT 64
+#define RAW_IMAGE_MIN_DATA_OFFSET 4096
+
+static long readLittleEndianLong( const unsigned char* bytes )
+{
+   return ((long)bytes[3]<<24) | ((long)bytes[2]<<16) | ((long)bytes[1]<<8) | (long)bytes[0];
+}
+
+static void writeLittleEndianLong( unsigned char* bytes, long data )
+{
+   bytes[0] = (unsigned char)(data&0xff);
+   bytes[1] = (unsigned char)((data>>8)&0xff);
+   bytes[2] = (unsigned char)((data>>16)&0xff);
+   bytes[3] = (unsigned char)((data>>24)&0xff);
+}
+
+static long long readLittleEndianLongLong( const unsigned char* bytes )
+{
+   return ((long long)readLittleEndianLong( bytes+4 )<<32) | (long long)readLittleEndianLong( bytes );
+}
+
+static void writeLittleEndianLongLong( unsigned char* bytes, long long data )
+{
+   writeLittleEndianLong( bytes, (long)(data&0xffffffff) );
+   writeLittleEndianLong( bytes+4, (long)((data>>32)&0xffffffff) );
+}
+
+bool RgbImage::IsRawImageFileName( const char* filename )
+{
+   size_t length = strlen( filename );
+   return length>=5 && 0==strcmp( filename + length - 5, ".rimg" );
+}
+
+void RgbImage::releaseMapping()
+{
+   munmap( MappedFile, MappedSize );
+   MappedFile = 0;
+   MappedSize = 0;
+}
+
+/* ********************************************************************
+*  MapRawImageFile
+*  Map a raw image container file read-only and use its pixel data as
+*     the image. Only the header is checked; pages of the pixels are read
+*     when they are first touched and shared with other mappings of the
+*     file through the page cache. A file written with a smaller page
+*     size than this system's, whose pixel data does not start on a page,
+*     is copied into memory instead.
+*  Return true for success, false for failure.
+**********************************************************************/
+
+bool RgbImage::MapRawImageFile( const char* filename )
+{
+   Reset();
+   int fd = open( filename, O_RDONLY );
+   if ( fd<0 ) {
+      fprintf(stderr, "Unable to open file: %s\n", filename);
+      ErrorCode = OpenError;
+      return false;
+   }
+   struct stat fileStat;
+   void* base = MAP_FAILED;
+   if ( 0==fstat( fd, &fileStat ) && fileStat.st_size>=RAW_IMAGE_MIN_DATA_OFFSET ) {
+      base = mmap( 0, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+   }
+   close( fd );
+   if ( base==MAP_FAILED ) {
+      fprintf(stderr, "Unable to map file: %s\n", filename);
+      ErrorCode = OpenError;
+      return false;
+   }
+
+   const unsigned char* header = (const unsigned char*)base;
+   long width = readLittleEndianLong( header+8 );
+   long height = readLittleEndianLong( header+12 );
+   long channels = readLittleEndianLong( header+16 );
+   long stride = readLittleEndianLong( header+20 );
+   long long dataOffset = readLittleEndianLongLong( header+32 );
+   long long dataSize = readLittleEndianLongLong( header+40 );
+   bool ok = 0==memcmp( header, "RIMG", 4 )
+      && readLittleEndianLong( header+4 )==RAW_IMAGE_VERSION
+      && readLittleEndianLong( header+24 )==0
+      && width>0 && width<=100000 && height>0 && height<=100000
+      && (channels==1 || channels==3)
+      && stride>=channels*width && stride%RAW_IMAGE_ROW_ALIGNMENT==0
+      && dataOffset>=RAW_IMAGE_MIN_DATA_OFFSET && dataOffset%RAW_IMAGE_MIN_DATA_OFFSET==0
+      && dataSize==(long long)stride*height && dataOffset<=(long long)fileStat.st_size
+      && dataSize<=(long long)fileStat.st_size-dataOffset;
+   if ( !ok ) {
+      fprintf(stderr, "Not a valid raw image file: %s.\n", filename);
+      munmap( base, fileStat.st_size );
+      ErrorCode = FileFormatError;
+      return false;
+   }
+
+   NumRows = height;
+   NumCols = width;
+   NumChannels = (int)channels;
+   RowStride = stride;
+   if ( dataOffset%sysconf( _SC_PAGESIZE )!=0 ) {
+      ImagePtr = new unsigned char[dataSize];
+      memcpy( ImagePtr, (unsigned char*)base + dataOffset, dataSize );
+      OwnsImagePtr = true;
+      munmap( base, fileStat.st_size );
+      return true;
+   }
+   MappedFile = base;
+   MappedSize = fileStat.st_size;
+   ImagePtr = (unsigned char*)base + dataOffset;
+   OwnsImagePtr = false;
    return true;
 }
 
+/* ********************************************************************
+*  WriteRawImageFile
+*  Write the image to a raw image container file that MapRawImageFile
+*     can map.
+*  Return true for success, false for failure.
+**********************************************************************/
+
+bool RgbImage::WriteRawImageFile( const char* filename )
+{
+   FILE* outfile = fopen( filename, "wb" );
+   if ( !outfile ) {
+      fprintf(stderr, "Unable to open file: %s\n", filename);
+      ErrorCode = OpenError;
+      return false;
+   }
+   bool ok = writeRawImage( outfile );
+   if ( fclose( outfile )!=0 ) {
+      ok = false;
+   }
+   if ( !ok && ErrorCode!=MemoryError ) {
+      ErrorCode = WriteError;
+   }
+   return ok;
+}
+
+bool RgbImage::writeRawImage( FILE* outfile )
+{
+   long pageSize = sysconf( _SC_PAGESIZE );
+   long dataOffset = (pageSize>RAW_IMAGE_MIN_DATA_OFFSET) ? pageSize : RAW_IMAGE_MIN_DATA_OFFSET;
+   long stride = ((NumChannels*NumCols + RAW_IMAGE_ROW_ALIGNMENT-1)/RAW_IMAGE_ROW_ALIGNMENT)*RAW_IMAGE_ROW_ALIGNMENT;
+
+   // The header page and one padded row are staged in zeroed memory
+   unsigned char* buffer = (unsigned char*)calloc( 1, dataOffset>stride ? dataOffset : stride );
+   if ( !buffer ) {
+      ErrorCode = MemoryError;
+      return false;
+   }
+   memcpy( buffer, "RIMG", 4 );
+   writeLittleEndianLong( buffer+4, RAW_IMAGE_VERSION );
+   writeLittleEndianLong( buffer+8, NumCols );
+   writeLittleEndianLong( buffer+12, NumRows );
+   writeLittleEndianLong( buffer+16, NumChannels );
+   writeLittleEndianLong( buffer+20, stride );
+   writeLittleEndianLong( buffer+24, 0 );      // bottom-up
+   writeLittleEndianLongLong( buffer+32, dataOffset );
+   writeLittleEndianLongLong( buffer+40, (long long)stride*NumRows );
+
+   bool ok = fwrite( buffer, 1, dataOffset, outfile )==(size_t)dataOffset;
+   memset( buffer, 0, stride );
+   for ( long i=0; i<NumRows && ok; i++ ) {
+      memcpy( buffer, ImagePtr + i*GetNumBytesPerRow(), NumChannels*NumCols );
+      ok = fwrite( buffer, 1, stride, outfile )==(size_t)stride;
+   }
+   free( buffer );
+   return ok;
+}
+
+/* ********************************************************************
+*  LoadImageFile, ReadImageFileSize, WriteImageFile
+*  Dispatch on the extension of the file name to the QOI, raw image
+*     container, raw rows or BMP routines.
+**********************************************************************/
+
+bool RgbImage::LoadImageFile( const char* filename, unsigned char* pixelBuffer, long bufferSize, int numChannels )
+{
+   if ( IsQoiFileName( filename ) ) {
+      return LoadQoiFile( filename, pixelBuffer, bufferSize, numChannels );
+   }
+   if ( numChannels==1 ) {
+      return LoadGrayBmpFile( filename, pixelBuffer, bufferSize );
+   }
+   return LoadBmpFile( filename, pixelBuffer, bufferSize );
+}
+
+bool RgbImage::ReadImageFileSize( const char* filename, long* numRows, long* numCols )
+{
+   if ( IsQoiFileName( filename ) ) {
+      return ReadQoiFileSize( filename, numRows, numCols );
+   }
+   return ReadBmpFileSize( filename, numRows, numCols );
+}
+
+/* ********************************************************************
+*  LoadImageData, EncodeImageData
+*  The same in memory, for files read or written by other means, e.g.
+*     asynchronous I/O: LoadImageData decodes the contents of a BMP or
+*     QOI file (the type from filename), EncodeImageData encodes into
+*     data and returns the size of the file, or -1 if it does not fit
+*     into capacity bytes.
+**********************************************************************/
+
+bool RgbImage::LoadImageData( const char* filename, const unsigned char* data, long dataSize,
+                              unsigned char* pixelBuffer, long bufferSize, int numChannels )
+{
+   Reset();
+   if ( IsQoiFileName( filename ) ) {
+      return loadQoi( data, dataSize, filename, pixelBuffer, bufferSize, numChannels );
+   }
+   FILE* infile = fmemopen( (void*)data, dataSize, "rb" );
+   if ( !infile ) {
+      ErrorCode = OpenError;
+      return false;
+   }
+   bool ok = (numChannels==1) ? loadGrayBmp( infile, filename, pixelBuffer, bufferSize )
+                              : loadBmp( infile, filename, pixelBuffer, bufferSize );
+   fclose( infile );
+   return ok;
+}
+
+long RgbImage::EncodeImageData( const char* filename, unsigned char* data, long capacity )
+{
+   FILE* outfile = fmemopen( data, capacity, "wb" );
+   if ( !outfile ) {
+      ErrorCode = MemoryError;
+      return -1;
+   }
+   size_t length = strlen( filename );
+   bool ok;
+   if ( length>4 && 0==strcmp( filename + length - 4, ".raw" ) ) {
+      ok = writeRaw( outfile );
+   }
+   else if ( IsQoiFileName( filename ) ) {
+      ok = writeQoi( outfile );
+   }
+   else if ( IsRawImageFileName( filename ) ) {
+      ok = writeRawImage( outfile );
+   }
+   else {
+      ok = writeBmp( outfile );
+   }
+   // The writers go through the stream buffer; data that does not fit
+   //   fails when the buffer is flushed
+   if ( fflush( outfile )!=0 || ferror( outfile ) ) {
+      ok = false;
+   }
+   long size = ftell( outfile );
+   fclose( outfile );
+   return ok ? size : -1;
+}
+
+bool RgbImage::WriteImageFile( const char* filename )
+{
+   size_t length = strlen( filename );
+   if ( length>4 && 0==strcmp( filename + length - 4, ".raw" ) ) {
+      return WriteRawFile( filename );
+   }
+   if ( IsQoiFileName( filename ) ) {
+      return WriteQoiFile( filename );
+   }
+   if ( IsRawImageFileName( filename ) ) {
+      return WriteRawImageFile( filename );
+   }
+   return WriteBmpFile( filename );
+}
+
 void RgbImage::writeLong( long data, FILE* outfile )
 { 
    // Read in 32 bit integer
@@ -265,8 +1176,12 @@ void RgbImage::SetRgbPixelf( long row, long col, double red, double green, doubl
 void RgbImage::SetRgbPixelc( long row, long col,
                unsigned char red, unsigned char green, unsigned char blue )
 {
-   assert ( row<NumRows && col<NumCols );
-   unsigned char* thePixel = GetRgbPixel( row, col );
+   unsigned char* thePixel = GetPixel( row, col );
+   if ( NumChannels==1 ) {
+      // BT.709 luma, as the gray loaders compute it
+      *thePixel = (unsigned char)((2126*red + 7152*green + 722*blue + 5000)/10000);
+      return;
+   }
    *(thePixel++) = red;
    *(thePixel++) = green;
    *(thePixel) = blue;
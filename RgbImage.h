@@ -32,21 +32,68 @@ class RgbImage
 public:
    RgbImage();
    RgbImage( const char* filename );
-   RgbImage( int numRows, int numCols );   // Initialize a blank bitmap of this size.
+   RgbImage( int numRows, int numCols, int numChannels = 3 );   // Initialize a blank bitmap of this size.
    ~RgbImage();
 
    bool LoadBmpFile( const char *filename );      // Loads the bitmap from the specified file
+   // Loads the bitmap into caller owned memory (e.g. mapped staging memory) of
+   //   bufferSize bytes instead of allocating it. The memory is not freed by RgbImage.
+   bool LoadBmpFile( const char *filename, unsigned char* pixelBuffer, long bufferSize );
+   // Loads a 24 bit or 8 bit palette BMP file as a single channel image of gray
+   //   values (BT.709 luma of the colors). bufferSize as for LoadBmpFile.
+   bool LoadGrayBmpFile( const char *filename, unsigned char* pixelBuffer = 0, long bufferSize = 0 );
+   // Reads only the dimensions from the header of a 24 bit or 8 bit BMP file.
+   static bool ReadBmpFileSize( const char *filename, long* numRows, long* numCols );
+   // Loads a QOI file (lossless, 3 or 4 channels; alpha is dropped) as RGB or,
+   //   with numChannels 1, as gray values. pixelBuffer and bufferSize as for LoadBmpFile.
+   bool LoadQoiFile( const char *filename, unsigned char* pixelBuffer = 0, long bufferSize = 0, int numChannels = 3 );
+   // Reads only the dimensions from the header of a QOI file.
+   static bool ReadQoiFileSize( const char *filename, long* numRows, long* numCols );
+   static bool IsQoiFileName( const char *filename );      // Ends in ".qoi"?
+   // Raw image container (".rimg") made for mmap: a header page with the
+   //   dimensions, channels and row stride, then the bottom-up rows of the
+   //   image with a stride that is a multiple of 64 bytes. Mapping needs no
+   //   parsing or copying; the pixels are read-only and page aligned, so they
+   //   can back CL_MEM_USE_HOST_PTR buffers. RGB and gray images.
+   bool MapRawImageFile( const char* filename );
+   bool WriteRawImageFile( const char* filename );
+   static bool IsRawImageFileName( const char* filename );   // Ends in ".rimg"?
+   bool IsMapped() const { return MappedFile!=0; }
+   // Load, size and write by file name extension: ".qoi" QOI, ".rimg" raw image
+   //   container, anything else BMP (WriteImageFile also ".raw" raw rows).
+   //   LoadImageFile does not map raw image containers, use MapRawImageFile.
+   bool LoadImageFile( const char *filename, unsigned char* pixelBuffer, long bufferSize, int numChannels = 3 );
+   static bool ReadImageFileSize( const char *filename, long* numRows, long* numCols );
+   bool WriteImageFile( const char* filename );
+   // The same for files in memory: LoadImageData decodes dataSize bytes of a BMP
+   //   or QOI file, EncodeImageData returns the size of the file encoded into
+   //   data, -1 if it needs more than capacity bytes. filename gives the type.
+   bool LoadImageData( const char *filename, const unsigned char* data, long dataSize,
+                       unsigned char* pixelBuffer, long bufferSize, int numChannels = 3 );
+   long EncodeImageData( const char* filename, unsigned char* data, long capacity );
+   // Uses caller owned memory with rows of GetNumBytesPerRow() bytes as the image,
+   //   or of rowStride bytes if it is not 0.
+   void AttachImageData( unsigned char* pixelBuffer, long numRows, long numCols, int numChannels = 3, long rowStride = 0 );
    bool WriteBmpFile( const char* filename );      // Write the bitmap to the specified file
+                                                   //   (8 bit gray palette for single channel images)
+   bool WriteRawFile( const char* filename );      // Write top-down rows without padding
+   bool WriteQoiFile( const char* filename );      // Write a 3 channel QOI file (gray as r=g=b)
 #ifndef RGBIMAGE_DONT_USE_OPENGL
    bool LoadFromOpenglBuffer();               // Load the bitmap from the current OpenGL buffer
 #endif
 
    long GetNumRows() const { return NumRows; }
    long GetNumCols() const { return NumCols; }
-   // Rows are word aligned
-   long GetNumBytesPerRow() const { return ((3*NumCols+3)>>2)<<2; }   
+   int GetNumChannels() const { return NumChannels; }   // 3 for RGB, 1 for gray
+   // Rows are word aligned, or RowStride bytes apart in mapped raw image files
+   long GetNumBytesPerRow() const { return RowStride ? RowStride : ((NumChannels*NumCols+3)>>2)<<2; }   
    void* ImageData() const { return (void*)ImagePtr; }
 
+   // Address of the NumChannels bytes of a pixel of an RGB or gray image
+   const unsigned char* GetPixel( long row, long col ) const;
+   unsigned char* GetPixel( long row, long col );
+   // The addresses of RGB pixels require an RGB image. The color values of a
+   //   gray pixel are its gray value, gray pixels are set to the luma.
    const unsigned char* GetRgbPixel( long row, long col ) const;
    unsigned char* GetRgbPixel( long row, long col );
    void GetRgbPixel( long row, long col, float* red, float* green, float* blue ) const;
@@ -61,7 +108,7 @@ public:
    enum {
       NoError = 0,
       OpenError = 1,         // Unable to open file for reading
-      FileFormatError = 2,   // Not recognized as a 24 bit BMP file
+      FileFormatError = 2,   // Not recognized as a 24 bit BMP (or QOI) file
       MemoryError = 3,      // Unable to allocate memory for image data
       ReadError = 4,         // End of file reached prematurely
       WriteError = 5         // Unable to write out data (or no date to write out)
@@ -72,13 +119,31 @@ public:
 
 private:
    unsigned char* ImagePtr;   // array of pixel values (integers range 0 to 255)
+   bool OwnsImagePtr;         // false if ImagePtr is caller owned memory
    long NumRows;            // number of rows in image
    long NumCols;            // number of columns in image
+   int NumChannels;         // bytes per pixel, 3 (RGB) or 1 (gray)
+   long RowStride;          // 0, or bytes per row of mapped or attached data
+   void* MappedFile;         // mapping of MapRawImageFile, 0 if none
+   long MappedSize;
    int ErrorCode;            // error code
 
+   void releaseMapping();
+
+   bool loadBmp( FILE* infile, const char* filename, unsigned char* pixelBuffer, long bufferSize );
+   bool loadGrayBmp( FILE* infile, const char* filename, unsigned char* pixelBuffer, long bufferSize );
+   bool loadQoi( const unsigned char* data, long fileSize, const char* filename,
+                 unsigned char* pixelBuffer, long bufferSize, int numChannels );
+   bool writeBmp( FILE* outfile );
+   bool writeRaw( FILE* outfile );
+   bool writeQoi( FILE* outfile );
+   bool writeRawImage( FILE* outfile );
+   bool readBmpHeader( FILE* infile );
+   bool readBmpHeader( FILE* infile, int* bitsPerPixel, long* dataOffset, long* numColors );
    static short readShort( FILE* infile );
    static long readLong( FILE* infile );
    static void skipChars( FILE* infile, int numChars );
+   static unsigned char* readWholeFile( const char* filename, long* fileSize );
    static void writeLong( long data, FILE* outfile );
    static void writeShort( short data, FILE* outfile );
    
@@ -91,6 +156,11 @@ inline RgbImage::RgbImage()
    NumRows = 0;
    NumCols = 0;
    ImagePtr = 0;
+   OwnsImagePtr = true;
+   NumChannels = 3;
+   RowStride = 0;
+   MappedFile = 0;
+   MappedSize = 0;
    ErrorCode = 0;
 }
 
@@ -99,51 +169,84 @@ inline RgbImage::RgbImage( const char* filename )
    NumRows = 0;
    NumCols = 0;
    ImagePtr = 0;
+   OwnsImagePtr = true;
+   NumChannels = 3;
+   RowStride = 0;
+   MappedFile = 0;
+   MappedSize = 0;
    ErrorCode = 0;
    LoadBmpFile( filename );
 }
 
 inline RgbImage::~RgbImage()
 {
-   delete[] ImagePtr;
+   if ( OwnsImagePtr ) {
+      delete[] ImagePtr;
+   }
+   if ( MappedFile ) {
+      releaseMapping();
+   }
 }
 
-// Returned value points to three "unsigned char" values for R,G,B
-inline const unsigned char* RgbImage::GetRgbPixel( long row, long col ) const
+// Returned value points to NumChannels "unsigned char" values
+inline const unsigned char* RgbImage::GetPixel( long row, long col ) const
 {
    assert ( row<NumRows && col<NumCols );
    const unsigned char* ret = ImagePtr;
-   long i = row*GetNumBytesPerRow() + 3*col;
+   long i = row*GetNumBytesPerRow() + NumChannels*col;
    ret += i;
    return ret;
 }
 
-inline unsigned char* RgbImage::GetRgbPixel( long row, long col )
+inline unsigned char* RgbImage::GetPixel( long row, long col )
 {
    assert ( row<NumRows && col<NumCols );
    unsigned char* ret = ImagePtr;
-   long i = row*GetNumBytesPerRow() + 3*col;
+   long i = row*GetNumBytesPerRow() + NumChannels*col;
    ret += i;
    return ret;
 }
 
+// Returned value points to three "unsigned char" values for R,G,B
+inline const unsigned char* RgbImage::GetRgbPixel( long row, long col ) const
+{
+   assert ( NumChannels==3 );
+   return GetPixel( row, col );
+}
+
+inline unsigned char* RgbImage::GetRgbPixel( long row, long col )
+{
+   assert ( NumChannels==3 );
+   return GetPixel( row, col );
+}
+
 inline void RgbImage::GetRgbPixel( long row, long col, float* red, float* green, float* blue ) const
 {
-   assert ( row<NumRows && col<NumCols );
-   const unsigned char* thePixel = GetRgbPixel( row, col );
+   const unsigned char* thePixel = GetPixel( row, col );
    const float f = 1.0f/255.0f;
-   *red = f*(float)(*(thePixel++));
-   *green = f*(float)(*(thePixel++));
+   *red = f*(float)(*thePixel);
+   if ( NumChannels==3 ) {
+      thePixel++;
+   }
+   *green = f*(float)(*thePixel);
+   if ( NumChannels==3 ) {
+      thePixel++;
+   }
    *blue = f*(float)(*thePixel);
 }
 
 inline void RgbImage::GetRgbPixel( long row, long col, double* red, double* green, double* blue ) const
 {
-   assert ( row<NumRows && col<NumCols );
-   const unsigned char* thePixel = GetRgbPixel( row, col );
+   const unsigned char* thePixel = GetPixel( row, col );
    const double f = 1.0/255.0;
-   *red = f*(double)(*(thePixel++));
-   *green = f*(double)(*(thePixel++));
+   *red = f*(double)(*thePixel);
+   if ( NumChannels==3 ) {
+      thePixel++;
+   }
+   *green = f*(double)(*thePixel);
+   if ( NumChannels==3 ) {
+      thePixel++;
+   }
    *blue = f*(double)(*thePixel);
 }
 
@@ -151,8 +254,16 @@ inline void RgbImage::Reset()
 {
    NumRows = 0;
    NumCols = 0;
-   delete[] ImagePtr;
+   if ( OwnsImagePtr ) {
+      delete[] ImagePtr;
+   }
+   if ( MappedFile ) {
+      releaseMapping();
+   }
    ImagePtr = 0;
+   OwnsImagePtr = true;
+   NumChannels = 3;
+   RowStride = 0;
    ErrorCode = 0;
 }
 
@@ -0,0 +1,41 @@
+#.rst:
+# FindEGL
+# -------
+#
+# Try to find EGL, used for headless (window-less) GL contexts
+#
+# Once done this will define::
+#
+#   EGL_FOUND          - True if EGL was found
+#   EGL_INCLUDE_DIRS   - include directories for EGL
+#   EGL_LIBRARIES      - link against this library to use EGL
+#
+# The module will also define two cache variables::
+#
+#   EGL_INCLUDE_DIR    - the EGL include directory
+#   EGL_LIBRARY        - the path to the EGL library
+#
+
+find_path(EGL_INCLUDE_DIR
+  NAMES
+    EGL/egl.h
+  PATHS
+    /usr/include
+    /usr/local/include
+    /opt/graphics/OpenGL/include)
+
+find_library(EGL_LIBRARY
+  NAMES EGL)
+
+set(EGL_LIBRARIES ${EGL_LIBRARY})
+set(EGL_INCLUDE_DIRS ${EGL_INCLUDE_DIR})
+
+include(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(
+  EGL
+  FOUND_VAR EGL_FOUND
+  REQUIRED_VARS EGL_LIBRARY EGL_INCLUDE_DIR)
+
+mark_as_advanced(
+  EGL_INCLUDE_DIR
+  EGL_LIBRARY)
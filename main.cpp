@@ -1,3 +1,6 @@
+// Declare the GL entry points beyond 1.1 (buffer objects, texture storage,
+// sync objects); libGL on Linux exports them.
+#define GL_GLEXT_PROTOTYPES
 #include <GLFW/glfw3.h>
 #include <GL/glut.h>
 #include <GL/glx.h>
@@ -5,13 +8,47 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "RgbImage.h"
+#include "FrameSource.h"
+#include "AsyncFileIO.h"
+#include "ResultCache.h"
 #include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#ifndef EGL_PLATFORM_DEVICE_EXT
+#define EGL_PLATFORM_DEVICE_EXT 0x313F
+#endif
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+#endif
 
 #include <CL/cl.h>
 #include <CL/cl_gl.h>
 
 char* filename = "img.bmp";
 
+// Number of horizontally adjacent pixels computed by one work-item of the
+// FilterRow kernel. Passed to the kernel source as a build option.
+#define PIXELS_PER_WI 4
+
+// Radius of the 3x3 filter, passed to the kernels as FILTER_SIZE unless the
+// build options of a program set it. See GetFilterRadius.
+#define FILTER_RADIUS 1
+
 ///////////////////////////////////////////////////////////////////////////////
 // Help macros for checking for errors
 #define CHECK_NULL(p) \
@@ -159,8 +196,82 @@ int PrintOpenCLInfo()
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Returns a platform and device id as selected by the user.
-void SelectOpenCLPlatformAndDevice(cl_platform_id* pPlatform, cl_device_id* pDevice)
+// Returns a monotonic time stamp in milliseconds.
+double GetTimeMs()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the type (CPU, GPU, ...) of the input device.
+cl_device_type GetDeviceType(cl_device_id device)
+{
+    cl_int clError;
+    cl_device_type deviceType;
+
+    clError = clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(deviceType), &deviceType, NULL);
+    CHECK_OCL_ERR(clError);
+
+    return deviceType;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns CL_TRUE if the input device supports image objects.
+cl_bool DeviceSupportsImages(cl_device_id device)
+{
+    cl_int clError;
+    cl_bool imageSupport;
+
+    clError = clGetDeviceInfo(device, CL_DEVICE_IMAGE_SUPPORT, sizeof(imageSupport), &imageSupport, NULL);
+    CHECK_OCL_ERR(clError);
+
+    return imageSupport;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns true if the input device lists the extension in CL_DEVICE_EXTENSIONS.
+bool DeviceSupportsExtension(cl_device_id device, const char* extension)
+{
+    cl_int clError;
+    size_t extensionsSize = 0;
+    char* extensions = NULL;
+    bool supported = false;
+
+    clError = clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, NULL, &extensionsSize);
+    CHECK_OCL_ERR(clError);
+
+    extensions = (char*)malloc(extensionsSize + 1);
+    CHECK_NULL(extensions);
+
+    clError = clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, extensionsSize, extensions, NULL);
+    CHECK_OCL_ERR(clError);
+    extensions[extensionsSize] = 0;
+
+    // Match whole, space separated names only
+    size_t length = strlen(extension);
+    for (const char* match = strstr(extensions, extension); match; match = strstr(match + 1, extension))
+    {
+        if ((match == extensions || match[-1] == ' ') && (match[length] == ' ' || match[length] == 0))
+        {
+            supported = true;
+            break;
+        }
+    }
+
+    free(extensions);
+
+    return supported;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns a platform and device id as selected by the user. Platform and
+// device numbers greater than 0 (e.g. from the command line) are used instead
+// of asking.
+void SelectOpenCLPlatformAndDevice(cl_platform_id* pPlatform, cl_device_id* pDevice, int platformNumber, int deviceNumber)
 {
     cl_uint numPlatforms = 0;
     cl_uint numDevices = 0;
@@ -185,10 +296,23 @@ void SelectOpenCLPlatformAndDevice(cl_platform_id* pPlatform, cl_device_id* pDev
     clError = clGetPlatformIDs(numPlatforms, platforms, NULL);
     CHECK_OCL_ERR(clError);
 
-    printf("\n\nSelect platform to use [%d-%d]:", 1, numPlatforms);
-    scanf("%d", &platformIndex);
+    if (platformNumber > 0)
+    {
+        platformIndex = platformNumber;
+    }
+    else
+    {
+        printf("\n\nSelect platform to use [%d-%d]:", 1, numPlatforms);
+        scanf("%d", &platformIndex);
+    }
     platformIndex--;
 
+    if (platformIndex < 0 || platformIndex >= (int)numPlatforms)
+    {
+        printf("\nInvalid platform number %d", platformIndex + 1);
+        exit(EXIT_FAILURE);
+    }
+
     *pPlatform = platforms[platformIndex];
 
     clError = clGetDeviceIDs(platforms[platformIndex], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices);
@@ -200,10 +324,23 @@ void SelectOpenCLPlatformAndDevice(cl_platform_id* pPlatform, cl_device_id* pDev
     clError = clGetDeviceIDs(platforms[platformIndex], CL_DEVICE_TYPE_ALL, numDevices, devices, NULL);
     CHECK_OCL_ERR(clError);
 
-    printf("Select device to use [%d-%d]:", 1, numDevices);
-    scanf("%d", &deviceIndex);
+    if (deviceNumber > 0)
+    {
+        deviceIndex = deviceNumber;
+    }
+    else
+    {
+        printf("Select device to use [%d-%d]:", 1, numDevices);
+        scanf("%d", &deviceIndex);
+    }
     deviceIndex--;
 
+    if (deviceIndex < 0 || deviceIndex >= (int)numDevices)
+    {
+        printf("\nInvalid device number %d", deviceIndex + 1);
+        exit(EXIT_FAILURE);
+    }
+
     *pDevice = devices[deviceIndex];
 
     if (platforms)
@@ -213,8 +350,196 @@ void SelectOpenCLPlatformAndDevice(cl_platform_id* pPlatform, cl_device_id* pDev
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Creates an OpenCL context for the given device and platform.
-cl_context CreateOpenCLContext(cl_platform_id platform, cl_device_id device)
+// The GL context the program renders with and shares textures with OpenCL:
+// either a GLFW window with a GLX context, or a headless EGL context on a
+// pbuffer surface for machines without a display.
+typedef enum
+{
+    GL_BACKEND_GLFW,
+    GL_BACKEND_EGL
+} GLBackend;
+
+typedef struct
+{
+    GLBackend backend;
+    GLFWwindow* window;         // GL_BACKEND_GLFW only
+#ifdef HAVE_EGL
+    EGLDisplay eglDisplay;      // GL_BACKEND_EGL only
+    EGLSurface eglSurface;
+    EGLContext eglContext;
+#endif
+} GLContext;
+
+#ifdef HAVE_EGL
+///////////////////////////////////////////////////////////////////////////////
+// Returns true if EGL reports the client extension, false also if the
+// implementation has no client extensions at all.
+bool HasEGLClientExtension(const char* extension)
+{
+    const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (!extensions)
+    {
+        return false;
+    }
+
+    // Match whole, space separated names only
+    size_t length = strlen(extension);
+    for (const char* match = strstr(extensions, extension); match; match = strstr(match + 1, extension))
+    {
+        if ((match == extensions || match[-1] == ' ') && (match[length] == ' ' || match[length] == 0))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns an initialized EGL display that needs no window system: the first
+// GPU of the device platform, else Mesa's surfaceless platform. Without
+// either extension it falls back to the default display, which needs X11 or
+// Wayland on most implementations. Returns EGL_NO_DISPLAY on failure.
+EGLDisplay GetHeadlessEGLDisplay()
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = NULL;
+    if (HasEGLClientExtension("EGL_EXT_platform_base"))
+    {
+        getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    }
+
+    if (getPlatformDisplay && HasEGLClientExtension("EGL_EXT_platform_device") &&
+        HasEGLClientExtension("EGL_EXT_device_enumeration"))
+    {
+        PFNEGLQUERYDEVICESEXTPROC queryDevices = (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+        EGLDeviceEXT device;
+        EGLint numDevices = 0;
+
+        if (queryDevices && queryDevices(1, &device, &numDevices) && numDevices > 0)
+        {
+            EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, device, NULL);
+            if (EGL_NO_DISPLAY != display && eglInitialize(display, NULL, NULL))
+            {
+                return display;
+            }
+        }
+    }
+
+    if (getPlatformDisplay && HasEGLClientExtension("EGL_MESA_platform_surfaceless"))
+    {
+        EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        if (EGL_NO_DISPLAY != display && eglInitialize(display, NULL, NULL))
+        {
+            return display;
+        }
+    }
+
+    EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (EGL_NO_DISPLAY != display && eglInitialize(display, NULL, NULL))
+    {
+        return display;
+    }
+
+    return EGL_NO_DISPLAY;
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Creates a headless desktop GL context rendering to a width x height pbuffer
+// through EGL and makes it current. Works with Mesa's software rasterizer.
+// Returns false if EGL is not available or the context can not be created.
+bool CreateHeadlessGLContext(GLContext* glContext, int width, int height)
+{
+    CHECK_NULL(glContext);
+
+    memset(glContext, 0, sizeof(*glContext));
+    glContext->backend = GL_BACKEND_EGL;
+
+#ifdef HAVE_EGL
+    EGLint numConfigs = 0;
+    EGLConfig config;
+
+    const EGLint configAttributes[] =
+    {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+
+    const EGLint pbufferAttributes[] =
+    {
+        EGL_WIDTH, width,
+        EGL_HEIGHT, height,
+        EGL_NONE
+    };
+
+    glContext->eglDisplay = GetHeadlessEGLDisplay();
+    if (EGL_NO_DISPLAY == glContext->eglDisplay)
+    {
+        printf("\nUnable to initialize EGL");
+        return false;
+    }
+
+    if (!eglChooseConfig(glContext->eglDisplay, configAttributes, &config, 1, &numConfigs) || numConfigs < 1)
+    {
+        printf("\nNo EGL config with pbuffer and desktop GL support");
+        return false;
+    }
+
+    glContext->eglSurface = eglCreatePbufferSurface(glContext->eglDisplay, config, pbufferAttributes);
+    eglBindAPI(EGL_OPENGL_API);
+    glContext->eglContext = eglCreateContext(glContext->eglDisplay, config, EGL_NO_CONTEXT, NULL);
+
+    if (EGL_NO_SURFACE == glContext->eglSurface || EGL_NO_CONTEXT == glContext->eglContext ||
+        !eglMakeCurrent(glContext->eglDisplay, glContext->eglSurface, glContext->eglSurface, glContext->eglContext))
+    {
+        printf("\nUnable to create the EGL pbuffer context");
+        return false;
+    }
+
+    return true;
+#else
+    printf("\nHeadless mode requires EGL support at build time");
+    return false;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Destroys the GL context and its window or pbuffer.
+void DestroyGLContext(GLContext* glContext)
+{
+    CHECK_NULL(glContext);
+
+    if (GL_BACKEND_GLFW == glContext->backend)
+    {
+        if (glContext->window)
+            glfwDestroyWindow(glContext->window);
+        glfwTerminate();
+    }
+#ifdef HAVE_EGL
+    else if (glContext->eglDisplay)
+    {
+        eglMakeCurrent(glContext->eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (glContext->eglContext)
+            eglDestroyContext(glContext->eglDisplay, glContext->eglContext);
+        if (glContext->eglSurface)
+            eglDestroySurface(glContext->eglDisplay, glContext->eglSurface);
+        eglTerminate(glContext->eglDisplay);
+    }
+#endif
+
+    memset(glContext, 0, sizeof(*glContext));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Creates an OpenCL context for the given device and platform that shares
+// objects with the current GL context of the given backend. If glContext is
+// NULL the context does not share with GL (devices without cl_khr_gl_sharing).
+cl_context CreateOpenCLContext(cl_platform_id platform, cl_device_id device, const GLContext* glContext)
 {
     cl_int clError;
     cl_context context;
@@ -227,6 +552,19 @@ cl_context CreateOpenCLContext(cl_platform_id platform, cl_device_id device)
         0
     };
 
+    if (!glContext)
+    {
+        contextProperties[2] = 0;
+    }
+#ifdef HAVE_EGL
+    else if (GL_BACKEND_EGL == glContext->backend)
+    {
+        contextProperties[3] = (cl_context_properties)glContext->eglContext;
+        contextProperties[4] = CL_EGL_DISPLAY_KHR;
+        contextProperties[5] = (cl_context_properties)glContext->eglDisplay;
+    }
+#endif
+
     context = clCreateContext(contextProperties, 1, &device, NULL, NULL, &clError);
     CHECK_OCL_ERR(clError);
 
@@ -263,6 +601,56 @@ cl_command_queue CreateOpenCLQueue(cl_device_id device, cl_context context)
     return queue;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// How the work of one host thread is submitted to the device:
+// QUEUE_MODE_IN_ORDER     - one in-order queue, commands run one after another
+// QUEUE_MODE_OUT_OF_ORDER - one out-of-order queue, ordering only by events
+// QUEUE_MODE_SPLIT        - separate in-order transfer and compute queues,
+//                           ordered between each other by events
+// The last two let transfers of one job overlap the kernel of another.
+typedef enum
+{
+    QUEUE_MODE_IN_ORDER,
+    QUEUE_MODE_OUT_OF_ORDER,
+    QUEUE_MODE_SPLIT
+} QueueMode;
+
+///////////////////////////////////////////////////////////////////////////////
+// Creates an OpenCL queue with the given properties. If the device does not
+// support out-of-order execution an in-order queue is created instead.
+cl_command_queue CreateOpenCLQueueWithProperties(cl_device_id device, cl_context context, cl_command_queue_properties properties)
+{
+    cl_int clError;
+    cl_command_queue queue;
+    cl_command_queue_properties supported = 0;
+
+    clError = clGetDeviceInfo(device, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported), &supported, NULL);
+    CHECK_OCL_ERR(clError);
+
+    queue = clCreateCommandQueue(context, device, properties & supported, &clError);
+    CHECK_OCL_ERR(clError);
+
+    return queue;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the queue mode suited to the device: out-of-order where the device
+// supports it (e.g. multi-core CPU runtimes), otherwise separate transfer and
+// compute queues, which lets devices with DMA engines copy while computing.
+QueueMode GetDefaultQueueMode(cl_device_id device)
+{
+    cl_int clError;
+    cl_command_queue_properties supported = 0;
+
+    clError = clGetDeviceInfo(device, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported), &supported, NULL);
+    CHECK_OCL_ERR(clError);
+
+    if (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+        return QUEUE_MODE_OUT_OF_ORDER;
+
+    return QUEUE_MODE_SPLIT;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Releases the input OpenCL queue.
 void ReleaseOpenCLQueue(cl_command_queue *pQueue)
@@ -358,216 +746,3460 @@ void CopyHostToDevice(void* hostBuffer, cl_mem deviceBuffer, size_t sizeInBytes,
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Copies data from a device buffer back to host.
-void CopyDeviceToHost(cl_mem deviceBuffer, void* hostBuffer, size_t sizeInBytes, cl_command_queue queue, cl_bool blocking)
+// Copies data from a host buffer to an OpenCL device buffer without blocking.
+// The copy starts after the events of waitList and signals *pEvent.
+void CopyHostToDeviceAsync(const void* hostBuffer, cl_mem deviceBuffer, size_t sizeInBytes, cl_command_queue queue,
+                           cl_uint numWaitEvents, const cl_event* waitList, cl_event* pEvent)
 {
     cl_int clError;
 
-    clError = clEnqueueReadBuffer(queue, deviceBuffer, blocking, 0, sizeInBytes, hostBuffer, 0, NULL, NULL);
+    clError = clEnqueueWriteBuffer(queue, deviceBuffer, CL_FALSE, 0, sizeInBytes, hostBuffer, numWaitEvents, waitList, pEvent);
 
     CHECK_OCL_ERR(clError);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Loads the OpenCL code from the input file.
-char* LoadOpenCLSourceFromFile(const char* filePath, size_t *pSourceLength)
+// Copies data from a device buffer back to host without blocking. The copy
+// starts after the events of waitList and signals *pEvent.
+void CopyDeviceToHostAsync(cl_mem deviceBuffer, void* hostBuffer, size_t sizeInBytes, cl_command_queue queue,
+                           cl_uint numWaitEvents, const cl_event* waitList, cl_event* pEvent)
 {
-    FILE* fileHandle;
-    char* sourceCode;
-
-    fileHandle = fopen(filePath, "rb");
-    CHECK_NULL(fileHandle);
-    fseek(fileHandle, 0, SEEK_END);
-
-    *pSourceLength = ftell(fileHandle);
-    sourceCode = (char*)malloc((*pSourceLength) + 1);
-    CHECK_NULL(sourceCode);
-
-    fseek(fileHandle, 0, SEEK_SET);
-    fread(sourceCode, *pSourceLength, 1, fileHandle);
-    sourceCode[(*pSourceLength)] = 0;
-    *pSourceLength = (*pSourceLength) + 1;
+    cl_int clError;
 
-    fclose(fileHandle);
+    clError = clEnqueueReadBuffer(queue, deviceBuffer, CL_FALSE, 0, sizeInBytes, hostBuffer, numWaitEvents, waitList, pEvent);
 
-    return sourceCode;
+    CHECK_OCL_ERR(clError);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Builds an OpenCL program for the specified device
-void BuildProgram(cl_program program, cl_device_id device)
+// Releases an OpenCL event object.
+void ReleaseEvent(cl_event *pEvent)
 {
     cl_int clError;
-    char *buildLog;
-    size_t buildLogSize;
-    //char buildOptions[256];
-    
-    //sprintf(buildOptions, "-DVALS_PER_WI=%d", VALS_PER_WI);
-    clError = clBuildProgram(program, 1, &device, NULL, NULL, NULL);
-    if (CL_SUCCESS != clError)
-    {
-        printf("\nOpenCL error %d at line %d in file %s", clError, __LINE__, __FILE__);
 
-        buildLog = NULL;
-        buildLogSize = 0;
+    CHECK_NULL(pEvent);
 
-        clError = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &buildLogSize);
+    if (*pEvent)
+    {
+        clError = clReleaseEvent(*pEvent);
         CHECK_OCL_ERR(clError);
 
-        if (buildLogSize)
-        {
-            // Allocate memory to fit the build log - it can be very large in case of errors
-            buildLog = (char*)malloc(buildLogSize);
-            if (buildLog)
-            {
-                clError = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, buildLogSize, buildLog, NULL);
-                CHECK_OCL_ERR(clError);
-
-                printf("\nOpenCL program build info: \n%s\n", buildLog);
-
-                // Free buildLog buffer
-                free(buildLog);
-            }
-        }
-
-        exit(EXIT_FAILURE);
+        *pEvent = 0;
     }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Creates and builds an OpenCL program with the input source code for
-// the given context and source code string.
-cl_program CreateAndBuildProgramFromSource(cl_context context, char* sourceCode, size_t sourceCodeLength)
+// Copies data from a device buffer back to host.
+void CopyDeviceToHost(cl_mem deviceBuffer, void* hostBuffer, size_t sizeInBytes, cl_command_queue queue, cl_bool blocking)
 {
-    cl_program program;
     cl_int clError;
-    cl_device_id device;
 
-    clError = clGetContextInfo(context, CL_CONTEXT_DEVICES, sizeof(cl_device_id), &device, NULL);
-    CHECK_OCL_ERR(clError);
+    clError = clEnqueueReadBuffer(queue, deviceBuffer, blocking, 0, sizeInBytes, hostBuffer, 0, NULL, NULL);
 
-    program = clCreateProgramWithSource(context, 1, (const char**)(&sourceCode), &sourceCodeLength, &clError);
     CHECK_OCL_ERR(clError);
-
-    BuildProgram(program, device);
-
-    return program;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Releases an OpenCL program object.
-void ReleaseProgram(cl_program *pProgram)
+// Pool of pinned staging buffers for host-device transfers. Each buffer is
+// allocated with CL_MEM_ALLOC_HOST_PTR and mapped once for its whole lifetime,
+// so images can be loaded straight into pinned memory and transferred without
+// the runtime staging a pageable copy first. Buffers are reused across frames.
+#define MAX_STAGING_BUFFERS 4
+
+typedef struct
 {
-    cl_int clError;
+    cl_mem buffer;          // CL_MEM_ALLOC_HOST_PTR buffer
+    void* hostPtr;          // persistent host mapping of buffer
+    size_t sizeInBytes;
+    int inUse;
+} StagingBuffer;
 
-    CHECK_NULL(pProgram);
+typedef struct
+{
+    cl_context context;
+    cl_command_queue queue;
+    pthread_mutex_t lock;
+    StagingBuffer buffers[MAX_STAGING_BUFFERS];
+} StagingPool;
 
-    if (*pProgram)
-    {
-        clError = clReleaseProgram(*pProgram);
-        CHECK_OCL_ERR(clError);
+///////////////////////////////////////////////////////////////////////////////
+// Initializes an empty staging pool. Buffers are created on demand.
+void InitStagingPool(StagingPool* pool, cl_context context, cl_command_queue queue)
+{
+    CHECK_NULL(pool);
 
-        *pProgram = 0;
-    }
+    memset(pool, 0, sizeof(*pool));
+    pool->context = context;
+    pool->queue = queue;
+    pthread_mutex_init(&pool->lock, NULL);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Creates an OpenCL kernel object for the kernel with the given name.
-cl_kernel CreateKernel(cl_program program, const char* kernelName)
+// Unmaps and releases one staging buffer of the pool.
+void ReleaseStagingBufferMemory(StagingPool* pool, StagingBuffer* staging)
 {
     cl_int clError;
-    cl_kernel kernel;
 
-    kernel = clCreateKernel(program, kernelName, &clError);
-    CHECK_OCL_ERR(clError);
+    if (staging->buffer)
+    {
+        clError = clEnqueueUnmapMemObject(pool->queue, staging->buffer, staging->hostPtr, 0, NULL, NULL);
+        CHECK_OCL_ERR(clError);
+        clFinish(pool->queue);
 
-    return kernel;
+        ReleaseDeviceBuffer(&staging->buffer);
+    }
+
+    memset(staging, 0, sizeof(*staging));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Releases an OpenCL kernel object.
-void ReleaseKernel(cl_kernel *pKernel)
+// Returns a mapped staging buffer of at least sizeInBytes bytes. A free buffer
+// that is large enough is reused, otherwise an empty slot (or the smallest
+// free buffer) is (re)allocated.
+StagingBuffer* AcquireStagingBuffer(StagingPool* pool, size_t sizeInBytes)
 {
     cl_int clError;
+    StagingBuffer* victim = NULL;
 
-    CHECK_NULL(pKernel);
+    CHECK_NULL(pool);
 
-    if (*pKernel)
+    pthread_mutex_lock(&pool->lock);
+
+    for (int i = 0; i < MAX_STAGING_BUFFERS; i++)
     {
-        clError = clReleaseKernel(*pKernel);
-        CHECK_OCL_ERR(clError);
+        StagingBuffer* staging = &pool->buffers[i];
 
-        *pKernel = 0;
+        if (staging->inUse)
+            continue;
+
+        if (staging->buffer && staging->sizeInBytes >= sizeInBytes)
+        {
+            staging->inUse = 1;
+            pthread_mutex_unlock(&pool->lock);
+            return staging;
+        }
+
+        if (!victim || !staging->buffer || (victim->buffer && staging->sizeInBytes < victim->sizeInBytes))
+            victim = staging;
+    }
+
+    // All buffers are in use
+    CHECK_NULL(victim);
+
+    ReleaseStagingBufferMemory(pool, victim);
+
+    victim->buffer = clCreateBuffer(pool->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, sizeInBytes, NULL, &clError);
+    CHECK_OCL_ERR(clError);
+
+    victim->hostPtr = clEnqueueMapBuffer(pool->queue, victim->buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, sizeInBytes, 0, NULL, NULL, &clError);
+    CHECK_OCL_ERR(clError);
+
+    victim->sizeInBytes = sizeInBytes;
+    victim->inUse = 1;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return victim;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns a staging buffer to the pool. It stays mapped for reuse.
+void ReleaseStagingBuffer(StagingPool* pool, StagingBuffer* staging)
+{
+    CHECK_NULL(pool);
+    CHECK_NULL(staging);
+
+    pthread_mutex_lock(&pool->lock);
+    staging->inUse = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Unmaps and releases all buffers of the pool.
+void ReleaseStagingPool(StagingPool* pool)
+{
+    CHECK_NULL(pool);
+
+    for (int i = 0; i < MAX_STAGING_BUFFERS; i++)
+        ReleaseStagingBufferMemory(pool, &pool->buffers[i]);
+
+    pthread_mutex_destroy(&pool->lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Loads a BMP or QOI file directly into a staging buffer of the pool, as RGB
+// or, with numChannels 1, as gray values. QOI files are decoded straight into
+// the staging memory. The returned buffer backs the pixel data of image and
+// must be released after the last use of image.
+StagingBuffer* LoadImageFileToStaging(StagingPool* pool, const char* filePath, int numChannels, RgbImage* image)
+{
+    long numRows = 0;
+    long numCols = 0;
+
+    if (!RgbImage::ReadImageFileSize(filePath, &numRows, &numCols))
+        exit(EXIT_FAILURE);
+
+    // Rows are padded to 4 bytes, same as RgbImage::GetNumBytesPerRow()
+    size_t sizeInBytes = numRows * (((numChannels * numCols + 3) >> 2) << 2);
+    StagingBuffer* staging = AcquireStagingBuffer(pool, sizeInBytes);
+
+    if (!image->LoadImageFile(filePath, (unsigned char*)staging->hostPtr, (long)staging->sizeInBytes, numChannels))
+        exit(EXIT_FAILURE);
+
+    return staging;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Pool of device memory objects (buffers and 2D images) that are recycled
+// instead of being created and released for every job. Objects are matched by
+// type, flags, size and image format. Free objects are released in least
+// recently used order once the pool would grow beyond its budget, which is
+// derived from CL_DEVICE_GLOBAL_MEM_SIZE.
+#define MAX_POOLED_MEM_OBJECTS 32
+
+typedef struct
+{
+    cl_mem memObject;
+    cl_mem_object_type type;    // CL_MEM_OBJECT_BUFFER or CL_MEM_OBJECT_IMAGE2D
+    cl_mem_flags flags;
+    size_t sizeInBytes;         // buffer size, or estimated image size
+    size_t width;               // images only
+    size_t height;              // images only
+    cl_image_format format;     // images only
+    int inUse;
+    unsigned long lastUse;      // LRU stamp
+} PooledMemObject;
+
+typedef struct
+{
+    cl_context context;
+    cl_ulong budget;            // bytes the pool may hold before trimming
+    cl_ulong allocated;         // bytes currently held (free and in use)
+    unsigned long useCounter;
+    pthread_mutex_t lock;
+    PooledMemObject entries[MAX_POOLED_MEM_OBJECTS];
+} DeviceMemoryPool;
+
+///////////////////////////////////////////////////////////////////////////////
+// Initializes an empty memory pool. The pool may use up to three quarters of
+// the global memory of the device before free objects are trimmed.
+void InitDeviceMemoryPool(DeviceMemoryPool* pool, cl_context context, cl_device_id device)
+{
+    cl_int clError;
+    cl_ulong globalMemSize = 0;
+
+    CHECK_NULL(pool);
+
+    clError = clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(globalMemSize), &globalMemSize, NULL);
+    CHECK_OCL_ERR(clError);
+
+    memset(pool, 0, sizeof(*pool));
+    pool->context = context;
+    pool->budget = globalMemSize / 4 * 3;
+    pthread_mutex_init(&pool->lock, NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the size of one pixel in bytes for the given image format.
+size_t GetImageFormatPixelSize(const cl_image_format* format)
+{
+    size_t channels = 4;
+    size_t channelSize = 4;
+
+    switch (format->image_channel_order)
+    {
+    case CL_R:
+    case CL_LUMINANCE:
+        channels = 1;
+        break;
+    case CL_RG:
+        channels = 2;
+        break;
+    }
+
+    switch (format->image_channel_data_type)
+    {
+    case CL_UNORM_INT8:
+    case CL_UNSIGNED_INT8:
+        channelSize = 1;
+        break;
+    }
+
+    return channels * channelSize;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Releases free pooled objects, least recently used first, until
+// requiredBytes more bytes fit into the budget or nothing is left to release.
+// The pool must be locked by the caller.
+void TrimDeviceMemoryPool(DeviceMemoryPool* pool, size_t requiredBytes)
+{
+    CHECK_NULL(pool);
+
+    while (pool->allocated + requiredBytes > pool->budget)
+    {
+        PooledMemObject* oldest = NULL;
+
+        for (int i = 0; i < MAX_POOLED_MEM_OBJECTS; i++)
+        {
+            PooledMemObject* entry = &pool->entries[i];
+            if (entry->memObject && !entry->inUse && (!oldest || entry->lastUse < oldest->lastUse))
+                oldest = entry;
+        }
+
+        if (!oldest)
+            break;
+
+        pool->allocated -= oldest->sizeInBytes;
+        ReleaseDeviceBuffer(&oldest->memObject);
+        memset(oldest, 0, sizeof(*oldest));
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Looks up a free pooled object matching the given description. If there is
+// none a new object is created in an empty slot (or in place of the least
+// recently used free object). format, width and height are ignored for
+// buffers.
+cl_mem AcquirePooledMemObject(DeviceMemoryPool* pool, cl_mem_object_type type, cl_mem_flags flags, size_t sizeInBytes,
+                              const cl_image_format* format, size_t width, size_t height)
+{
+    cl_int clError;
+    PooledMemObject* slot = NULL;
+
+    CHECK_NULL(pool);
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (int i = 0; i < MAX_POOLED_MEM_OBJECTS; i++)
+    {
+        PooledMemObject* entry = &pool->entries[i];
+
+        if (entry->memObject && !entry->inUse && entry->type == type && entry->flags == flags && entry->sizeInBytes == sizeInBytes &&
+            (type == CL_MEM_OBJECT_BUFFER ||
+             (entry->width == width && entry->height == height &&
+              entry->format.image_channel_order == format->image_channel_order &&
+              entry->format.image_channel_data_type == format->image_channel_data_type)))
+        {
+            entry->inUse = 1;
+            entry->lastUse = ++pool->useCounter;
+            pthread_mutex_unlock(&pool->lock);
+            return entry->memObject;
+        }
+    }
+
+    // Make room in the budget, then take an empty slot or the LRU free entry
+    TrimDeviceMemoryPool(pool, sizeInBytes);
+
+    for (int i = 0; i < MAX_POOLED_MEM_OBJECTS; i++)
+    {
+        PooledMemObject* entry = &pool->entries[i];
+
+        if (!entry->memObject)
+        {
+            slot = entry;
+            break;
+        }
+        if (!entry->inUse && (!slot || entry->lastUse < slot->lastUse))
+            slot = entry;
+    }
+
+    // All entries are in use
+    CHECK_NULL(slot);
+
+    if (slot->memObject)
+    {
+        pool->allocated -= slot->sizeInBytes;
+        ReleaseDeviceBuffer(&slot->memObject);
+    }
+    memset(slot, 0, sizeof(*slot));
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (type == CL_MEM_OBJECT_BUFFER)
+        {
+            slot->memObject = clCreateBuffer(pool->context, flags, sizeInBytes, NULL, &clError);
+        }
+        else
+        {
+            cl_image_desc imageDesc;
+
+            memset(&imageDesc, 0, sizeof(imageDesc));
+            imageDesc.image_type = CL_MEM_OBJECT_IMAGE2D;
+            imageDesc.image_width = width;
+            imageDesc.image_height = height;
+
+            slot->memObject = clCreateImage(pool->context, flags, format, &imageDesc, NULL, &clError);
+        }
+
+        // Out of device memory: drop every free object and try once more
+        if ((CL_MEM_OBJECT_ALLOCATION_FAILURE == clError || CL_OUT_OF_RESOURCES == clError) && 0 == attempt)
+            TrimDeviceMemoryPool(pool, (size_t)pool->budget);
+        else
+            break;
+    }
+    CHECK_OCL_ERR(clError);
+
+    slot->type = type;
+    slot->flags = flags;
+    slot->sizeInBytes = sizeInBytes;
+    if (type != CL_MEM_OBJECT_BUFFER)
+    {
+        slot->width = width;
+        slot->height = height;
+        slot->format = *format;
+    }
+    slot->inUse = 1;
+    slot->lastUse = ++pool->useCounter;
+    pool->allocated += sizeInBytes;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return slot->memObject;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns a pooled device buffer of sizeInBytes bytes.
+cl_mem AcquirePooledBuffer(DeviceMemoryPool* pool, cl_mem_flags flags, size_t sizeInBytes)
+{
+    return AcquirePooledMemObject(pool, CL_MEM_OBJECT_BUFFER, flags, sizeInBytes, NULL, 0, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns a pooled 2D image of the given size and format.
+cl_mem AcquirePooledImage(DeviceMemoryPool* pool, cl_mem_flags flags, const cl_image_format* format, size_t width, size_t height)
+{
+    CHECK_NULL(format);
+
+    return AcquirePooledMemObject(pool, CL_MEM_OBJECT_IMAGE2D, flags, width * height * GetImageFormatPixelSize(format), format, width, height);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns a memory object to the pool and clears the caller's handle. Objects
+// that do not belong to the pool are released.
+void ReleasePooledMemObject(DeviceMemoryPool* pool, cl_mem* pMemObject)
+{
+    CHECK_NULL(pool);
+    CHECK_NULL(pMemObject);
+
+    if (!*pMemObject)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (int i = 0; i < MAX_POOLED_MEM_OBJECTS; i++)
+    {
+        if (pool->entries[i].memObject == *pMemObject)
+        {
+            pool->entries[i].inUse = 0;
+            *pMemObject = 0;
+            pthread_mutex_unlock(&pool->lock);
+            return;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    ReleaseDeviceBuffer(pMemObject);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Releases all objects of the pool.
+void ReleaseDeviceMemoryPool(DeviceMemoryPool* pool)
+{
+    CHECK_NULL(pool);
+
+    for (int i = 0; i < MAX_POOLED_MEM_OBJECTS; i++)
+        ReleaseDeviceBuffer(&pool->entries[i].memObject);
+
+    pthread_mutex_destroy(&pool->lock);
+    memset(pool, 0, sizeof(*pool));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Loads the OpenCL code from the input file.
+char* LoadOpenCLSourceFromFile(const char* filePath, size_t *pSourceLength)
+{
+    FILE* fileHandle;
+    char* sourceCode;
+
+    fileHandle = fopen(filePath, "rb");
+    CHECK_NULL(fileHandle);
+    fseek(fileHandle, 0, SEEK_END);
+
+    *pSourceLength = ftell(fileHandle);
+    sourceCode = (char*)malloc((*pSourceLength) + 1);
+    CHECK_NULL(sourceCode);
+
+    fseek(fileHandle, 0, SEEK_SET);
+    fread(sourceCode, *pSourceLength, 1, fileHandle);
+    sourceCode[(*pSourceLength)] = 0;
+    *pSourceLength = (*pSourceLength) + 1;
+
+    fclose(fileHandle);
+
+    return sourceCode;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the filter radius (FILTER_SIZE) of a program built with the extra
+// build options extraOptions (may be NULL). The halos of dirty rectangles
+// and regions of interest must be at least this wide.
+int GetFilterRadius(const char* extraOptions)
+{
+    const char* option = extraOptions ? strstr(extraOptions, "-DFILTER_SIZE=") : NULL;
+
+    return option ? atoi(option + strlen("-DFILTER_SIZE=")) : FILTER_RADIUS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Builds an OpenCL program for the specified device. extraOptions (may be
+// NULL) is appended to the common build options.
+void BuildProgram(cl_program program, cl_device_id device, const char* extraOptions)
+{
+    cl_int clError;
+    char *buildLog;
+    size_t buildLogSize;
+    char buildOptions[256];
+    
+    snprintf(buildOptions, sizeof(buildOptions), "-DPIXELS_PER_WI=%d -DFILTER_SIZE=%d %s", PIXELS_PER_WI, GetFilterRadius(extraOptions),
+             extraOptions ? extraOptions : "");
+    clError = clBuildProgram(program, 1, &device, buildOptions, NULL, NULL);
+    if (CL_SUCCESS != clError)
+    {
+        printf("\nOpenCL error %d at line %d in file %s", clError, __LINE__, __FILE__);
+
+        buildLog = NULL;
+        buildLogSize = 0;
+
+        clError = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &buildLogSize);
+        CHECK_OCL_ERR(clError);
+
+        if (buildLogSize)
+        {
+            // Allocate memory to fit the build log - it can be very large in case of errors
+            buildLog = (char*)malloc(buildLogSize);
+            if (buildLog)
+            {
+                clError = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, buildLogSize, buildLog, NULL);
+                CHECK_OCL_ERR(clError);
+
+                printf("\nOpenCL program build info: \n%s\n", buildLog);
+
+                // Free buildLog buffer
+                free(buildLog);
+            }
+        }
+
+        exit(EXIT_FAILURE);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Creates and builds an OpenCL program with the input source code for
+// the given context and source code string.
+cl_program CreateAndBuildProgramFromSource(cl_context context, char* sourceCode, size_t sourceCodeLength, const char* buildOptions)
+{
+    cl_program program;
+    cl_int clError;
+    cl_device_id device;
+
+    clError = clGetContextInfo(context, CL_CONTEXT_DEVICES, sizeof(cl_device_id), &device, NULL);
+    CHECK_OCL_ERR(clError);
+
+    program = clCreateProgramWithSource(context, 1, (const char**)(&sourceCode), &sourceCodeLength, &clError);
+    CHECK_OCL_ERR(clError);
+
+    BuildProgram(program, device, buildOptions);
+
+    return program;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Releases an OpenCL program object.
+void ReleaseProgram(cl_program *pProgram)
+{
+    cl_int clError;
+
+    CHECK_NULL(pProgram);
+
+    if (*pProgram)
+    {
+        clError = clReleaseProgram(*pProgram);
+        CHECK_OCL_ERR(clError);
+
+        *pProgram = 0;
     }
 }
 
-GLuint loadTextureFromFile(RgbImage theTexMap, int id)
-{   
-	GLuint texture;
-	glGenTextures(id, &texture); // Get the First Free Name to use for the Font Texture
-	glBindTexture(GL_TEXTURE_2D, texture); // Actually create the texture object
-    glClearColor (0.0, 0.0, 0.0, 0.0);
-    glShadeModel(GL_FLAT);
-    glEnable(GL_DEPTH_TEST);
+///////////////////////////////////////////////////////////////////////////////
+// Creates an OpenCL kernel object for the kernel with the given name.
+cl_kernel CreateKernel(cl_program program, const char* kernelName)
+{
+    cl_int clError;
+    cl_kernel kernel;
+
+    kernel = clCreateKernel(program, kernelName, &clError);
+    CHECK_OCL_ERR(clError);
+
+    return kernel;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Releases an OpenCL kernel object.
+void ReleaseKernel(cl_kernel *pKernel)
+{
+    cl_int clError;
+
+    CHECK_NULL(pKernel);
+
+    if (*pKernel)
+    {
+        clError = clReleaseKernel(*pKernel);
+        CHECK_OCL_ERR(clError);
+
+        *pKernel = 0;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Checks whether all filter weights are integers scaled by one power of two,
+// like the binomial kernels normalized by 16. On success the integer weights
+// are stored in intWeights and the shift that normalizes them is returned,
+// otherwise -1 is returned and the float kernels have to be used.
+int GetFixedPointWeights(const float* weights, int count, int* intWeights)
+{
+    for (int shift = 0; shift <= 15; shift++)
+    {
+        bool exact = true;
+
+        for (int i = 0; i < count && exact; i++)
+        {
+            float scaled = ldexpf(weights[i], shift);
+            exact = (scaled == floorf(scaled)) && (fabsf(scaled) <= 32767.0f);
+            intWeights[i] = (int)scaled;
+        }
+
+        if (exact)
+            return shift;
+    }
+
+    return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the narrowest accumulator type the fixed-point kernels can use for
+// the given integer weights: ushort when the sum of 8-bit products plus the
+// rounding term always fits in 16 bits, int otherwise.
+const char* GetFixedPointAccumulator(const int* intWeights, int count, int shift)
+{
+    long maxSum = (shift > 0) ? (1L << (shift - 1)) : 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (intWeights[i] < 0)
+            return "int";
+        maxSum += 255L * intWeights[i];
+    }
+
+    return (maxSum <= 65535) ? "ushort" : "int";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Per-thread OpenCL objects. Kernel arguments are not thread-safe, so every
+// host thread that enqueues work gets its own kernel objects, created from
+// the shared and already built program, and its own in-order command queue.
+// Threads can then set arguments and enqueue concurrently.
+#define MAX_THREAD_KERNELS 8
+
+typedef struct
+{
+    cl_program program;
+    const char* name;
+    cl_kernel kernel;
+} ThreadKernel;
+
+typedef struct
+{
+    cl_context context;
+    QueueMode mode;
+    cl_command_queue queue;             // compute queue
+    cl_command_queue transferQueue;     // same as queue unless QUEUE_MODE_SPLIT
+    ThreadKernel kernels[MAX_THREAD_KERNELS];
+    int numKernels;
+} ThreadResources;
+
+static __thread ThreadResources* threadResources = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the OpenCL objects of the calling thread, creating them on first use.
+ThreadResources* GetThreadResources()
+{
+    if (!threadResources)
+    {
+        threadResources = (ThreadResources*)calloc(1, sizeof(ThreadResources));
+        CHECK_NULL(threadResources);
+    }
+
+    return threadResources;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the calling thread's compute and transfer queues for the given
+// context and device, created on first use according to mode. A thread keeps
+// the queues of its first call, asking for another mode later is an error.
+// pTransferQueue may be NULL.
+cl_command_queue GetThreadQueues(cl_context context, cl_device_id device, QueueMode mode, cl_command_queue* pTransferQueue)
+{
+    ThreadResources* resources = GetThreadResources();
+
+    if (resources->queue && resources->mode != mode)
+    {
+        printf("\nQueue mode %d requested by a thread that uses queue mode %d", mode, resources->mode);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!resources->queue)
+    {
+        resources->context = context;
+        resources->mode = mode;
+
+        switch (mode)
+        {
+        case QUEUE_MODE_OUT_OF_ORDER:
+            resources->queue = CreateOpenCLQueueWithProperties(device, context, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+            resources->transferQueue = resources->queue;
+            break;
+        case QUEUE_MODE_SPLIT:
+            resources->queue = CreateOpenCLQueue(device, context);
+            resources->transferQueue = CreateOpenCLQueue(device, context);
+            break;
+        default:
+            resources->queue = CreateOpenCLQueue(device, context);
+            resources->transferQueue = resources->queue;
+            break;
+        }
+    }
+
+    if (pTransferQueue)
+        *pTransferQueue = resources->transferQueue;
+
+    return resources->queue;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the calling thread's instance of the named kernel of the program.
+// kernelName must stay valid while the thread uses the kernel.
+cl_kernel GetThreadKernel(cl_program program, const char* kernelName)
+{
+    ThreadResources* resources = GetThreadResources();
+
+    for (int i = 0; i < resources->numKernels; i++)
+    {
+        ThreadKernel* cached = &resources->kernels[i];
+        if (cached->program == program && 0 == strcmp(cached->name, kernelName))
+            return cached->kernel;
+    }
+
+    if (resources->numKernels >= MAX_THREAD_KERNELS)
+    {
+        printf("\nToo many kernels cached by one thread");
+        exit(EXIT_FAILURE);
+    }
+
+    // clCreateKernel on a built program is thread-safe and gives an instance
+    // with its own argument state
+    ThreadKernel* cached = &resources->kernels[resources->numKernels++];
+    cached->program = program;
+    cached->name = kernelName;
+    cached->kernel = CreateKernel(program, kernelName);
+
+    return cached->kernel;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Releases the OpenCL objects of the calling thread. Must be called by every
+// thread that used GetThreadQueues or GetThreadKernel before it exits.
+void ReleaseThreadResources()
+{
+    ThreadResources* resources = threadResources;
+
+    if (!resources)
+        return;
+
+    for (int i = 0; i < resources->numKernels; i++)
+        ReleaseKernel(&resources->kernels[i].kernel);
+
+    if (resources->transferQueue != resources->queue)
+        ReleaseOpenCLQueue(&resources->transferQueue);
+    ReleaseOpenCLQueue(&resources->queue);
+
+    free(resources);
+    threadResources = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns true if the current GL context is at least version major.minor or
+// advertises the given extension.
+bool HasGLFeature(int major, int minor, const char* extension)
+{
+    const char* version = (const char*)glGetString(GL_VERSION);
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    int contextMajor = 0;
+    int contextMinor = 0;
+
+    if (version && 2 == sscanf(version, "%d.%d", &contextMajor, &contextMinor))
+    {
+        if (contextMajor > major || (contextMajor == major && contextMinor >= minor))
+            return true;
+    }
+
+    return extensions && extension && strstr(extensions, extension);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Ring of pixel unpack buffers for asynchronous texture uploads. The host
+// writes pixels into the mapped memory of one buffer while the GL copies from
+// the others into textures with DMA. With GL_ARB_buffer_storage the buffers
+// are mapped persistently once, otherwise they are mapped for every upload.
+// A fence per buffer keeps the host from overwriting pixels still in use.
+#define PBO_RING_SIZE 3
+
+typedef struct
+{
+    GLuint buffers[PBO_RING_SIZE];
+    void* mapped[PBO_RING_SIZE];    // persistent mappings, NULL otherwise
+    GLsync fences[PBO_RING_SIZE];
+    size_t sizeInBytes;             // capacity of each buffer
+    int next;                       // next buffer to use
+    int current;                    // buffer between Begin/EndPboUpload
+    bool persistent;
+} PboRing;
+
+///////////////////////////////////////////////////////////////////////////////
+// Initializes an empty ring. Buffers are created by the first upload.
+void InitPboRing(PboRing* ring)
+{
+    CHECK_NULL(ring);
+
+    memset(ring, 0, sizeof(*ring));
+    ring->persistent = HasGLFeature(4, 4, "GL_ARB_buffer_storage");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Deletes the buffers and fences of the ring.
+void ReleasePboRing(PboRing* ring)
+{
+    CHECK_NULL(ring);
+
+    for (int i = 0; i < PBO_RING_SIZE; i++)
+    {
+        if (ring->fences[i])
+            glDeleteSync(ring->fences[i]);
+
+        if (ring->mapped[i])
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->buffers[i]);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if (ring->buffers[0])
+        glDeleteBuffers(PBO_RING_SIZE, ring->buffers);
+
+    bool persistent = ring->persistent;
+    memset(ring, 0, sizeof(*ring));
+    ring->persistent = persistent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns host memory of at least sizeInBytes bytes to write the pixels of the
+// next upload to. Must be followed by EndPboUpload.
+void* BeginPboUpload(PboRing* ring, size_t sizeInBytes)
+{
+    CHECK_NULL(ring);
+
+    // (Re)create the buffers if they are too small
+    if (ring->sizeInBytes < sizeInBytes)
+    {
+        ReleasePboRing(ring);
+
+        glGenBuffers(PBO_RING_SIZE, ring->buffers);
+        for (int i = 0; i < PBO_RING_SIZE; i++)
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->buffers[i]);
+            if (ring->persistent)
+            {
+                GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                glBufferStorage(GL_PIXEL_UNPACK_BUFFER, sizeInBytes, NULL, flags);
+                ring->mapped[i] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, sizeInBytes, flags);
+                CHECK_NULL(ring->mapped[i]);
+            }
+            else
+            {
+                glBufferData(GL_PIXEL_UNPACK_BUFFER, sizeInBytes, NULL, GL_STREAM_DRAW);
+            }
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        ring->sizeInBytes = sizeInBytes;
+    }
+
+    ring->current = ring->next;
+    ring->next = (ring->next + 1) % PBO_RING_SIZE;
+
+    // Wait until the GL has finished the previous upload from this buffer
+    GLsync fence = ring->fences[ring->current];
+    if (fence)
+    {
+        glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(fence);
+        ring->fences[ring->current] = 0;
+    }
+
+    if (ring->persistent)
+        return ring->mapped[ring->current];
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->buffers[ring->current]);
+    void* hostPtr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, sizeInBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    CHECK_NULL(hostPtr);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    return hostPtr;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Starts the copy of the pixels written since BeginPboUpload into the given
+// region of a texture level. Returns without waiting for the copy.
+void EndPboUpload(PboRing* ring, GLuint texture, GLint level, GLint x, GLint y, GLsizei width, GLsizei height, GLenum format)
+{
+    CHECK_NULL(ring);
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->buffers[ring->current]);
+    if (!ring->persistent)
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    // Rows are tightly packed, single channel rows need not be multiples of 4
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, (GL_RGBA == format) ? 4 : 1);
+    glTexSubImage2D(GL_TEXTURE_2D, level, x, y, width, height, format, GL_UNSIGNED_BYTE, (const GLvoid*)0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    ring->fences[ring->current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Expands the padded RGB rows of an image to RGBA pixels at dst.
+void CopyRgbToRgba(const RgbImage& image, unsigned char* dst)
+{
+    for (long row = 0; row < image.GetNumRows(); row++)
+    {
+        const unsigned char* src = image.GetRgbPixel(row, 0);
+        for (long col = 0; col < image.GetNumCols(); col++)
+        {
+            *(dst++) = *(src++);
+            *(dst++) = *(src++);
+            *(dst++) = *(src++);
+            *(dst++) = 255;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Input textures are RGBA for RGB images and single channel (GL_R8, shared
+// with OpenCL as CL_R) for gray images. Returns the bytes per texel.
+int GetTexturePixelSize(const RgbImage& image)
+{
+    return (1 == image.GetNumChannels()) ? 1 : 4;
+}
+
+GLenum GetTexturePixelFormat(int pixelSize)
+{
+    return (1 == pixelSize) ? GL_RED : GL_RGBA;
+}
+
+// Writes the pixels of an image to dst in the layout of its texture: RGB
+// expanded to RGBA, gray rows without the padding of the RgbImage rows.
+void CopyImageToTexturePixels(const RgbImage& image, unsigned char* dst)
+{
+    if (3 == image.GetNumChannels())
+    {
+        CopyRgbToRgba(image, dst);
+        return;
+    }
+
+    const unsigned char* src = (const unsigned char*)image.ImageData();
+    for (long row = 0; row < image.GetNumRows(); row++)
+    {
+        memcpy(dst, src, image.GetNumCols());
+        dst += image.GetNumCols();
+        src += image.GetNumBytesPerRow();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Creates a 2D texture with the usual sampling state and levels mip levels of
+// the given sized format, immutable where glTexStorage2D is available.
+GLuint createTexture(int id, GLenum internalFormat, GLenum format, int width, int height, int levels)
+{
+	GLuint texture;
+	glGenTextures(id, &texture); // Get the First Free Name to use for the Font Texture
+	glBindTexture(GL_TEXTURE_2D, texture); // Actually create the texture object
+    glClearColor (0.0, 0.0, 0.0, 0.0);
+    glShadeModel(GL_FLAT);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    // The mip levels are only sampled when minification selects them
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (levels > 1) ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+
+    if (HasGLFeature(4, 2, "GL_ARB_texture_storage"))
+    {
+        glTexStorage2D(GL_TEXTURE_2D, levels, internalFormat, width, height);
+    }
+    else
+    {
+        for (int level = 0; level < levels; level++)
+        {
+            glTexImage2D(GL_TEXTURE_2D, level, internalFormat, width, height, 0, format, GL_UNSIGNED_BYTE, NULL);
+            width = (width > 1) ? width / 2 : 1;
+            height = (height > 1) ? height / 2 : 1;
+        }
+    }
+
+	return texture;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the number of levels of a full mip chain / image pyramid.
+int GetMipLevelCount(int width, int height)
+{
+    int levels = 1;
+
+    while (width > 1 || height > 1)
+    {
+        width = (width > 1) ? width / 2 : 1;
+        height = (height > 1) ? height / 2 : 1;
+        levels++;
+    }
+
+    return levels;
+}
+
+// Creates an RGBA (gray: GL_R8) texture of the size of the image with storage
+// for levels mip levels and uploads the image to level 0 through the PBO ring.
+// The upload runs asynchronously; the other levels are built on the device by
+// BuildImagePyramid.
+GLuint loadTextureFromFile(const RgbImage& theTexMap, int id, PboRing* pboRing, int levels)
+{   
+	int width = theTexMap.GetNumCols();
+	int height = theTexMap.GetNumRows();
+	int pixelSize = GetTexturePixelSize(theTexMap);
+	GLuint texture = createTexture(id, (1 == pixelSize) ? GL_R8 : GL_RGBA8, GetTexturePixelFormat(pixelSize), width, height, levels);
+
+	unsigned char* pixels = (unsigned char*)BeginPboUpload(pboRing, (size_t)width * height * pixelSize);
+	CopyImageToTexturePixels(theTexMap, pixels);
+	EndPboUpload(pboRing, texture, 0, 0, 0, width, height, GetTexturePixelFormat(pixelSize));
+	
+	return texture;
+}
+
+GLuint loadTexture(int id, int width, int height)
+{   
+	return createTexture(id, GL_LUMINANCE8, GL_LUMINANCE, width, height, 1);
+}
+
+// A rectangle of pixels, rows counted from the bottom like the texture rows.
+typedef struct
+{
+	int x;
+	int y;
+	int width;
+	int height;
+} PixelRect;
+
+// Enqueues the kernel over the output pixels of rect only: the kernels take
+// their position from get_global_id, which includes the global work offset.
+// pixelsPerWorkItem is the number of output pixels one work-item writes along
+// a row: 1 for Filter, PIXELS_PER_WI for FilterRow; rect->x must be a multiple
+// of it.
+void enqueueImageKernelRect(cl_command_queue queue, cl_kernel kernel, cl_mem image, cl_mem filterWeightsBuffer, cl_mem buffer, const PixelRect* rect, int pixelsPerWorkItem)
+{
+	cl_int clError = 0;
+
+	clError |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &image);
+	clError |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &filterWeightsBuffer);
+	clError |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &buffer);
+	CHECK_OCL_ERR(clError);
+
+	int workDim = 2;
+	size_t globalWorkOffset[2] = {(size_t)(rect->x / pixelsPerWorkItem), (size_t)rect->y};
+	size_t globalWorkSize[2] = {(size_t)(rect->width + pixelsPerWorkItem - 1) / pixelsPerWorkItem, (size_t)rect->height};
+	// Launch the kernel
+	clError = clEnqueueNDRangeKernel(queue, kernel, workDim, globalWorkOffset, globalWorkSize, NULL, 0, NULL, NULL);
+	CHECK_OCL_ERR(clError);
+}
+
+void enqueueImageKernel(cl_command_queue queue, cl_kernel kernel, cl_mem image, cl_mem filterWeightsBuffer, cl_mem buffer, int width, int height, int pixelsPerWorkItem)
+{
+	PixelRect rect = {0, 0, width, height};
+	enqueueImageKernelRect(queue, kernel, image, filterWeightsBuffer, buffer, &rect, pixelsPerWorkItem);
+}
+
+// Filters between two images shared with GL textures.
+void runKernel(cl_command_queue queue, cl_kernel kernel, cl_mem image, cl_mem filterWeightsBuffer, cl_mem buffer, int width, int height, int pixelsPerWorkItem)
+{
+	glFinish();
+	clEnqueueAcquireGLObjects(queue, 1,  &image, 0, 0, NULL);
+	clEnqueueAcquireGLObjects(queue, 1,  &buffer, 0, 0, NULL);
+	clFinish(queue);
+
+	enqueueImageKernel(queue, kernel, image, filterWeightsBuffer, buffer, width, height, pixelsPerWorkItem);
+	clFinish(queue);
+	
+	clEnqueueReleaseGLObjects(queue, 1,  &image, 0, 0, NULL);
+	clEnqueueReleaseGLObjects(queue, 1,  &buffer, 0, 0, NULL);
+	clFinish(queue);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Interop without cl_khr_gl_sharing: pixels move between GL textures and CL
+// images through host memory. Texture reads go through a pixel pack buffer,
+// texture writes through the PBO ring, so the GL side of both copies is DMA.
+#define INTEROP_BENCHMARK_FRAMES 8
+
+typedef enum
+{
+	INTEROP_GL_SHARING,
+	INTEROP_HOST_COPY
+} InteropMode;
+
+typedef struct
+{
+	GLuint packBuffer;
+	size_t sizeInBytes;
+} HostCopyInterop;
+
+void InitHostCopyInterop(HostCopyInterop* interop)
+{
+	CHECK_NULL(interop);
+
+	memset(interop, 0, sizeof(*interop));
+}
+
+void ReleaseHostCopyInterop(HostCopyInterop* interop)
+{
+	CHECK_NULL(interop);
+
+	if (interop->packBuffer)
+		glDeleteBuffers(1, &interop->packBuffer);
+
+	memset(interop, 0, sizeof(*interop));
+}
+
+// Copies level 0 of an RGBA (pixelSize 4) or single channel (pixelSize 1)
+// texture into a CL image of the same size and format.
+void CopyTextureToImage(HostCopyInterop* interop, GLuint texture, cl_mem image, int width, int height, int pixelSize, cl_command_queue queue)
+{
+	size_t sizeInBytes = (size_t)width * height * pixelSize;
+
+	if (interop->sizeInBytes < sizeInBytes)
+	{
+		if (!interop->packBuffer)
+			glGenBuffers(1, &interop->packBuffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, interop->packBuffer);
+		glBufferData(GL_PIXEL_PACK_BUFFER, sizeInBytes, NULL, GL_STREAM_READ);
+		interop->sizeInBytes = sizeInBytes;
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, interop->packBuffer);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glPixelStorei(GL_PACK_ALIGNMENT, pixelSize);
+	glGetTexImage(GL_TEXTURE_2D, 0, GetTexturePixelFormat(pixelSize), GL_UNSIGNED_BYTE, (GLvoid*)0);
+
+	void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sizeInBytes, GL_MAP_READ_BIT);
+	CHECK_NULL(pixels);
+	CopyImageHostToDevice(pixels, image, width, height, queue, CL_TRUE);
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Copies an RGBA (pixelSize 4) or CL_R (pixelSize 1) CL image into the given
+// level of a texture.
+void CopyImageToTexture(PboRing* pboRing, cl_mem image, GLuint texture, GLint level, int width, int height, int pixelSize, cl_command_queue queue)
+{
+	cl_int clError;
+	size_t origin[] = {0, 0, 0};
+	size_t region[] = {(size_t)width, (size_t)height, 1};
+
+	void* pixels = BeginPboUpload(pboRing, (size_t)width * height * pixelSize);
+	clError = clEnqueueReadImage(queue, image, CL_TRUE, origin, region, 0, 0, pixels, 0, NULL, NULL);
+	CHECK_OCL_ERR(clError);
+	EndPboUpload(pboRing, texture, level, 0, 0, width, height, GetTexturePixelFormat(pixelSize));
+}
+
+// Same as runKernel, but for CL images that are not shared with GL: the input
+// texture is copied into inputImage and outputImage into the output texture.
+// inputPixelSize is 4 for RGBA and 1 for gray input, the output is RGBA.
+void runKernelHostCopy(cl_command_queue queue, cl_kernel kernel, HostCopyInterop* interop, PboRing* pboRing,
+					   GLuint inputTexture, cl_mem inputImage, int inputWidth, int inputHeight, int inputPixelSize, cl_mem filterWeightsBuffer,
+					   cl_mem outputImage, GLuint outputTexture, int width, int height, int pixelsPerWorkItem)
+{
+	CopyTextureToImage(interop, inputTexture, inputImage, inputWidth, inputHeight, inputPixelSize, queue);
+	enqueueImageKernel(queue, kernel, inputImage, filterWeightsBuffer, outputImage, width, height, pixelsPerWorkItem);
+	CopyImageToTexture(pboRing, outputImage, outputTexture, 0, width, height, 4, queue);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Dirty rectangles: the parts of the input that changed since the last filter
+// pass. Only the output pixels within the filter radius of them are filtered
+// again, the rest of the output texture keeps its pixels.
+#define MAX_DIRTY_RECTS 16
+
+typedef struct
+{
+	PixelRect rects[MAX_DIRTY_RECTS];
+	int numRects;
+} DirtyRegion;
+
+void ClearDirtyRegion(DirtyRegion* region)
+{
+	CHECK_NULL(region);
+
+	region->numRects = 0;
+}
+
+static bool RectsTouch(const PixelRect* a, const PixelRect* b)
+{
+	return a->x <= b->x + b->width && b->x <= a->x + a->width &&
+		   a->y <= b->y + b->height && b->y <= a->y + a->height;
+}
+
+static void UniteRects(PixelRect* a, const PixelRect* b)
+{
+	int right = (a->x + a->width > b->x + b->width) ? a->x + a->width : b->x + b->width;
+	int top = (a->y + a->height > b->y + b->height) ? a->y + a->height : b->y + b->height;
+	a->x = (a->x < b->x) ? a->x : b->x;
+	a->y = (a->y < b->y) ? a->y : b->y;
+	a->width = right - a->x;
+	a->height = top - a->y;
+}
+
+// Adds a changed rectangle of the input. Rectangles that overlap or touch
+// are merged, and a full list collapses into its bounding box, so the work
+// never exceeds one pass over the union.
+void MarkDirtyRect(DirtyRegion* region, int x, int y, int width, int height)
+{
+	CHECK_NULL(region);
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	PixelRect rect = {x, y, width, height};
+
+	// A merged rectangle may now touch others, so start over after a merge
+	for (int i = 0; i < region->numRects; i++)
+	{
+		if (RectsTouch(&region->rects[i], &rect))
+		{
+			UniteRects(&rect, &region->rects[i]);
+			region->rects[i] = region->rects[--region->numRects];
+			i = -1;
+		}
+	}
+
+	if (region->numRects == MAX_DIRTY_RECTS)
+	{
+		for (int i = 1; i < region->numRects; i++)
+			UniteRects(&region->rects[0], &region->rects[i]);
+		UniteRects(&region->rects[0], &rect);
+		region->numRects = 1;
+		return;
+	}
+
+	region->rects[region->numRects++] = rect;
+}
+
+// Returns the output pixels that depend on the dirty input rectangle: the
+// rectangle grown by the filter radius, clamped to the output of width x
+// height pixels and aligned to work-items. Output pixels beyond the right or
+// top edge of the input read the clamped edge texels, so a rectangle at the
+// edge of the input extends to the edge of the output.
+PixelRect GetDirtyOutputRect(const PixelRect* dirty, int filterRadius, int inputWidth, int inputHeight, int width, int height, int pixelsPerWorkItem)
+{
+	int left = (dirty->x > filterRadius) ? dirty->x - filterRadius : 0;
+	int bottom = (dirty->y > filterRadius) ? dirty->y - filterRadius : 0;
+	int right = dirty->x + dirty->width + filterRadius;
+	int top = dirty->y + dirty->height + filterRadius;
+	if (right > width || dirty->x + dirty->width >= inputWidth)
+		right = width;
+	if (top > height || dirty->y + dirty->height >= inputHeight)
+		top = height;
+
+	PixelRect rect;
+	rect.x = left - left % pixelsPerWorkItem;
+	rect.y = bottom;
+	rect.width = (right > rect.x) ? right - rect.x : 0;
+	rect.height = (top > rect.y) ? top - rect.y : 0;
+
+	return rect;
+}
+
+// Copies a rectangle of an RGBA (pixelSize 4) or CL_R (pixelSize 1) CL image
+// into the same rectangle of a texture level.
+void CopyImageRectToTexture(PboRing* pboRing, cl_mem image, GLuint texture, GLint level, const PixelRect* rect, int pixelSize, cl_command_queue queue)
+{
+	cl_int clError;
+	size_t origin[] = {(size_t)rect->x, (size_t)rect->y, 0};
+	size_t region[] = {(size_t)rect->width, (size_t)rect->height, 1};
+
+	void* pixels = BeginPboUpload(pboRing, (size_t)rect->width * rect->height * pixelSize);
+	clError = clEnqueueReadImage(queue, image, CL_TRUE, origin, region, 0, 0, pixels, 0, NULL, NULL);
+	CHECK_OCL_ERR(clError);
+	EndPboUpload(pboRing, texture, level, rect->x, rect->y, rect->width, rect->height, GetTexturePixelFormat(pixelSize));
+}
+
+// Same as runKernel, but filters only the given output rectangles.
+void runKernelRects(cl_command_queue queue, cl_kernel kernel, cl_mem image, cl_mem filterWeightsBuffer, cl_mem buffer,
+					const PixelRect* rects, int numRects, int pixelsPerWorkItem)
+{
+	glFinish();
+	clEnqueueAcquireGLObjects(queue, 1,  &image, 0, 0, NULL);
+	clEnqueueAcquireGLObjects(queue, 1,  &buffer, 0, 0, NULL);
+	clFinish(queue);
+
+	for (int i = 0; i < numRects; i++)
+		enqueueImageKernelRect(queue, kernel, image, filterWeightsBuffer, buffer, &rects[i], pixelsPerWorkItem);
+	clFinish(queue);
+	
+	clEnqueueReleaseGLObjects(queue, 1,  &image, 0, 0, NULL);
+	clEnqueueReleaseGLObjects(queue, 1,  &buffer, 0, 0, NULL);
+	clFinish(queue);
+}
+
+// Same as runKernelHostCopy, but filters only the given output rectangles and
+// copies only them to the output texture. The input image must already hold
+// the current input, see UploadDirtyRects.
+void runKernelHostCopyRects(cl_command_queue queue, cl_kernel kernel, PboRing* pboRing, cl_mem inputImage, cl_mem filterWeightsBuffer,
+							cl_mem outputImage, GLuint outputTexture, const PixelRect* rects, int numRects, int pixelsPerWorkItem)
+{
+	for (int i = 0; i < numRects; i++)
+		enqueueImageKernelRect(queue, kernel, inputImage, filterWeightsBuffer, outputImage, &rects[i], pixelsPerWorkItem);
+	for (int i = 0; i < numRects; i++)
+		CopyImageRectToTexture(pboRing, outputImage, outputTexture, 0, &rects[i], 4, queue);
+}
+
+// Enqueues one of the buffer based kernels (FilterBufferRGB/RGBA/Gray) for
+// devices without image support. inputPitch is the distance between two input
+// rows in bytes and is only passed to the RGB and gray kernels (packedRgb). fixedPointShift is
+// the normalization shift of the *Fixed kernel variants, or -1 for the float
+// ones. The kernel starts after the events of waitList and signals *pEvent
+// (may be NULL).
+void enqueueBufferKernel(cl_command_queue queue, cl_kernel kernel, cl_mem input, int inputWidth, int inputHeight, int inputPitch, cl_mem filterWeightsBuffer, cl_mem output, int width, int height, cl_bool packedRgb, int fixedPointShift,
+						 cl_uint numWaitEvents, const cl_event* waitList, cl_event* pEvent)
+{
+	cl_int clError = 0;
+	cl_uint argIndex = 0;
+
+	clError |= clSetKernelArg(kernel, argIndex++, sizeof(cl_mem), &input);
+	clError |= clSetKernelArg(kernel, argIndex++, sizeof(int), &inputWidth);
+	clError |= clSetKernelArg(kernel, argIndex++, sizeof(int), &inputHeight);
+	if (packedRgb)
+		clError |= clSetKernelArg(kernel, argIndex++, sizeof(int), &inputPitch);
+	clError |= clSetKernelArg(kernel, argIndex++, sizeof(cl_mem), &filterWeightsBuffer);
+	clError |= clSetKernelArg(kernel, argIndex++, sizeof(cl_mem), &output);
+	clError |= clSetKernelArg(kernel, argIndex++, sizeof(int), &width);
+	clError |= clSetKernelArg(kernel, argIndex++, sizeof(int), &height);
+	if (fixedPointShift >= 0)
+		clError |= clSetKernelArg(kernel, argIndex++, sizeof(int), &fixedPointShift);
+	CHECK_OCL_ERR(clError);
+
+	int workDim = 2;
+	size_t globalWorkSize[2] = {(size_t)width, (size_t)height};
+	// Launch the kernel
+	clError = clEnqueueNDRangeKernel(queue, kernel, workDim, NULL, globalWorkSize, NULL, numWaitEvents, waitList, pEvent);
+	CHECK_OCL_ERR(clError);
+}
+
+// Same as enqueueBufferKernel, but waits until the kernel has finished.
+void runBufferKernel(cl_command_queue queue, cl_kernel kernel, cl_mem input, int inputWidth, int inputHeight, int inputPitch, cl_mem filterWeightsBuffer, cl_mem output, int width, int height, cl_bool packedRgb, int fixedPointShift)
+{
+	enqueueBufferKernel(queue, kernel, input, inputWidth, inputHeight, inputPitch, filterWeightsBuffer, output, width, height, packedRgb, fixedPointShift, 0, NULL, NULL);
+	clFinish(queue);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Builds levels 1 to numLevels-1 of an image pyramid on the device with the
+// DownsampleGaussian kernel. levels[0] holds the full resolution image of
+// width x height pixels, every level is half the size of the previous one (at
+// least 1 pixel) and is computed from it.
+void BuildImagePyramid(cl_command_queue queue, cl_kernel downsampleKernel, cl_mem* levels, int numLevels, int width, int height)
+{
+	cl_int clError;
+
+	for (int level = 1; level < numLevels; level++)
+	{
+		width = (width > 1) ? width / 2 : 1;
+		height = (height > 1) ? height / 2 : 1;
+
+		clError = clSetKernelArg(downsampleKernel, 0, sizeof(cl_mem), &levels[level - 1]);
+		clError |= clSetKernelArg(downsampleKernel, 1, sizeof(cl_mem), &levels[level]);
+		CHECK_OCL_ERR(clError);
+
+		size_t globalWorkSize[2] = {(size_t)width, (size_t)height};
+		clError = clEnqueueNDRangeKernel(queue, downsampleKernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
+		CHECK_OCL_ERR(clError);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Builds the mip levels 1 and up of a GL texture on the device. Every level
+// is shared with OpenCL, so the results land in the texture without a copy.
+void BuildTexturePyramid(cl_context context, cl_command_queue queue, cl_kernel downsampleKernel, GLuint texture, int numLevels, int width, int height)
+{
+	cl_int clError;
+	cl_mem* levels = (cl_mem*)malloc(numLevels * sizeof(cl_mem));
+	CHECK_NULL(levels);
+
+	for (int level = 0; level < numLevels; level++)
+	{
+		levels[level] = clCreateFromGLTexture2D(context, CL_MEM_READ_WRITE, GL_TEXTURE_2D, level, texture, &clError);
+		CHECK_OCL_ERR(clError);
+	}
+
+	glFinish();
+	clError = clEnqueueAcquireGLObjects(queue, numLevels, levels, 0, NULL, NULL);
+	CHECK_OCL_ERR(clError);
+
+	BuildImagePyramid(queue, downsampleKernel, levels, numLevels, width, height);
+
+	clError = clEnqueueReleaseGLObjects(queue, numLevels, levels, 0, NULL, NULL);
+	CHECK_OCL_ERR(clError);
+	clFinish(queue);
+
+	for (int level = 0; level < numLevels; level++)
+		ReleaseDeviceBuffer(&levels[level]);
+	free(levels);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Headless variant: allocates an RGBA (pixelSize 4) or CL_R (pixelSize 1)
+// pyramid of numLevels CL images from the memory pool into levels, uploads
+// the packed pixels to level 0 and builds the other levels on the device.
+// The images are returned to the pool with ReleasePooledMemObject.
+void CreateImagePyramid(DeviceMemoryPool* pool, cl_command_queue queue, cl_kernel downsampleKernel, void* pixels, int width, int height, int pixelSize,
+						cl_mem* levels, int numLevels)
+{
+	cl_image_format format;
+	format.image_channel_order = (1 == pixelSize) ? CL_R : CL_RGBA;
+	format.image_channel_data_type = CL_UNORM_INT8;
+
+	int levelWidth = width;
+	int levelHeight = height;
+	for (int level = 0; level < numLevels; level++)
+	{
+		levels[level] = AcquirePooledImage(pool, CL_MEM_READ_WRITE, &format, levelWidth, levelHeight);
+		levelWidth = (levelWidth > 1) ? levelWidth / 2 : 1;
+		levelHeight = (levelHeight > 1) ? levelHeight / 2 : 1;
+	}
+
+	CopyImageHostToDevice(pixels, levels[0], width, height, queue, CL_FALSE);
+	BuildImagePyramid(queue, downsampleKernel, levels, numLevels, width, height);
+	clFinish(queue);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Same as BuildTexturePyramid for contexts without GL sharing: the pyramid is
+// built in CL images from the pixels of level 0 (in the texture layout of
+// pixelSize bytes per texel) and levels 1 and up are copied into the texture.
+void BuildTexturePyramidHostCopy(DeviceMemoryPool* pool, cl_command_queue queue, cl_kernel downsampleKernel, PboRing* pboRing,
+								 GLuint texture, void* pixels, int pixelSize, int numLevels, int width, int height)
+{
+	cl_mem* levels = (cl_mem*)malloc(numLevels * sizeof(cl_mem));
+	CHECK_NULL(levels);
+
+	CreateImagePyramid(pool, queue, downsampleKernel, pixels, width, height, pixelSize, levels, numLevels);
+
+	for (int level = 1; level < numLevels; level++)
+	{
+		width = (width > 1) ? width / 2 : 1;
+		height = (height > 1) ? height / 2 : 1;
+		CopyImageToTexture(pboRing, levels[level], texture, level, width, height, pixelSize, queue);
+	}
+
+	for (int level = 0; level < numLevels; level++)
+		ReleasePooledMemObject(pool, &levels[level]);
+	free(levels);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// YUV 4:2:0 frames on the device: luma as a CL_R image of width x height and
+// chroma at half resolution as two CL_R images (I420) or one CL_RG image
+// (NV12). In host memory the planes follow each other without padding, which
+// is the layout of the yuv420p and nv12 raw video formats.
+typedef enum
+{
+	YUV_LAYOUT_I420,
+	YUV_LAYOUT_NV12
+} YuvLayout;
+
+typedef struct
+{
+	YuvLayout layout;
+	int width;
+	int height;
+	int numPlanes;
+	cl_mem planes[3];
+} YuvImage;
+
+// Bytes of one frame in host memory.
+size_t GetYuvFrameSize(int width, int height)
+{
+	return (size_t)width * height + 2 * (size_t)(width / 2) * (height / 2);
+}
+
+// Acquires the plane images from the memory pool. Width and height must be even.
+void CreateYuvImage(DeviceMemoryPool* pool, YuvLayout layout, cl_mem_flags flags, int width, int height, YuvImage* image)
+{
+	cl_image_format format;
+	format.image_channel_data_type = CL_UNORM_INT8;
+
+	CHECK_NULL(image);
+
+	image->layout = layout;
+	image->width = width;
+	image->height = height;
+	image->numPlanes = (YUV_LAYOUT_I420 == layout) ? 3 : 2;
+
+	format.image_channel_order = CL_R;
+	image->planes[0] = AcquirePooledImage(pool, flags, &format, width, height);
+	format.image_channel_order = (YUV_LAYOUT_I420 == layout) ? CL_R : CL_RG;
+	for (int plane = 1; plane < image->numPlanes; plane++)
+		image->planes[plane] = AcquirePooledImage(pool, flags, &format, width / 2, height / 2);
+}
+
+void ReleaseYuvImage(DeviceMemoryPool* pool, YuvImage* image)
+{
+	for (int plane = 0; plane < image->numPlanes; plane++)
+		ReleasePooledMemObject(pool, &image->planes[plane]);
+	image->numPlanes = 0;
+}
+
+// Enqueues the copy of every plane from or to a frame in host memory.
+void EnqueueYuvTransfer(cl_command_queue queue, YuvImage* image, void* frame, cl_bool write)
+{
+	cl_int clError;
+	unsigned char* plane = (unsigned char*)frame;
+	size_t origin[] = {0, 0, 0};
+
+	for (int i = 0; i < image->numPlanes; i++)
+	{
+		size_t region[] = {(size_t)image->width, (size_t)image->height, 1};
+		size_t bytesPerPixel = (YUV_LAYOUT_NV12 == image->layout && i > 0) ? 2 : 1;
+		if (i > 0)
+		{
+			region[0] /= 2;
+			region[1] /= 2;
+		}
+
+		if (write)
+			clError = clEnqueueWriteImage(queue, image->planes[i], CL_FALSE, origin, region, 0, 0, plane, 0, NULL, NULL);
+		else
+			clError = clEnqueueReadImage(queue, image->planes[i], CL_FALSE, origin, region, 0, 0, plane, 0, NULL, NULL);
+		CHECK_OCL_ERR(clError);
+
+		plane += region[0] * region[1] * bytesPerPixel;
+	}
+}
+
+// Enqueues FilterYUV420 or FilterNV12, matching the layout of the images.
+void enqueueYuvKernel(cl_command_queue queue, cl_kernel kernel, YuvImage* input, cl_mem filterWeightsBuffer, YuvImage* output, cl_int filterChroma)
+{
+	cl_int clError = 0;
+	cl_uint argIndex = 0;
+
+	for (int plane = 0; plane < input->numPlanes; plane++)
+		clError |= clSetKernelArg(kernel, argIndex++, sizeof(cl_mem), &input->planes[plane]);
+	clError |= clSetKernelArg(kernel, argIndex++, sizeof(cl_mem), &filterWeightsBuffer);
+	for (int plane = 0; plane < output->numPlanes; plane++)
+		clError |= clSetKernelArg(kernel, argIndex++, sizeof(cl_mem), &output->planes[plane]);
+	clError |= clSetKernelArg(kernel, argIndex++, sizeof(cl_int), &filterChroma);
+	CHECK_OCL_ERR(clError);
+
+	size_t globalWorkSize[2] = {(size_t)output->width / 2, (size_t)output->height / 2};
+	clError = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalWorkSize, NULL, 0, NULL, NULL);
+	CHECK_OCL_ERR(clError);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Shared state for filtering host images from any number of threads with the
+// buffer kernels. All members are read-only after InitFilterEngine; the
+// kernels and queues used for a job belong to the calling thread.
+typedef struct
+{
+    cl_context context;
+    cl_device_id device;
+    cl_program program;
+    const char* kernelName;         // FilterBufferRGB or FilterBufferRGBFixed
+    const char* rgbaKernelName;     // FilterBufferRGBA or FilterBufferRGBAFixed
+    const char* grayKernelName;     // FilterBufferGray or FilterBufferGrayFixed
+    int outputPixelSize;            // 4, or 3 for programs built with OUTPUT_RGB,
+                                    // gray input always gives 1
+    cl_mem filterWeightsBuffer;
+    int fixedPointShift;            // -1 for float weights
+    QueueMode queueMode;
+    DeviceMemoryPool* memoryPool;
+    ResultCache* resultCache;       // NULL, or results to reuse
+    ResultKey configKey;            // hash of the program source, build
+                                    // options and weights
+} FilterEngine;
+
+///////////////////////////////////////////////////////////////////////////////
+// Hashes what the results of the engine depend on besides the input: the
+// source and build options of the program and the weights.
+void HashFilterConfiguration(ResultKey* key, cl_program program, cl_device_id device, const void* weights, size_t weightsSize,
+                             int fixedPointShift)
+{
+    cl_int clError;
+    size_t size = 0;
+
+    clError = clGetProgramInfo(program, CL_PROGRAM_SOURCE, 0, NULL, &size);
+    CHECK_OCL_ERR(clError);
+    char* text = (char*)malloc(size + 1);
+    CHECK_NULL(text);
+    clError = clGetProgramInfo(program, CL_PROGRAM_SOURCE, size, text, NULL);
+    CHECK_OCL_ERR(clError);
+    HashResultKey(key, text, size);
+    free(text);
+
+    clError = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_OPTIONS, 0, NULL, &size);
+    CHECK_OCL_ERR(clError);
+    text = (char*)malloc(size + 1);
+    CHECK_NULL(text);
+    clError = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_OPTIONS, size, text, NULL);
+    CHECK_OCL_ERR(clError);
+    HashResultKey(key, text, size);
+    free(text);
+
+    HashResultKey(key, weights, weightsSize);
+    HashResultKey(key, &fixedPointShift, sizeof(fixedPointShift));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Initializes a filter engine. fixedWeights are used instead of weights when
+// fixedPointShift is not negative.
+void InitFilterEngine(FilterEngine* engine, cl_context context, cl_device_id device, cl_program program, DeviceMemoryPool* memoryPool,
+                      const float* weights, const int* fixedWeights, int fixedPointShift, int numWeights, QueueMode queueMode)
+{
+    CHECK_NULL(engine);
+
+    memset(engine, 0, sizeof(*engine));
+    engine->context = context;
+    engine->device = device;
+    engine->program = program;
+    engine->memoryPool = memoryPool;
+    engine->fixedPointShift = fixedPointShift;
+    engine->queueMode = queueMode;
+    engine->outputPixelSize = 4;
+
+    cl_command_queue queue = GetThreadQueues(context, device, queueMode, NULL);
+
+    if (fixedPointShift >= 0)
+    {
+        engine->kernelName = "FilterBufferRGBFixed";
+        engine->rgbaKernelName = "FilterBufferRGBAFixed";
+        engine->grayKernelName = "FilterBufferGrayFixed";
+        engine->filterWeightsBuffer = AcquirePooledBuffer(memoryPool, CL_MEM_READ_ONLY, sizeof(int) * numWeights);
+        CopyHostToDevice((void*)fixedWeights, engine->filterWeightsBuffer, sizeof(int) * numWeights, queue, CL_TRUE);
+        HashFilterConfiguration(&engine->configKey, program, device, fixedWeights, sizeof(int) * numWeights, fixedPointShift);
+    }
+    else
+    {
+        engine->kernelName = "FilterBufferRGB";
+        engine->rgbaKernelName = "FilterBufferRGBA";
+        engine->grayKernelName = "FilterBufferGray";
+        engine->filterWeightsBuffer = AcquirePooledBuffer(memoryPool, CL_MEM_READ_ONLY, sizeof(float) * numWeights);
+        CopyHostToDevice((void*)weights, engine->filterWeightsBuffer, sizeof(float) * numWeights, queue, CL_TRUE);
+        HashFilterConfiguration(&engine->configKey, program, device, weights, sizeof(float) * numWeights, fixedPointShift);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Releases the device objects owned by the engine.
+void ReleaseFilterEngine(FilterEngine* engine)
+{
+    CHECK_NULL(engine);
+
+    if (engine->memoryPool)
+        ReleasePooledMemObject(engine->memoryPool, &engine->filterWeightsBuffer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Device objects of one filter operation in flight. An operation served from
+// the result cache has none.
+typedef struct
+{
+    cl_mem inputBuffer;
+    cl_mem outputBuffer;
+    cl_event writeEvent;
+    cl_event kernelEvent;
+    cl_event readEvent;
+    bool storeResult;           // add output to the cache when done
+    ResultKey resultKey;
+    void* output;
+    size_t outputSize;
+} FilterOperation;
+
+///////////////////////////////////////////////////////////////////////////////
+// Output bytes per pixel of the engine for input of numChannels channels.
+int GetFilterOutputPixelSize(const FilterEngine* engine, int numChannels)
+{
+    return (1 == numChannels) ? 1 : engine->outputPixelSize;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Enqueues kernel and readback for input that is already in a device buffer,
+// in the layout described at EnqueueFilterPixels. The kernel waits for
+// op->writeEvent if set. The operation does not release input unless it is
+// op->inputBuffer, so e.g. a CL_MEM_USE_HOST_PTR buffer over a mapped file
+// can be filtered any number of times without an upload.
+void EnqueueFilterBuffer(FilterEngine* engine, FilterOperation* op, cl_mem input, int inputWidth, int inputHeight, int inputPitch,
+                         int numChannels, void* output, int width, int height)
+{
+    cl_command_queue transferQueue;
+    cl_command_queue computeQueue = GetThreadQueues(engine->context, engine->device, engine->queueMode, &transferQueue);
+    const char* kernelName = (4 == numChannels) ? engine->rgbaKernelName : ((1 == numChannels) ? engine->grayKernelName : engine->kernelName);
+    cl_kernel kernel = GetThreadKernel(engine->program, kernelName);
+
+    size_t outputSize = (size_t)width * height * GetFilterOutputPixelSize(engine, numChannels);
+    op->outputBuffer = AcquirePooledBuffer(engine->memoryPool, CL_MEM_WRITE_ONLY, outputSize);
+
+    enqueueBufferKernel(computeQueue, kernel, input, inputWidth, inputHeight, inputPitch,
+                        engine->filterWeightsBuffer, op->outputBuffer, width, height, 4 != numChannels, engine->fixedPointShift,
+                        op->writeEvent ? 1 : 0, op->writeEvent ? &op->writeEvent : NULL, &op->kernelEvent);
+    CopyDeviceToHostAsync(op->outputBuffer, output, outputSize, transferQueue, 1, &op->kernelEvent, &op->readEvent);
+
+    clFlush(computeQueue);
+    if (transferQueue != computeQueue)
+        clFlush(transferQueue);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Enqueues upload, kernel and readback of the pixels in host memory: rows of
+// numChannels 3 (packed RGB) or 1 (gray) inputPitch bytes apart, or with
+// numChannels 4 RGBA rows of inputWidth pixels. The output has
+// GetFilterOutputPixelSize() bytes per pixel.
+void EnqueueFilterPixels(FilterEngine* engine, FilterOperation* op, const void* input, int inputWidth, int inputHeight, int inputPitch,
+                         int numChannels, void* output, int width, int height)
+{
+    cl_command_queue transferQueue;
+    size_t rowPitch = (4 != numChannels) ? inputPitch : inputWidth * 4;
+    size_t inputSize = (size_t)inputHeight * rowPitch;
+
+    op->storeResult = false;
+    if (engine->resultCache)
+    {
+        // The key covers the pixels of every row but not the row padding
+        int format[6] = { inputWidth, inputHeight, numChannels, width, height, GetFilterOutputPixelSize(engine, numChannels) };
+        op->resultKey = engine->configKey;
+        HashResultKey(&op->resultKey, format, sizeof(format));
+        for (int row = 0; row < inputHeight; row++)
+            HashResultKey(&op->resultKey, (const unsigned char*)input + row * rowPitch, (size_t)inputWidth * numChannels);
+
+        op->output = output;
+        op->outputSize = (size_t)width * height * format[5];
+        if (LookupResult(engine->resultCache, &op->resultKey, output, op->outputSize))
+            return;
+        op->storeResult = true;
+    }
+
+    GetThreadQueues(engine->context, engine->device, engine->queueMode, &transferQueue);
+
+    op->inputBuffer = AcquirePooledBuffer(engine->memoryPool, CL_MEM_READ_ONLY, inputSize);
+    CopyHostToDeviceAsync(input, op->inputBuffer, inputSize, transferQueue, 0, NULL, &op->writeEvent);
+
+    EnqueueFilterBuffer(engine, op, op->inputBuffer, inputWidth, inputHeight, inputPitch, numChannels, output, width, height);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Enqueues upload, kernel and readback of one image without waiting for them.
+// Upload and readback go to the transfer queue, the kernel to the compute
+// queue; their order is expressed through events only, so the commands of
+// different operations can overlap in the out-of-order and split queue modes.
+void EnqueueFilterOperation(FilterEngine* engine, FilterOperation* op, const RgbImage* input, void* output, int width, int height)
+{
+    EnqueueFilterPixels(engine, op, input->ImageData(), input->GetNumCols(), input->GetNumRows(), input->GetNumBytesPerRow(),
+                        input->GetNumChannels(), output, width, height);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Waits until the operation has completed and releases its objects.
+void FinishFilterOperation(FilterEngine* engine, FilterOperation* op)
+{
+    cl_int clError;
+
+    if (op->readEvent)
+    {
+        clError = clWaitForEvents(1, &op->readEvent);
+        CHECK_OCL_ERR(clError);
+    }
+    if (op->storeResult)
+    {
+        StoreResult(engine->resultCache, &op->resultKey, op->output, op->outputSize);
+        op->storeResult = false;
+    }
+
+    ReleaseEvent(&op->writeEvent);
+    ReleaseEvent(&op->kernelEvent);
+    ReleaseEvent(&op->readEvent);
+
+    ReleasePooledMemObject(engine->memoryPool, &op->inputBuffer);
+    ReleasePooledMemObject(engine->memoryPool, &op->outputBuffer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Filters input into width x height pixels at output, RGBA for RGB input and
+// gray for gray input unless the engine's program selects other outputs. Safe to call from
+// several threads at once: each thread uses its own queues and kernel object.
+void FilterImage(FilterEngine* engine, const RgbImage* input, void* output, int width, int height)
+{
+    FilterOperation op;
+
+    memset(&op, 0, sizeof(op));
+    EnqueueFilterOperation(engine, &op, input, output, width, height);
+    FinishFilterOperation(engine, &op);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Objects for filtering a host image into the output texture on any of the
+// paths: shared images, host copy images or the buffer kernels.
+typedef struct
+{
+	cl_command_queue queue;
+	cl_bool imageSupport;
+	InteropMode interopMode;
+	cl_mem image;               // images shared with the textures
+	cl_mem buffer;
+	cl_mem copyImage;           // images of the host copy path
+	cl_mem copyBuffer;
+	HostCopyInterop* hostCopy;
+	PboRing* pboRing;
+	GLuint inputTexture;
+	int inputWidth;
+	int inputHeight;
+	int inputPixelSize;         // 4 for RGBA, 1 for gray input textures
+	const RgbImage* mappedImage;    // input mapped from a raw image file and
+	cl_mem mappedBuffer;            // the CL_MEM_USE_HOST_PTR buffer over it
+	GLuint outputTexture;
+	int width;
+	int height;
+	int pixelsPerWorkItem;
+	unsigned char* rectPixels;  // dirty rectangles for the host copy image
+	size_t rectPixelsSize;
+} FilterTargets;
+
+// Uploads a new input image to level 0 of the input texture. Only the image
+// paths read the texture, the buffer path filters the host image directly.
+void UploadImageToTexture(PboRing* pboRing, GLuint texture, const RgbImage& image)
+{
+	int width = (int)image.GetNumCols();
+	int height = (int)image.GetNumRows();
+
+	int pixelSize = GetTexturePixelSize(image);
+
+	void* pixels = BeginPboUpload(pboRing, (size_t)width * height * pixelSize);
+	CopyImageToTexturePixels(image, (unsigned char*)pixels);
+	EndPboUpload(pboRing, texture, 0, 0, 0, width, height, GetTexturePixelFormat(pixelSize));
+}
+
+// Filters into the output texture with the kernel and weights on the image
+// paths or with the engine on the buffer path.
+void FilterToTexture(const FilterTargets* targets, cl_kernel kernel, cl_mem weights, FilterEngine* engine, const RgbImage* input)
+{
+	if (targets->imageSupport && INTEROP_GL_SHARING == targets->interopMode)
+	{
+		runKernel(targets->queue, kernel, targets->image, weights, targets->buffer, targets->width, targets->height, targets->pixelsPerWorkItem);
+	}
+	else if (targets->imageSupport)
+	{
+		runKernelHostCopy(targets->queue, kernel, targets->hostCopy, targets->pboRing, targets->inputTexture, targets->copyImage,
+						  targets->inputWidth, targets->inputHeight, targets->inputPixelSize, weights, targets->copyBuffer, targets->outputTexture,
+						  targets->width, targets->height, targets->pixelsPerWorkItem);
+	}
+	else
+	{
+		// The result is read back straight into the mapped PBO
+		int outputPixelSize = GetFilterOutputPixelSize(engine, input->GetNumChannels());
+		void* pixels = BeginPboUpload(targets->pboRing, (size_t)targets->width * targets->height * outputPixelSize);
+		if (targets->mappedBuffer && input == targets->mappedImage)
+		{
+			// The device reads the mapped file directly, no upload
+			FilterOperation op;
+			memset(&op, 0, sizeof(op));
+			EnqueueFilterBuffer(engine, &op, targets->mappedBuffer, input->GetNumCols(), input->GetNumRows(), input->GetNumBytesPerRow(),
+								input->GetNumChannels(), pixels, targets->width, targets->height);
+			FinishFilterOperation(engine, &op);
+		}
+		else
+		{
+			FilterImage(engine, input, pixels, targets->width, targets->height);
+		}
+		EndPboUpload(targets->pboRing, targets->outputTexture, 0, 0, 0, targets->width, targets->height,
+					 (1 == outputPixelSize) ? GL_LUMINANCE : GL_RGBA);
+	}
+}
+
+// Writes a rectangle of an image to dst in the layout of its texture, see
+// CopyImageToTexturePixels.
+void CopyImageRectToTexturePixels(const RgbImage& image, const PixelRect* rect, unsigned char* dst)
+{
+	for (int row = rect->y; row < rect->y + rect->height; row++)
+	{
+		const unsigned char* src = image.GetPixel(row, rect->x);
+		if (1 == image.GetNumChannels())
+		{
+			memcpy(dst, src, rect->width);
+			dst += rect->width;
+			continue;
+		}
+		for (int col = 0; col < rect->width; col++)
+		{
+			*(dst++) = *(src++);
+			*(dst++) = *(src++);
+			*(dst++) = *(src++);
+			*(dst++) = 255;
+		}
+	}
+}
+
+// Writes a rectangle of an image to the same rectangle of the input image of
+// the host copy path.
+void WriteHostCopyImageRect(FilterTargets* targets, const RgbImage& image, const PixelRect* rect)
+{
+	size_t sizeInBytes = (size_t)rect->width * rect->height * GetTexturePixelSize(image);
+
+	if (targets->rectPixelsSize < sizeInBytes)
+	{
+		free(targets->rectPixels);
+		targets->rectPixels = (unsigned char*)malloc(sizeInBytes);
+		CHECK_NULL(targets->rectPixels);
+		targets->rectPixelsSize = sizeInBytes;
+	}
+	CopyImageRectToTexturePixels(image, rect, targets->rectPixels);
+
+	size_t origin[] = {(size_t)rect->x, (size_t)rect->y, 0};
+	size_t region[] = {(size_t)rect->width, (size_t)rect->height, 1};
+	cl_int clError = clEnqueueWriteImage(targets->queue, targets->copyImage, CL_TRUE, origin, region, 0, 0,
+										 targets->rectPixels, 0, NULL, NULL);
+	CHECK_OCL_ERR(clError);
+}
+
+// Uploads the dirty rectangles of a new input image to level 0 of the input
+// texture and, on the host copy path, to the input image, which otherwise
+// would be copied back from the whole texture.
+void UploadDirtyRects(FilterTargets* targets, const RgbImage& image, const DirtyRegion* region)
+{
+	if (!targets->imageSupport)
+		return;
+
+	int pixelSize = GetTexturePixelSize(image);
+
+	for (int i = 0; i < region->numRects; i++)
+	{
+		const PixelRect* rect = &region->rects[i];
+
+		void* pixels = BeginPboUpload(targets->pboRing, (size_t)rect->width * rect->height * pixelSize);
+		CopyImageRectToTexturePixels(image, rect, (unsigned char*)pixels);
+		EndPboUpload(targets->pboRing, targets->inputTexture, 0, rect->x, rect->y, rect->width, rect->height, GetTexturePixelFormat(pixelSize));
+
+		// The PBO is mapped write-only, the image gets its own copy
+		if (INTEROP_HOST_COPY == targets->interopMode)
+			WriteHostCopyImageRect(targets, image, rect);
+	}
+}
+
+// Filters the output pixels that depend on the dirty rectangles of the input
+// into the output texture, whose other pixels stay as they are. The input
+// must have been uploaded with UploadDirtyRects. The buffer path converts and
+// uploads whole frames and filters the whole input again.
+void FilterDirtyRects(const FilterTargets* targets, cl_kernel kernel, cl_mem weights, FilterEngine* engine, const RgbImage* input,
+					  const DirtyRegion* region, int filterRadius)
+{
+	if (0 == region->numRects)
+		return;
+
+	if (!targets->imageSupport)
+	{
+		FilterToTexture(targets, kernel, weights, engine, input);
+		return;
+	}
+
+	// Grown rectangles may overlap, merging them filters every pixel once
+	DirtyRegion outputRegion;
+	ClearDirtyRegion(&outputRegion);
+	for (int i = 0; i < region->numRects; i++)
+	{
+		PixelRect rect = GetDirtyOutputRect(&region->rects[i], filterRadius, targets->inputWidth, targets->inputHeight,
+											targets->width, targets->height, targets->pixelsPerWorkItem);
+		MarkDirtyRect(&outputRegion, rect.x, rect.y, rect.width, rect.height);
+	}
+
+	if (INTEROP_GL_SHARING == targets->interopMode)
+		runKernelRects(targets->queue, kernel, targets->image, weights, targets->buffer, outputRegion.rects, outputRegion.numRects, targets->pixelsPerWorkItem);
+	else
+		runKernelHostCopyRects(targets->queue, kernel, targets->pboRing, targets->copyImage, weights, targets->copyBuffer, targets->outputTexture,
+							   outputRegion.rects, outputRegion.numRects, targets->pixelsPerWorkItem);
+}
+
+// Rows of the input compared as one band: each band with changes becomes a
+// dirty rectangle from its first to its last changed column.
+#define DIRTY_BAND_ROWS 16
+
+// Marks the pixels in which two images of the same size and format differ,
+// in bands of rows, and returns the number of changed pixels the rectangles
+// cover.
+long FindDirtyRects(const RgbImage& previous, const RgbImage& current, DirtyRegion* region)
+{
+	int numChannels = current.GetNumChannels();
+	long rowBytes = current.GetNumCols() * numChannels;
+	long area = 0;
+
+	ClearDirtyRegion(region);
+
+	for (long band = 0; band < current.GetNumRows(); band += DIRTY_BAND_ROWS)
+	{
+		long lastRow = (band + DIRTY_BAND_ROWS < current.GetNumRows()) ? band + DIRTY_BAND_ROWS : current.GetNumRows();
+		long firstChanged = -1;
+		long lastChanged = -1;
+		long first = rowBytes;
+		long last = -1;
+
+		for (long row = band; row < lastRow; row++)
+		{
+			const unsigned char* a = previous.GetPixel(row, 0);
+			const unsigned char* b = current.GetPixel(row, 0);
+			if (0 == memcmp(a, b, rowBytes))
+				continue;
+
+			long left = 0;
+			while (a[left] == b[left])
+				left++;
+			long right = rowBytes - 1;
+			while (a[right] == b[right])
+				right--;
+
+			first = (left < first) ? left : first;
+			last = (right > last) ? right : last;
+			if (firstChanged < 0)
+				firstChanged = row;
+			lastChanged = row;
+		}
+
+		if (firstChanged < 0)
+			continue;
+
+		int x = (int)(first / numChannels);
+		int width = (int)(last / numChannels) + 1 - x;
+		int height = (int)(lastChanged + 1 - firstChanged);
+		MarkDirtyRect(region, x, (int)firstChanged, width, height);
+		area += (long)width * height;
+	}
+
+	return area;
+}
+
+// Copies the dirty rectangles of source to the same pixels of destination.
+void CopyDirtyRects(RgbImage& destination, const RgbImage& source, const DirtyRegion* region)
+{
+	int numChannels = source.GetNumChannels();
+
+	for (int i = 0; i < region->numRects; i++)
+	{
+		const PixelRect* rect = &region->rects[i];
+		for (int row = rect->y; row < rect->y + rect->height; row++)
+			memcpy(destination.GetPixel(row, rect->x), source.GetPixel(row, rect->x), (size_t)rect->width * numChannels);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Regions of interest: only the requested rectangles of the output are
+// filtered and read back, the rest of the output is never computed.
+#define MAX_ROI_RECTS 16
+
+// Parses a region of interest "X,Y,WxH" with the origin at the top left of
+// the output, as image viewers count, into a rectangle with rows counted from
+// the bottom. Returns false if it is malformed or not within the output.
+bool ParseRoi(const char* text, int width, int height, PixelRect* rect)
+{
+	int x, y, roiWidth, roiHeight;
+
+	if (4 != sscanf(text, "%d,%d,%dx%d", &x, &y, &roiWidth, &roiHeight))
+		return false;
+	if (x < 0 || y < 0 || roiWidth <= 0 || roiHeight <= 0 || x + roiWidth > width || y + roiHeight > height)
+		return false;
+
+	rect->x = x;
+	rect->y = height - y - roiHeight;
+	rect->width = roiWidth;
+	rect->height = roiHeight;
+
+	return true;
+}
+
+// Returns the input pixels the filter reads for the output rectangle: the
+// rectangle grown by the filter radius and clamped to the input, which for
+// output beyond the input edge is the clamped edge.
+PixelRect GetRoiInputRect(const PixelRect* roi, int filterRadius, int inputWidth, int inputHeight)
+{
+	int left = roi->x - filterRadius;
+	int bottom = roi->y - filterRadius;
+	left = (left < 0) ? 0 : ((left > inputWidth - 1) ? inputWidth - 1 : left);
+	bottom = (bottom < 0) ? 0 : ((bottom > inputHeight - 1) ? inputHeight - 1 : bottom);
+
+	int right = roi->x + roi->width + filterRadius;
+	int top = roi->y + roi->height + filterRadius;
+	right = (right > inputWidth) ? inputWidth : ((right < left + 1) ? left + 1 : right);
+	top = (top > inputHeight) ? inputHeight : ((top < bottom + 1) ? bottom + 1 : top);
+
+	PixelRect rect = {left, bottom, right - left, top - bottom};
+	return rect;
+}
+
+// Filters only the regions of interest of the input into the output texture.
+// On the host copy path only the regions and their halos of filterRadius
+// pixels are written to the input image and only the regions are read back.
+// The buffer path filters the whole input.
+void FilterRoisToTexture(FilterTargets* targets, cl_kernel kernel, cl_mem weights, FilterEngine* engine, const RgbImage* input,
+						 const PixelRect* rois, int numRois, int filterRadius)
+{
+	if (!targets->imageSupport)
+	{
+		FilterToTexture(targets, kernel, weights, engine, input);
+		return;
+	}
+
+	// Launches start at a whole work-item, so FilterRow may also write a few
+	// pixels left of a region
+	PixelRect rects[MAX_ROI_RECTS];
+	for (int i = 0; i < numRois; i++)
+	{
+		rects[i] = rois[i];
+		rects[i].x -= rois[i].x % targets->pixelsPerWorkItem;
+		rects[i].width += rois[i].x % targets->pixelsPerWorkItem;
+	}
+
+	if (INTEROP_GL_SHARING == targets->interopMode)
+	{
+		runKernelRects(targets->queue, kernel, targets->image, weights, targets->buffer, rects, numRois, targets->pixelsPerWorkItem);
+		return;
+	}
+
+	for (int i = 0; i < numRois; i++)
+	{
+		PixelRect inputRect = GetRoiInputRect(&rects[i], filterRadius, targets->inputWidth, targets->inputHeight);
+		WriteHostCopyImageRect(targets, *input, &inputRect);
+	}
+	runKernelHostCopyRects(targets->queue, kernel, targets->pboRing, targets->copyImage, weights, targets->copyBuffer, targets->outputTexture,
+						   rects, numRois, targets->pixelsPerWorkItem);
+}
+
+// Writes a rectangle of the filtered output to an image file of numChannels
+// channels. On the image paths only the rectangle is read from the output
+// image, the buffer path crops the output texture.
+bool WriteOutputRectToFile(const FilterTargets* targets, const PixelRect* rect, int numChannels, const char* filePath)
+{
+	RgbImage output(rect->height, rect->width, numChannels);
+
+	if (!output.ImageLoaded())
+		return false;
+
+	if (!targets->imageSupport)
+	{
+		RgbImage frame(targets->height, targets->width, numChannels);
+		if (!frame.ImageLoaded())
+			return false;
+
+		glBindTexture(GL_TEXTURE_2D, targets->outputTexture);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glGetTexImage(GL_TEXTURE_2D, 0, (1 == numChannels) ? GL_LUMINANCE : GL_RGB, GL_UNSIGNED_BYTE, frame.ImageData());
+
+		for (int row = 0; row < rect->height; row++)
+			memcpy(output.GetPixel(row, 0), frame.GetPixel(rect->y + row, rect->x), (size_t)rect->width * numChannels);
+
+		return output.WriteImageFile(filePath);
+	}
+
+	// The shared output image has the format of the output texture
+	cl_mem image = (INTEROP_GL_SHARING == targets->interopMode) ? targets->buffer : targets->copyBuffer;
+	size_t pixelSize = 0;
+	cl_int clError = clGetImageInfo(image, CL_IMAGE_ELEMENT_SIZE, sizeof(pixelSize), &pixelSize, NULL);
+	CHECK_OCL_ERR(clError);
+
+	unsigned char* pixels = (unsigned char*)malloc((size_t)rect->width * rect->height * pixelSize);
+	CHECK_NULL(pixels);
+
+	size_t origin[] = {(size_t)rect->x, (size_t)rect->y, 0};
+	size_t region[] = {(size_t)rect->width, (size_t)rect->height, 1};
+	if (INTEROP_GL_SHARING == targets->interopMode)
+	{
+		glFinish();
+		clEnqueueAcquireGLObjects(targets->queue, 1, &image, 0, 0, NULL);
+	}
+	clError = clEnqueueReadImage(targets->queue, image, CL_TRUE, origin, region, 0, 0, pixels, 0, NULL, NULL);
+	CHECK_OCL_ERR(clError);
+	if (INTEROP_GL_SHARING == targets->interopMode)
+	{
+		clEnqueueReleaseGLObjects(targets->queue, 1, &image, 0, 0, NULL);
+		clFinish(targets->queue);
+	}
+
+	// RGBA to RGB, or the first channel, which holds gray and luminance
+	const unsigned char* src = pixels;
+	for (int row = 0; row < rect->height; row++)
+	{
+		unsigned char* dst = output.GetPixel(row, 0);
+		for (int col = 0; col < rect->width; col++, src += pixelSize)
+		{
+			for (int c = 0; c < numChannels; c++)
+				*(dst++) = src[(1 == pixelSize) ? 0 : c];
+		}
+	}
+	free(pixels);
+
+	return output.WriteImageFile(filePath);
+}
+
+// Path of the output file of a region: the output path itself for a single
+// region, with "_<index>" before the extension for several.
+void GetRoiOutputPath(const char* outputPath, int roiIndex, int numRois, char* roiPath, size_t size)
+{
+	const char* extension = strrchr(outputPath, '.');
+	const char* slash = strrchr(outputPath, '/');
+
+	if (1 == numRois)
+		snprintf(roiPath, size, "%s", outputPath);
+	else if (extension && (!slash || extension > slash))
+		snprintf(roiPath, size, "%.*s_%d%s", (int)(extension - outputPath), outputPath, roiIndex, extension);
+	else
+		snprintf(roiPath, size, "%s_%d", outputPath, roiIndex);
+}
+
+// Writes every region of interest to its file, see GetRoiOutputPath.
+bool WriteRoisToFiles(const FilterTargets* targets, const PixelRect* rois, int numRois, int numChannels, const char* outputPath)
+{
+	bool written = true;
+
+	for (int i = 0; i < numRois; i++)
+	{
+		char roiPath[1100];
+		GetRoiOutputPath(outputPath, i, numRois, roiPath, sizeof(roiPath));
+		if (!WriteOutputRectToFile(targets, &rois[i], numChannels, roiPath))
+		{
+			printf("\nUnable to write %s", roiPath);
+			written = false;
+		}
+	}
+
+	return written;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads until size bytes have been read or the stream ends. Returns the number
+// of bytes read.
+size_t ReadFully(int fd, void* buffer, size_t size)
+{
+	size_t total = 0;
+
+	while (total < size)
+	{
+		ssize_t count = read(fd, (char*)buffer + total, size - total);
+		if (count < 0 && EINTR == errno)
+			continue;
+		if (count <= 0)
+			break;
+		total += count;
+	}
+
+	return total;
+}
+
+// Writes size bytes, returns false on errors (e.g. the reader exited).
+bool WriteFully(int fd, const void* buffer, size_t size)
+{
+	const char* data = (const char*)buffer;
+
+	while (size > 0)
+	{
+		ssize_t count = write(fd, data, size);
+		if (count < 0 && EINTR == errno)
+			continue;
+		if (count <= 0)
+			return false;
+		data += count;
+		size -= count;
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes the frames of the pipe mode. If the output is a pipe the frames are
+// passed with vmsplice, which lets the pipe reference the pages of the frame
+// instead of copying them, so a frame must not be overwritten before the
+// reader consumed it. The pipe is therefore limited to at most one frame:
+// once a frame has been spliced, the pipe can not reference the one before
+// it, and two output buffers used alternately are safe to reuse.
+#define MAX_PIPE_SIZE (1 << 20)     // default /proc/sys/fs/pipe-max-size
+
+typedef struct
+{
+	int fd;
+	bool useVmsplice;
+} FrameWriter;
+
+void InitFrameWriter(FrameWriter* writer, int fd, size_t frameSize)
+{
+	struct stat status;
+
+	CHECK_NULL(writer);
+
+	writer->fd = fd;
+	writer->useVmsplice = false;
+
+	if (0 != fstat(fd, &status) || !S_ISFIFO(status.st_mode))
+		return;
+
+	// The kernel rounds pipe sizes up to a power of two pages
+	long pipeSize = sysconf(_SC_PAGESIZE);
+	while ((size_t)pipeSize * 2 <= frameSize && pipeSize * 2 <= MAX_PIPE_SIZE)
+		pipeSize *= 2;
+	if ((size_t)pipeSize > frameSize)
+		return;
+
+	int actualSize = fcntl(fd, F_SETPIPE_SZ, (int)pipeSize);
+	writer->useVmsplice = (actualSize > 0 && (size_t)actualSize <= frameSize);
+}
+
+bool WriteFrame(FrameWriter* writer, const void* frame, size_t size)
+{
+	const char* data = (const char*)frame;
+
+	while (writer->useVmsplice && size > 0)
+	{
+		struct iovec segment;
+		segment.iov_base = (void*)data;
+		segment.iov_len = size;
+
+		ssize_t count = vmsplice(writer->fd, &segment, 1, 0);
+		if (count < 0 && EINTR == errno)
+			continue;
+		if (count < 0 && EPIPE == errno)
+			return false;
+		if (count < 0)
+		{
+			// Memory of the OpenCL runtime may not be spliceable
+			writer->useVmsplice = false;
+			break;
+		}
+		data += count;
+		size -= count;
+	}
+
+	return WriteFully(writer->fd, data, size);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Filters raw frames of width x height RGB24, RGBA or gray8 pixels (numChannels
+// 3, 4 or 1) from stdin to outputFd in the same format, or as 8-bit gray
+// frames with luminanceOutput, e.g. between two ffmpeg -f rawvideo processes.
+// There is no GL: the buffer kernels run in a context of their own. Frames
+// are read with large read() calls into two pinned staging buffers, so the
+// next frame is read while the device filters the current one, and results
+// are read back into two more staging buffers that are written to the output.
+int RunPipeMode(cl_platform_id platform, cl_device_id device, int width, int height, int numChannels, bool luminanceOutput, int outputFd,
+				const float* filter, const int* fixedFilter, int fixedPointShift, const char* buildOptions, ResultCache* resultCache)
+{
+	char* sourceCode = NULL;
+	size_t sourceCodeLength = 0;
+	char pipeBuildOptions[128];
+
+	cl_context context = CreateOpenCLContext(platform, device, NULL);
+	cl_command_queue queue = CreateOpenCLQueue(device, context);
+
+	// RGB24 output comes straight from the kernels
+	if (snprintf(pipeBuildOptions, sizeof(pipeBuildOptions), "%s%s", buildOptions, (3 == numChannels) ? " -DOUTPUT_RGB" : "") >= (int)sizeof(pipeBuildOptions))
+	{
+		printf("\nBuild options too long: %s", buildOptions);
+		exit(EXIT_FAILURE);
+	}
+	sourceCode = LoadOpenCLSourceFromFile("OpenCLKernels.cl", &sourceCodeLength);
+	cl_program program = CreateAndBuildProgramFromSource(context, sourceCode, sourceCodeLength, pipeBuildOptions);
+
+	StagingPool stagingPool;
+	InitStagingPool(&stagingPool, context, queue);
+
+	DeviceMemoryPool memoryPool;
+	InitDeviceMemoryPool(&memoryPool, context, device);
+
+	FilterEngine engine;
+	InitFilterEngine(&engine, context, device, program, &memoryPool, filter, fixedFilter, fixedPointShift, 9, GetDefaultQueueMode(device));
+	engine.outputPixelSize = luminanceOutput ? 1 : numChannels;
+	engine.resultCache = resultCache;
+
+	size_t frameSize = (size_t)width * height * numChannels;
+	size_t outputFrameSize = (size_t)width * height * GetFilterOutputPixelSize(&engine, numChannels);
+	StagingBuffer* inputs[2];
+	StagingBuffer* outputs[2];
+	FilterOperation ops[2];
+	for (int i = 0; i < 2; i++)
+	{
+		inputs[i] = AcquireStagingBuffer(&stagingPool, frameSize);
+		outputs[i] = AcquireStagingBuffer(&stagingPool, outputFrameSize);
+		memset(&ops[i], 0, sizeof(ops[i]));
+	}
+
+	// Fewer, larger reads from a bigger input pipe
+	fcntl(STDIN_FILENO, F_SETPIPE_SZ, MAX_PIPE_SIZE);
+
+	FrameWriter writer;
+	InitFrameWriter(&writer, outputFd, outputFrameSize);
+
+	long numFrames = 0;
+	bool writeFailed = false;
+	double startTime = GetTimeMs();
+
+	bool pending = (ReadFully(STDIN_FILENO, inputs[0]->hostPtr, frameSize) == frameSize);
+	if (pending)
+		EnqueueFilterPixels(&engine, &ops[0], inputs[0]->hostPtr, width, height, width * numChannels, numChannels, outputs[0]->hostPtr, width, height);
+
+	while (pending)
+	{
+		int current = numFrames % 2;
+		int next = 1 - current;
+
+		// Read the next frame while the device works on the current one
+		bool nextPending = (ReadFully(STDIN_FILENO, inputs[next]->hostPtr, frameSize) == frameSize);
+
+		FinishFilterOperation(&engine, &ops[current]);
+		numFrames++;
+		if (!WriteFrame(&writer, outputs[current]->hostPtr, outputFrameSize))
+		{
+			writeFailed = true;
+			break;
+		}
+
+		if (nextPending)
+			EnqueueFilterPixels(&engine, &ops[next], inputs[next]->hostPtr, width, height, width * numChannels, numChannels, outputs[next]->hostPtr, width, height);
+		pending = nextPending;
+	}
+
+	double elapsedTime = GetTimeMs() - startTime;
+	const char* formatName = (4 == numChannels) ? "RGBA" : ((1 == numChannels) ? "gray8" : "RGB24");
+	printf("\nFiltered %ld frames of %dx%d %s pixels, %.3f ms per frame%s\n", numFrames, width, height, formatName,
+		   numFrames ? elapsedTime / numFrames : 0.0, writer.useVmsplice ? " (vmsplice output)" : "");
+	if (writeFailed)
+		printf("\nUnable to write to the output");
+	if (resultCache)
+		PrintResultCacheStats(resultCache);
+
+	for (int i = 0; i < 2; i++)
+	{
+		ReleaseStagingBuffer(&stagingPool, inputs[i]);
+		ReleaseStagingBuffer(&stagingPool, outputs[i]);
+	}
+	ReleaseStagingPool(&stagingPool);
+	ReleaseFilterEngine(&engine);
+	ReleaseThreadResources();
+	ReleaseDeviceMemoryPool(&memoryPool);
+
+	if (sourceCode)
+		free(sourceCode);
+	ReleaseProgram(&program);
+	ReleaseOpenCLQueue(&queue);
+	ReleaseOpenCLContext(&context);
+
+	return writeFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Pipe mode for yuv420p and nv12 frames. The planes stay in their native
+// layout and resolution on the device, which moves 1.5 bytes per pixel
+// instead of 3 or 4. Needs image support. Two sets of staging buffers let the
+// next frame be read while the device filters the current one.
+int RunYuvPipeMode(cl_platform_id platform, cl_device_id device, int width, int height, YuvLayout layout, bool filterChroma,
+				   int outputFd, const float* filter, const char* buildOptions)
+{
+	char* sourceCode = NULL;
+	size_t sourceCodeLength = 0;
+
+	if (!DeviceSupportsImages(device) || (width % 2) || (height % 2))
+	{
+		printf("\nYUV frames need a device with image support and an even frame size");
+		return EXIT_FAILURE;
+	}
+
+	cl_context context = CreateOpenCLContext(platform, device, NULL);
+	cl_command_queue queue = CreateOpenCLQueue(device, context);
+
+	sourceCode = LoadOpenCLSourceFromFile("OpenCLKernels.cl", &sourceCodeLength);
+	cl_program program = CreateAndBuildProgramFromSource(context, sourceCode, sourceCodeLength, buildOptions);
+	cl_kernel kernel = CreateKernel(program, (YUV_LAYOUT_I420 == layout) ? "FilterYUV420" : "FilterNV12");
+
+	StagingPool stagingPool;
+	InitStagingPool(&stagingPool, context, queue);
+
+	DeviceMemoryPool memoryPool;
+	InitDeviceMemoryPool(&memoryPool, context, device);
+
+	cl_mem filterWeightsBuffer = AcquirePooledBuffer(&memoryPool, CL_MEM_READ_ONLY, sizeof(float) * 9);
+	CopyHostToDevice((void*)filter, filterWeightsBuffer, sizeof(float) * 9, queue, CL_TRUE);
+
+	size_t frameSize = GetYuvFrameSize(width, height);
+	StagingBuffer* inputs[2];
+	StagingBuffer* outputs[2];
+	for (int i = 0; i < 2; i++)
+	{
+		inputs[i] = AcquireStagingBuffer(&stagingPool, frameSize);
+		outputs[i] = AcquireStagingBuffer(&stagingPool, frameSize);
+	}
+
+	YuvImage inputImage;
+	YuvImage outputImage;
+	CreateYuvImage(&memoryPool, layout, CL_MEM_READ_ONLY, width, height, &inputImage);
+	CreateYuvImage(&memoryPool, layout, CL_MEM_WRITE_ONLY, width, height, &outputImage);
+
+	fcntl(STDIN_FILENO, F_SETPIPE_SZ, MAX_PIPE_SIZE);
+
+	FrameWriter writer;
+	InitFrameWriter(&writer, outputFd, frameSize);
+
+	long numFrames = 0;
+	bool writeFailed = false;
+	double startTime = GetTimeMs();
+
+	bool pending = (ReadFully(STDIN_FILENO, inputs[0]->hostPtr, frameSize) == frameSize);
+	while (pending)
+	{
+		int current = numFrames % 2;
+		int next = 1 - current;
+
+		EnqueueYuvTransfer(queue, &inputImage, inputs[current]->hostPtr, CL_TRUE);
+		enqueueYuvKernel(queue, kernel, &inputImage, filterWeightsBuffer, &outputImage, filterChroma ? 1 : 0);
+		EnqueueYuvTransfer(queue, &outputImage, outputs[current]->hostPtr, CL_FALSE);
+		clFlush(queue);
+
+		// Read the next frame while the device works on the current one
+		pending = (ReadFully(STDIN_FILENO, inputs[next]->hostPtr, frameSize) == frameSize);
+
+		clFinish(queue);
+		numFrames++;
+		if (!WriteFrame(&writer, outputs[current]->hostPtr, frameSize))
+		{
+			writeFailed = true;
+			break;
+		}
+	}
+
+	double elapsedTime = GetTimeMs() - startTime;
+	printf("\nFiltered %ld frames of %dx%d %s pixels, %.3f ms per frame%s\n", numFrames, width, height,
+		   (YUV_LAYOUT_I420 == layout) ? "yuv420p" : "nv12", numFrames ? elapsedTime / numFrames : 0.0,
+		   writer.useVmsplice ? " (vmsplice output)" : "");
+	if (writeFailed)
+		printf("\nUnable to write to the output");
+
+	for (int i = 0; i < 2; i++)
+	{
+		ReleaseStagingBuffer(&stagingPool, inputs[i]);
+		ReleaseStagingBuffer(&stagingPool, outputs[i]);
+	}
+	ReleaseYuvImage(&memoryPool, &inputImage);
+	ReleaseYuvImage(&memoryPool, &outputImage);
+	ReleasePooledMemObject(&memoryPool, &filterWeightsBuffer);
+	ReleaseStagingPool(&stagingPool);
+	ReleaseDeviceMemoryPool(&memoryPool);
+
+	if (sourceCode)
+		free(sourceCode);
+	ReleaseKernel(&kernel);
+	ReleaseProgram(&program);
+	ReleaseOpenCLQueue(&queue);
+	ReleaseOpenCLContext(&context);
+
+	return writeFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Batch mode: filters every BMP, QOI and raw image (.rimg) file of a directory
+// into files of the same names in another directory. With many small files
+// the time per file goes to decoding, encoding and the file system rather
+// than to the kernel, so the files are spread over a pool of host threads
+// that each keep BATCH_PIPELINE_DEPTH files in flight: while the device
+// uploads, filters and reads back the files submitted last, the thread
+// decodes the next file or encodes a finished one.
+//
+// Files are read and written asynchronously (io_uring, or a few pread and
+// pwrite threads) through BATCH_IO_BUFFERS buffers per worker: up to
+// BATCH_READ_AHEAD reads are kept in flight and decoded in the buffer they
+// completed in, and results are encoded into a buffer and written while the
+// worker goes on. Files larger than a buffer, and raw image files, which are
+// mapped, take the synchronous path.
+//
+// Work is balanced by stealing. Every worker owns a deque of files, initially
+// an equal share of the sorted list, and takes files from its bottom end. A
+// worker whose deque is empty steals the upper half of the files left in
+// another worker's deque. The files of a deque are always a contiguous range
+// of the list, so a deque is only two indices under a mutex, and a steal
+// moves many files at once, which keeps the locks uncontended.
+#define BATCH_PIPELINE_DEPTH 3
+#define MAX_BATCH_THREADS 64
+#define BATCH_IO_BUFFERS 8
+#define BATCH_READ_AHEAD 4
+#define BATCH_IO_BUFFER_SIZE (1 << 20)
+
+typedef struct
+{
+	long top;                   // files [top, bottom) of the list
+	long bottom;
+	pthread_mutex_t lock;
+} BatchDeque;
+
+typedef struct
+{
+	FilterEngine* engine;
+	const char* inputDir;
+	const char* outputDir;
+	char** fileNames;
+	long numFiles;
+	int numChannels;
+	int numWorkers;
+	BatchDeque deques[MAX_BATCH_THREADS];
+	pthread_mutex_t statsLock;
+	long numFailed;
+	long numSteals;
+	int numIoUringWorkers;
+} BatchPool;
+
+typedef struct
+{
+	BatchPool* pool;
+	int index;
+} BatchWorker;
+
+// A file in flight. The buffers are kept and grown between files.
+typedef struct
+{
+	long file;                  // index in the list, -1 if the slot is free
+	RgbImage input;
+	unsigned char* inputPixels;
+	long inputCapacity;
+	unsigned char* outputPixels;
+	size_t outputCapacity;
+	FilterOperation op;
+} BatchSlot;
+
+static int CompareFileNames(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Lists the image files of a directory in sorted order. Returns the number of
+// files, or -1 if the directory can not be read.
+long ListImageFiles(const char* dirPath, char*** fileNames)
+{
+	DIR* dir = opendir(dirPath);
+	long numFiles = 0;
+	long capacity = 1024;
+
+	*fileNames = NULL;
+	if (!dir)
+		return -1;
+
+	char** names = (char**)malloc(capacity * sizeof(char*));
+	CHECK_NULL(names);
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		const char* name = entry->d_name;
+		size_t length = strlen(name);
+		bool isBmp = (length > 4 && 0 == strcasecmp(name + length - 4, ".bmp"));
+		if (!isBmp && !RgbImage::IsQoiFileName(name) && !RgbImage::IsRawImageFileName(name))
+			continue;
+
+		if (numFiles == capacity)
+		{
+			capacity *= 2;
+			names = (char**)realloc(names, capacity * sizeof(char*));
+			CHECK_NULL(names);
+		}
+		names[numFiles] = strdup(name);
+		CHECK_NULL(names[numFiles]);
+		numFiles++;
+	}
+	closedir(dir);
+
+	qsort(names, numFiles, sizeof(char*), CompareFileNames);
+	*fileNames = names;
+
+	return numFiles;
+}
+
+// Takes the next file from the bottom of the worker's own deque.
+static bool PopBatchFile(BatchDeque* deque, long* file)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom > deque->top)
+	{
+		*file = --deque->bottom;
+		found = true;
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	return found;
+}
+
+// Moves the lower half of the files of the first other worker that has some,
+// the end opposite to the one its owner pops from, into the empty deque of
+// the thief. Returns false when all deques are empty.
+static bool StealBatchFiles(BatchPool* pool, int thief)
+{
+	for (int i = 1; i < pool->numWorkers; i++)
+	{
+		BatchDeque* victim = &pool->deques[(thief + i) % pool->numWorkers];
+
+		pthread_mutex_lock(&victim->lock);
+		long count = (victim->bottom - victim->top + 1) / 2;
+		long first = victim->top;
+		victim->top += count;
+		pthread_mutex_unlock(&victim->lock);
+
+		if (count > 0)
+		{
+			BatchDeque* own = &pool->deques[thief];
+			pthread_mutex_lock(&own->lock);
+			own->top = first;
+			own->bottom = first + count;
+			pthread_mutex_unlock(&own->lock);
+
+			pthread_mutex_lock(&pool->statsLock);
+			pool->numSteals++;
+			pthread_mutex_unlock(&pool->statsLock);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool NextBatchFile(BatchPool* pool, int worker, long* file)
+{
+	while (!PopBatchFile(&pool->deques[worker], file))
+	{
+		if (!StealBatchFiles(pool, worker))
+			return false;
+	}
+
+	return true;
+}
+
+static void CountBatchFailure(BatchPool* pool, const char* fileName)
+{
+	pthread_mutex_lock(&pool->statsLock);
+	pool->numFailed++;
+	pthread_mutex_unlock(&pool->statsLock);
+	fprintf(stderr, "\nUnable to filter %s", fileName);
+}
+
+// Decodes a file into the slot and enqueues its filtering without waiting.
+// The file is read here unless its contents are passed in data.
+static bool SubmitBatchFile(BatchPool* pool, BatchSlot* slot, long file, const unsigned char* data, size_t dataSize)
+{
+	char filePath[1100];
+	const char* fileName = pool->fileNames[file];
+
+	snprintf(filePath, sizeof(filePath), "%s/%s", pool->inputDir, fileName);
+
+	if (data)
+	{
+		// Decoded straight from the read buffer; the image owns its pixels
+		if (!slot->input.LoadImageData(fileName, data, (long)dataSize, NULL, 0, pool->numChannels))
+			return false;
+	}
+	else if (RgbImage::IsRawImageFileName(fileName))
+	{
+		if (!slot->input.MapRawImageFile(filePath) || slot->input.GetNumChannels() != pool->numChannels)
+			return false;
+	}
+	else
+	{
+		long numRows = 0;
+		long numCols = 0;
+		if (!RgbImage::ReadImageFileSize(filePath, &numRows, &numCols))
+			return false;
+
+		long inputSize = (((pool->numChannels * numCols + 3) >> 2) << 2) * numRows;
+		if (inputSize > slot->inputCapacity)
+		{
+			free(slot->inputPixels);
+			slot->inputPixels = (unsigned char*)malloc(inputSize);
+			CHECK_NULL(slot->inputPixels);
+			slot->inputCapacity = inputSize;
+		}
+		if (!slot->input.LoadImageFile(filePath, slot->inputPixels, slot->inputCapacity, pool->numChannels))
+			return false;
+	}
+
+	int width = (int)slot->input.GetNumCols();
+	int height = (int)slot->input.GetNumRows();
+	size_t outputSize = (size_t)width * height * GetFilterOutputPixelSize(pool->engine, pool->numChannels);
+	if (outputSize > slot->outputCapacity)
+	{
+		free(slot->outputPixels);
+		slot->outputPixels = (unsigned char*)malloc(outputSize);
+		CHECK_NULL(slot->outputPixels);
+		slot->outputCapacity = outputSize;
+	}
+
+	memset(&slot->op, 0, sizeof(slot->op));
+	EnqueueFilterOperation(pool->engine, &slot->op, &slot->input, slot->outputPixels, width, height);
+	slot->file = file;
+
+	return true;
+}
+
+// Waits for the filtered file of the slot and encodes it to the output
+// directory, into a buffer of io that is written asynchronously if one is
+// free and large enough. The output rows are packed and in the order of the
+// input rows.
+static void RetireBatchFile(BatchPool* pool, BatchSlot* slot, AsyncFileIO* io)
+{
+	char filePath[1100];
+	const char* fileName = pool->fileNames[slot->file];
+	int outputChannels = GetFilterOutputPixelSize(pool->engine, pool->numChannels);
+
+	FinishFilterOperation(pool->engine, &slot->op);
+
+	RgbImage output;
+	output.AttachImageData(slot->outputPixels, slot->input.GetNumRows(), slot->input.GetNumCols(), outputChannels,
+						   slot->input.GetNumCols() * outputChannels);
+	snprintf(filePath, sizeof(filePath), "%s/%s", pool->outputDir, fileName);
+
+	int buffer = AcquireFileIOBuffer(io);
+	if (buffer >= 0)
+	{
+		long size = output.EncodeImageData(filePath, GetFileIOBuffer(io, buffer), (long)io->bufferSize);
+		if (size >= 0 && SubmitFileWrite(io, buffer, filePath, size, (void*)(intptr_t)slot->file))
+		{
+			slot->input.Reset();
+			slot->file = -1;
+			return;
+		}
+		ReleaseFileIOBuffer(io, buffer);
+	}
+
+	if (!output.WriteImageFile(filePath))
+		CountBatchFailure(pool, fileName);
+
+	slot->input.Reset();
+	slot->file = -1;
+}
+
+// Retires the oldest file in flight if needed and submits file to its slot.
+static void FilterBatchFile(BatchPool* pool, BatchSlot* slots, int* next, AsyncFileIO* io, long file,
+							const unsigned char* data, size_t dataSize)
+{
+	BatchSlot* slot = &slots[*next];
+
+	if (slot->file >= 0)
+		RetireBatchFile(pool, slot, io);
+
+	if (!SubmitBatchFile(pool, slot, file, data, dataSize))
+	{
+		slot->input.Reset();
+		CountBatchFailure(pool, pool->fileNames[file]);
+		return;
+	}
+	*next = (*next + 1) % BATCH_PIPELINE_DEPTH;
+}
+
+static void* BatchWorkerMain(void* arg)
+{
+	BatchWorker* worker = (BatchWorker*)arg;
+	BatchPool* pool = worker->pool;
+	BatchSlot slots[BATCH_PIPELINE_DEPTH];
+	AsyncFileIO io;
+	FileIOCompletion completion;
+	char filePath[1100];
+	bool moreFiles = true;
+	int numReads = 0;
+	long file;
+	int next = 0;
+
+	for (int i = 0; i < BATCH_PIPELINE_DEPTH; i++)
+	{
+		slots[i].file = -1;
+		slots[i].inputPixels = NULL;
+		slots[i].inputCapacity = 0;
+		slots[i].outputPixels = NULL;
+		slots[i].outputCapacity = 0;
+	}
+
+	if (!InitAsyncFileIO(&io, BATCH_IO_BUFFERS, BATCH_IO_BUFFER_SIZE, true))
+		exit(EXIT_FAILURE);
+	if (io.useIoUring)
+	{
+		pthread_mutex_lock(&pool->statsLock);
+		pool->numIoUringWorkers++;
+		pthread_mutex_unlock(&pool->statsLock);
+	}
+
+	for (;;)
+	{
+		// Keep reads in flight; files that can not be read into a buffer are
+		// filtered synchronously
+		while (moreFiles && numReads < BATCH_READ_AHEAD)
+		{
+			if (!NextBatchFile(pool, worker->index, &file))
+			{
+				moreFiles = false;
+				break;
+			}
+
+			int buffer = -1;
+			if (!RgbImage::IsRawImageFileName(pool->fileNames[file]))
+			{
+				snprintf(filePath, sizeof(filePath), "%s/%s", pool->inputDir, pool->fileNames[file]);
+				buffer = AcquireFileIOBuffer(&io);
+				if (buffer >= 0 && !SubmitFileRead(&io, buffer, filePath, (void*)(intptr_t)file))
+				{
+					ReleaseFileIOBuffer(&io, buffer);
+					buffer = -1;
+				}
+			}
+			if (buffer >= 0)
+				numReads++;
+			else
+				FilterBatchFile(pool, slots, &next, &io, file, NULL, 0);
+		}
+
+		if (!WaitFileIO(&io, &completion))
+			break;
+
+		file = (intptr_t)completion.user;
+		if (FILE_IO_READ == completion.type)
+		{
+			numReads--;
+			if (completion.ok)
+				FilterBatchFile(pool, slots, &next, &io, file, completion.data, completion.size);
+			else
+				CountBatchFailure(pool, pool->fileNames[file]);
+		}
+		else if (!completion.ok)
+		{
+			CountBatchFailure(pool, pool->fileNames[file]);
+		}
+		ReleaseFileIOBuffer(&io, completion.buffer);
+	}
+
+	// Drain in submission order, then wait for the writes
+	for (int i = 0; i < BATCH_PIPELINE_DEPTH; i++)
+	{
+		BatchSlot* slot = &slots[(next + i) % BATCH_PIPELINE_DEPTH];
+		if (slot->file >= 0)
+			RetireBatchFile(pool, slot, &io);
+		free(slot->inputPixels);
+		free(slot->outputPixels);
+	}
+	while (WaitFileIO(&io, &completion))
+	{
+		if (!completion.ok)
+			CountBatchFailure(pool, pool->fileNames[(intptr_t)completion.user]);
+		ReleaseFileIOBuffer(&io, completion.buffer);
+	}
+	ReleaseAsyncFileIO(&io);
+
+	ReleaseThreadResources();
+
+	return NULL;
+}
+
+// Filters the image files of inputDir into outputDir on numThreads threads
+// (0: one per online processor). As the pipe mode it needs no GL.
+int RunBatchMode(cl_platform_id platform, cl_device_id device, const char* inputDir, const char* outputDir, int numChannels,
+				 bool luminanceOutput, int numThreads, const float* filter, const int* fixedFilter, int fixedPointShift,
+				 const char* buildOptions, ResultCache* resultCache)
+{
+	char* sourceCode = NULL;
+	size_t sourceCodeLength = 0;
+	char batchBuildOptions[128];
+	BatchPool pool;
 
-   // Pixel alignment: each row is word aligned (aligned to a 4 byte boundary)
-   //    Therefore, no need to call glPixelStore( GL_UNPACK_ALIGNMENT, ... );
+	// Outputs would replace inputs that may still be mapped
+	if (0 == strcmp(inputDir, outputDir))
+	{
+		printf("\nThe batch output directory must differ from the input directory");
+		return EXIT_FAILURE;
+	}
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	//glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, theTexMap.GetNumCols(), theTexMap.GetNumRows();
+	pool.numFiles = ListImageFiles(inputDir, &pool.fileNames);
+	if (pool.numFiles < 0)
+	{
+		printf("\nUnable to read the directory %s", inputDir);
+		return EXIT_FAILURE;
+	}
 
-    gluBuild2DMipmaps(GL_TEXTURE_2D, 3, theTexMap.GetNumCols(), theTexMap.GetNumRows(), GL_RGB, GL_UNSIGNED_BYTE, theTexMap.ImageData() );
-	
-	return texture;
+	if (numThreads <= 0)
+		numThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (numThreads < 1)
+		numThreads = 1;
+	if (numThreads > MAX_BATCH_THREADS)
+		numThreads = MAX_BATCH_THREADS;
+	if (numThreads > pool.numFiles)
+		numThreads = pool.numFiles > 0 ? (int)pool.numFiles : 1;
+
+	cl_context context = CreateOpenCLContext(platform, device, NULL);
+	cl_command_queue queue = CreateOpenCLQueue(device, context);
+
+	// Packed RGB output rows are written as they are
+	if (snprintf(batchBuildOptions, sizeof(batchBuildOptions), "%s -DOUTPUT_RGB", buildOptions) >= (int)sizeof(batchBuildOptions))
+	{
+		printf("\nBuild options too long: %s", buildOptions);
+		exit(EXIT_FAILURE);
+	}
+	sourceCode = LoadOpenCLSourceFromFile("OpenCLKernels.cl", &sourceCodeLength);
+	cl_program program = CreateAndBuildProgramFromSource(context, sourceCode, sourceCodeLength, batchBuildOptions);
+
+	DeviceMemoryPool memoryPool;
+	InitDeviceMemoryPool(&memoryPool, context, device);
+
+	FilterEngine engine;
+	InitFilterEngine(&engine, context, device, program, &memoryPool, filter, fixedFilter, fixedPointShift, 9, GetDefaultQueueMode(device));
+	engine.outputPixelSize = luminanceOutput ? 1 : 3;
+	engine.resultCache = resultCache;
+
+	pool.engine = &engine;
+	pool.inputDir = inputDir;
+	pool.outputDir = outputDir;
+	pool.numChannels = numChannels;
+	pool.numWorkers = numThreads;
+	pool.numFailed = 0;
+	pool.numSteals = 0;
+	pool.numIoUringWorkers = 0;
+	pthread_mutex_init(&pool.statsLock, NULL);
+
+	// Equal contiguous shares of the list
+	BatchWorker workers[MAX_BATCH_THREADS];
+	pthread_t threads[MAX_BATCH_THREADS];
+	for (int i = 0; i < numThreads; i++)
+	{
+		pool.deques[i].top = pool.numFiles * i / numThreads;
+		pool.deques[i].bottom = pool.numFiles * (i + 1) / numThreads;
+		pthread_mutex_init(&pool.deques[i].lock, NULL);
+		workers[i].pool = &pool;
+		workers[i].index = i;
+	}
+
+	double startTime = GetTimeMs();
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		if (pthread_create(&threads[i], NULL, BatchWorkerMain, &workers[i]))
+		{
+			printf("\nUnable to create worker thread");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int i = 0; i < numThreads; i++)
+		pthread_join(threads[i], NULL);
+
+	double elapsedTime = GetTimeMs() - startTime;
+	printf("\nFiltered %ld of %ld files on %d threads in %.1f ms, %.3f ms per file, %ld steals, %s file I/O\n",
+		   pool.numFiles - pool.numFailed, pool.numFiles, numThreads, elapsedTime,
+		   pool.numFiles ? elapsedTime / pool.numFiles : 0.0, pool.numSteals,
+		   pool.numIoUringWorkers ? "io_uring" : "threaded");
+	if (resultCache)
+		PrintResultCacheStats(resultCache);
+
+	for (int i = 0; i < numThreads; i++)
+		pthread_mutex_destroy(&pool.deques[i].lock);
+	pthread_mutex_destroy(&pool.statsLock);
+	for (long i = 0; i < pool.numFiles; i++)
+		free(pool.fileNames[i]);
+	free(pool.fileNames);
+
+	ReleaseFilterEngine(&engine);
+	ReleaseThreadResources();
+	ReleaseDeviceMemoryPool(&memoryPool);
+
+	if (sourceCode)
+		free(sourceCode);
+	ReleaseProgram(&program);
+	ReleaseOpenCLQueue(&queue);
+	ReleaseOpenCLContext(&context);
+
+	return pool.numFailed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-GLuint loadTexture(int id, int width, int height)
-{   
-	GLuint texture;
-	glGenTextures(id, &texture); // Get the First Free Name to use for the Font Texture
-	glBindTexture(GL_TEXTURE_2D, texture); // Actually create the texture object
-    glClearColor (0.0, 0.0, 0.0, 0.0);
-    glShadeModel(GL_FLAT);
-    glEnable(GL_DEPTH_TEST);
+///////////////////////////////////////////////////////////////////////////////
+// Reads level 0 of a texture back to the host as RGB or, with numChannels 1,
+// gray pixels and writes them to a BMP file (8-bit for gray), to a QOI file if
+// the path ends in ".qoi", to a raw image container if it ends in ".rimg" or
+// to a raw file of top-down rows if it ends in ".raw".
+bool WriteTextureToFile(GLuint texture, int width, int height, int numChannels, const char* filePath)
+{
+	RgbImage output(height, width, numChannels);
 
-   // Pixel alignment: each row is word aligned (aligned to a 4 byte boundary)
-   //    Therefore, no need to call glPixelStore( GL_UNPACK_ALIGNMENT, ... );
+	if (!output.ImageLoaded())
+		return false;
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width, height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
+	// RgbImage rows are padded to 4 bytes, as is the default pack alignment
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glGetTexImage(GL_TEXTURE_2D, 0, (1 == numChannels) ? GL_LUMINANCE : GL_RGB, GL_UNSIGNED_BYTE, output.ImageData());
 
-	return texture;
+	return output.WriteImageFile(filePath);
 }
 
-void runKernel(cl_command_queue queue, cl_kernel kernel, cl_mem image, cl_mem filterWeightsBuffer, cl_mem buffer, int width, int height)
+///////////////////////////////////////////////////////////////////////////////
+// Draws a texture over the whole viewport with a single triangle that covers
+// the clip space square. All state is created once, so a frame costs a
+// program bind, a texture bind and one draw call.
+static const char* displayVertexShader =
+	"#version 110\n"
+	"attribute vec2 position;\n"
+	"varying vec2 texCoord;\n"
+	"void main()\n"
+	"{\n"
+	"    texCoord = position * 0.5 + 0.5;\n"
+	"    gl_Position = vec4(position, 0.0, 1.0);\n"
+	"}\n";
+
+static const char* displayFragmentShader =
+	"#version 110\n"
+	"uniform sampler2D image;\n"
+	"varying vec2 texCoord;\n"
+	"void main()\n"
+	"{\n"
+	"    gl_FragColor = texture2D(image, texCoord);\n"
+	"}\n";
+
+typedef struct
 {
-	cl_int clError = 0;
-	
-	glFinish();
-	clEnqueueAcquireGLObjects(queue, 1,  &image, 0, 0, NULL);
-	clEnqueueAcquireGLObjects(queue, 1,  &buffer, 0, 0, NULL);
-	clFinish(queue);
-	clError |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &image);
-	clError |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &filterWeightsBuffer);
-	clError |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &buffer);
-	CHECK_OCL_ERR(clError);
+	GLuint program;
+	GLuint vertexBuffer;
+	GLuint vertexArray;     // 0 without GL 3.0 or GL_ARB_vertex_array_object
+	GLint positionLocation;
+} DisplayPipeline;
+
+// Returns a compiled shader or 0 after printing the info log.
+GLuint CompileShader(GLenum type, const char* source)
+{
+	GLint status = GL_FALSE;
+	GLuint shader = glCreateShader(type);
 
-	int workDim = 2;
-	size_t globalWorkSize[2] = {width, height};
-	// Launch the kernel
-	clError = clEnqueueNDRangeKernel(queue, kernel, workDim, NULL, globalWorkSize, NULL, 0, NULL, NULL);
-	CHECK_OCL_ERR(clError);
-	clFinish(queue);
-	
-	clEnqueueReleaseGLObjects(queue, 1,  &image, 0, 0, NULL);
-	clEnqueueReleaseGLObjects(queue, 1,  &buffer, 0, 0, NULL);
-	clFinish(queue);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+
+	if (GL_TRUE != status)
+	{
+		char log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		printf("\nShader compilation failed:\n%s", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+bool InitDisplayPipeline(DisplayPipeline* display)
+{
+	GLint status = GL_FALSE;
+	const GLfloat triangle[] = {
+		-1.0f, -1.0f,
+		 3.0f, -1.0f,
+		-1.0f,  3.0f
+	};
+
+	CHECK_NULL(display);
+	memset(display, 0, sizeof(*display));
+
+	GLuint vertexShader = CompileShader(GL_VERTEX_SHADER, displayVertexShader);
+	GLuint fragmentShader = CompileShader(GL_FRAGMENT_SHADER, displayFragmentShader);
+	if (!vertexShader || !fragmentShader)
+	{
+		glDeleteShader(vertexShader);
+		glDeleteShader(fragmentShader);
+		return false;
+	}
+
+	display->program = glCreateProgram();
+	glAttachShader(display->program, vertexShader);
+	glAttachShader(display->program, fragmentShader);
+	glLinkProgram(display->program);
+	glDeleteShader(vertexShader);
+	glDeleteShader(fragmentShader);
+
+	glGetProgramiv(display->program, GL_LINK_STATUS, &status);
+	if (GL_TRUE != status)
+	{
+		char log[1024];
+		glGetProgramInfoLog(display->program, sizeof(log), NULL, log);
+		printf("\nShader program link failed:\n%s", log);
+		glDeleteProgram(display->program);
+		display->program = 0;
+		return false;
+	}
+
+	// Frames are not cleared, the triangle covers the whole viewport: without
+	// depth test nothing reads the uncleared depth buffer
+	glDisable(GL_DEPTH_TEST);
+
+	display->positionLocation = glGetAttribLocation(display->program, "position");
+	glUseProgram(display->program);
+	glUniform1i(glGetUniformLocation(display->program, "image"), 0);
+	glUseProgram(0);
+
+	if (HasGLFeature(3, 0, "GL_ARB_vertex_array_object"))
+	{
+		glGenVertexArrays(1, &display->vertexArray);
+		glBindVertexArray(display->vertexArray);
+	}
+
+	glGenBuffers(1, &display->vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, display->vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(triangle), triangle, GL_STATIC_DRAW);
+
+	if (display->vertexArray)
+	{
+		glEnableVertexAttribArray(display->positionLocation);
+		glVertexAttribPointer(display->positionLocation, 2, GL_FLOAT, GL_FALSE, 0, (const GLvoid*)0);
+		glBindVertexArray(0);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	return true;
+}
+
+void DrawTexture(DisplayPipeline* display, GLuint texture)
+{
+	glUseProgram(display->program);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	if (display->vertexArray)
+	{
+		glBindVertexArray(display->vertexArray);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glBindVertexArray(0);
+	}
+	else
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, display->vertexBuffer);
+		glEnableVertexAttribArray(display->positionLocation);
+		glVertexAttribPointer(display->positionLocation, 2, GL_FLOAT, GL_FALSE, 0, (const GLvoid*)0);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glDisableVertexAttribArray(display->positionLocation);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	glUseProgram(0);
+}
+
+void ReleaseDisplayPipeline(DisplayPipeline* display)
+{
+	CHECK_NULL(display);
+
+	if (display->vertexArray)
+		glDeleteVertexArrays(1, &display->vertexArray);
+	if (display->vertexBuffer)
+		glDeleteBuffers(1, &display->vertexBuffer);
+	if (display->program)
+		glDeleteProgram(display->program);
+
+	memset(display, 0, sizeof(*display));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Rolling window of display frame times. The histogram has fixed width
+// buckets, the last bucket also counts every slower frame.
+#define FRAME_TIME_WINDOW 240
+#define FRAME_TIME_BUCKETS 12
+#define FRAME_TIME_BUCKET_MS 2.0
+
+typedef struct
+{
+	double times[FRAME_TIME_WINDOW];
+	int count;              // valid entries in times
+	int next;               // entry written by the next frame
+	long totalFrames;
+} FrameTimeStats;
+
+void InitFrameTimeStats(FrameTimeStats* stats)
+{
+	CHECK_NULL(stats);
+
+	memset(stats, 0, sizeof(*stats));
+}
+
+void AddFrameTime(FrameTimeStats* stats, double frameTimeMs)
+{
+	stats->times[stats->next] = frameTimeMs;
+	stats->next = (stats->next + 1) % FRAME_TIME_WINDOW;
+	if (stats->count < FRAME_TIME_WINDOW)
+		stats->count++;
+	stats->totalFrames++;
+}
+
+static int CompareDoubles(const void* a, const void* b)
+{
+	double difference = *(const double*)a - *(const double*)b;
+
+	return (difference > 0) - (difference < 0);
+}
+
+// Prints the statistics of the current window to the given stream.
+void PrintFrameTimeHistogram(const FrameTimeStats* stats, FILE* stream)
+{
+	double sorted[FRAME_TIME_WINDOW];
+	int buckets[FRAME_TIME_BUCKETS];
+	double sum = 0.0;
+
+	if (0 == stats->count)
+		return;
+
+	memset(buckets, 0, sizeof(buckets));
+	for (int i = 0; i < stats->count; i++)
+	{
+		int bucket = (int)(stats->times[i] / FRAME_TIME_BUCKET_MS);
+		buckets[(bucket < FRAME_TIME_BUCKETS) ? bucket : FRAME_TIME_BUCKETS - 1]++;
+		sorted[i] = stats->times[i];
+		sum += stats->times[i];
+	}
+	qsort(sorted, stats->count, sizeof(double), CompareDoubles);
+
+	fprintf(stream, "\nLast %d of %ld frames: mean %.2f ms (%.1f fps), min %.2f, median %.2f, 99th %.2f, max %.2f ms\n",
+		stats->count, stats->totalFrames, sum / stats->count, 1000.0 * stats->count / sum,
+		sorted[0], sorted[stats->count / 2], sorted[(stats->count * 99) / 100], sorted[stats->count - 1]);
+
+	for (int bucket = 0; bucket < FRAME_TIME_BUCKETS; bucket++)
+	{
+		int bar = (buckets[bucket] * 50 + stats->count - 1) / stats->count;
+		fprintf(stream, "%5.1f ms%s %5d |%.*s\n", bucket * FRAME_TIME_BUCKET_MS,
+			(FRAME_TIME_BUCKETS - 1 == bucket) ? "+" : " ", buckets[bucket], bar,
+			"##################################################");
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Frame pacing for the real-time mode. Every frame gets a fixed share of the
+// frame period for filtering. A frame that misses this budget switches the
+// filter to the degraded quality, and a degraded frame that still misses it
+// makes the pacer drop as many frames as the overrun covered, so the display
+// keeps showing the last result instead of stalling. After a run of frames
+// well within the budget the full quality comes back.
+#define FILTER_BUDGET_FRACTION 0.75
+#define FILTER_UPGRADE_FRAMES 30
+
+typedef enum
+{
+	FILTER_QUALITY_FULL,
+	FILTER_QUALITY_DEGRADED
+} FilterQuality;
+
+typedef struct
+{
+	double framePeriodMs;
+	double budgetMs;
+	FilterQuality quality;
+	int framesToDrop;
+	int framesWithinBudget;     // consecutive degraded frames at half budget
+	long filteredFrames;
+	long degradedFrames;
+	long droppedFrames;
+	long missedDeadlines;
+} FramePacer;
+
+void InitFramePacer(FramePacer* pacer, double framesPerSecond)
+{
+	CHECK_NULL(pacer);
+
+	memset(pacer, 0, sizeof(*pacer));
+	pacer->framePeriodMs = 1000.0 / framesPerSecond;
+	pacer->budgetMs = pacer->framePeriodMs * FILTER_BUDGET_FRACTION;
+	pacer->quality = FILTER_QUALITY_FULL;
+}
+
+// Returns false if the current frame is dropped and must not be filtered.
+bool BeginPacedFrame(FramePacer* pacer)
+{
+	if (pacer->framesToDrop > 0)
+	{
+		pacer->framesToDrop--;
+		pacer->droppedFrames++;
+		return false;
+	}
+
+	return true;
+}
+
+// Accounts the filter time of a frame that was not dropped.
+void EndPacedFrame(FramePacer* pacer, double filterTimeMs)
+{
+	pacer->filteredFrames++;
+	if (FILTER_QUALITY_DEGRADED == pacer->quality)
+		pacer->degradedFrames++;
+
+	if (filterTimeMs > pacer->budgetMs)
+	{
+		pacer->missedDeadlines++;
+		pacer->framesWithinBudget = 0;
+
+		if (FILTER_QUALITY_FULL == pacer->quality)
+			pacer->quality = FILTER_QUALITY_DEGRADED;
+		else
+			pacer->framesToDrop = (int)(filterTimeMs / pacer->framePeriodMs);
+	}
+	else if (FILTER_QUALITY_DEGRADED == pacer->quality && filterTimeMs < 0.5 * pacer->budgetMs)
+	{
+		if (++pacer->framesWithinBudget >= FILTER_UPGRADE_FRAMES)
+		{
+			pacer->quality = FILTER_QUALITY_FULL;
+			pacer->framesWithinBudget = 0;
+		}
+	}
+	else
+	{
+		pacer->framesWithinBudget = 0;
+	}
+}
+
+// Sleeps until the next frame of the target rate should start.
+void WaitForNextFrame(const FramePacer* pacer, double frameStartMs)
+{
+	double remainingMs = frameStartMs + pacer->framePeriodMs - GetTimeMs();
+
+	if (remainingMs > 0.0)
+	{
+		struct timespec delay;
+		delay.tv_sec = (time_t)(remainingMs / 1000.0);
+		delay.tv_nsec = (long)((remainingMs - delay.tv_sec * 1000.0) * 1000000.0);
+		nanosleep(&delay, NULL);
+	}
+}
+
+void PrintFramePacerStats(const FramePacer* pacer)
+{
+	printf("\nReal-time filtering at %.1f fps: %ld frames filtered (%ld degraded), %ld dropped, %ld missed the %.2f ms budget\n",
+		1000.0 / pacer->framePeriodMs, pacer->filteredFrames, pacer->degradedFrames,
+		pacer->droppedFrames, pacer->missedDeadlines, pacer->budgetMs);
 }
 
 static void error_callback(int error, const char* description)
@@ -580,8 +4212,249 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
 		glfwSetWindowShouldClose(window, GL_TRUE);
 }
 
-int main(void)
+static void PrintUsage(const char* programName)
 {
+	printf("Usage: %s [options]\n", programName);
+	printf("  --headless        use an offscreen EGL context instead of a window and\n");
+	printf("                    write the result to output.bmp (default without DISPLAY)\n");
+	printf("  --iterations N    filter the input N times and report the average time\n");
+	printf("  --swap-interval N wait for N vertical blanks per displayed frame, 0 to\n");
+	printf("                    measure the display loop unthrottled (default 1)\n");
+	printf("  --frame-stats F   write the frame time histogram to file F on exit\n");
+	printf("  --input F         filter the BMP, QOI or raw image (.rimg, mapped) file F\n");
+	printf("                    instead of img.bmp\n");
+	printf("  --sequence P      filter the numbered BMP or QOI files named by the printf\n");
+	printf("                    pattern P, e.g. frames/%%05d.qoi, instead of img.bmp\n");
+	printf("  --first N         number of the first file of the sequence (default 0)\n");
+	printf("  --raw-frames F WxH  filter the packed RGB24 (gray8 with --gray) frames\n");
+	printf("                    of file F\n");
+	printf("  --output P        write every filtered frame of a sequence to the BMP\n");
+	printf("                    files named by the printf pattern P, QOI, raw image\n");
+	printf("                    or raw frames if P ends in .qoi, .rimg or .raw; for a\n");
+	printf("                    single input P is the output file (default output.bmp\n");
+	printf("                    headless)\n");
+	printf("  --gray            load the input as 8-bit gray and filter a single channel\n");
+	printf("  --pipe WxH        filter raw frames of WxH pixels from stdin to stdout,\n");
+	printf("                    diagnostics go to stderr\n");
+	printf("  --pipe-format F   pixel format of the pipe mode: rgb24 (default), rgba,\n");
+	printf("                    gray8, yuv420p or nv12\n");
+	printf("  --luma-only       filter only the luma plane of yuv420p and nv12 frames\n");
+	printf("  --platform N      use OpenCL platform N instead of asking\n");
+	printf("  --device N        use device N of the platform instead of asking\n");
+	printf("  --linearize       filter in linear light: decode sRGB input before and\n");
+	printf("                    encode the result after the convolution\n");
+	printf("  --output-color C  output colours: rgb (default), ycbcr or luminance,\n");
+	printf("                    luminance writes a single channel\n");
+	printf("  --batch IN OUT    filter all BMP, QOI and .rimg files of directory IN\n");
+	printf("                    into files of the same names in directory OUT\n");
+	printf("  --threads N       host threads of the batch mode (default: processors)\n");
+	printf("  --cache-size MB   keep up to MB megabytes of results in memory and\n");
+	printf("                    reuse them for the same input, filter and output\n");
+	printf("  --cache-dir D     also keep results in directory D, across runs\n");
+	printf("  --cache-disk-size MB  limit of the results in D (default 1024)\n");
+	printf("  --dirty-rects     refilter only the pixels of a sequence frame that changed\n");
+	printf("                    since the previous frame, and their filter footprint\n");
+	printf("  --roi X,Y,WxH     filter and write only this region of the output, X,Y\n");
+	printf("                    from the top left; repeat for up to %d regions, which\n", MAX_ROI_RECTS);
+	printf("                    are written to the output files with _0, _1, ...\n");
+	printf("                    before the extension\n");
+	printf("  --realtime FPS    refilter the input every displayed frame at FPS frames\n");
+	printf("                    per second, degrading to a 5-tap filter or dropping\n");
+	printf("                    frames over budget\n");
+}
+
+int main(int argc, char** argv)
+{
+	// Without a display only the headless backend can work
+	const char* display = getenv("DISPLAY");
+	bool headless = (NULL == display || 0 == display[0]);
+	int iterations = 1;
+	int swapInterval = 1;
+	const char* frameStatsPath = NULL;
+	double realtimeFps = 0.0;
+	const char* inputPath = filename;
+	const char* sequencePattern = NULL;
+	long firstFrame = 0;
+	const char* rawFramesPath = NULL;
+	long rawFrameWidth = 0;
+	long rawFrameHeight = 0;
+	const char* outputPattern = NULL;
+	int pipeWidth = 0;
+	int pipeHeight = 0;
+	const char* pipeFormat = "rgb24";
+	bool filterChroma = true;
+	bool linearize = false;
+	bool gray = false;
+	const char* outputColor = "rgb";
+	int platformNumber = 0;
+	int deviceNumber = 0;
+	const char* batchInputDir = NULL;
+	const char* batchOutputDir = NULL;
+	int batchThreads = 0;
+	long cacheSizeMb = 0;
+	const char* cacheDir = NULL;
+	long cacheDiskSizeMb = 1024;
+	bool dirtyRects = false;
+	const char* roiTexts[MAX_ROI_RECTS];
+	int numRois = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (0 == strcmp(argv[i], "--headless"))
+		{
+			headless = true;
+		}
+		else if (0 == strcmp(argv[i], "--iterations") && i + 1 < argc)
+		{
+			iterations = atoi(argv[++i]);
+			if (iterations < 1)
+				iterations = 1;
+		}
+		else if (0 == strcmp(argv[i], "--swap-interval") && i + 1 < argc)
+		{
+			swapInterval = atoi(argv[++i]);
+		}
+		else if (0 == strcmp(argv[i], "--frame-stats") && i + 1 < argc)
+		{
+			frameStatsPath = argv[++i];
+		}
+		else if (0 == strcmp(argv[i], "--input") && i + 1 < argc)
+		{
+			inputPath = argv[++i];
+		}
+		else if (0 == strcmp(argv[i], "--sequence") && i + 1 < argc)
+		{
+			sequencePattern = argv[++i];
+		}
+		else if (0 == strcmp(argv[i], "--first") && i + 1 < argc)
+		{
+			firstFrame = atol(argv[++i]);
+		}
+		else if (0 == strcmp(argv[i], "--raw-frames") && i + 2 < argc)
+		{
+			rawFramesPath = argv[++i];
+			if (2 != sscanf(argv[++i], "%ldx%ld", &rawFrameWidth, &rawFrameHeight))
+			{
+				PrintUsage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (0 == strcmp(argv[i], "--pipe") && i + 1 < argc)
+		{
+			if (2 != sscanf(argv[++i], "%dx%d", &pipeWidth, &pipeHeight) || pipeWidth <= 0 || pipeHeight <= 0)
+			{
+				PrintUsage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (0 == strcmp(argv[i], "--pipe-format") && i + 1 < argc)
+		{
+			pipeFormat = argv[++i];
+			if (strcmp(pipeFormat, "rgb24") && strcmp(pipeFormat, "rgba") && strcmp(pipeFormat, "gray8") &&
+				strcmp(pipeFormat, "yuv420p") && strcmp(pipeFormat, "nv12"))
+			{
+				PrintUsage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (0 == strcmp(argv[i], "--linearize"))
+		{
+			linearize = true;
+		}
+		else if (0 == strcmp(argv[i], "--gray"))
+		{
+			gray = true;
+		}
+		else if (0 == strcmp(argv[i], "--output-color") && i + 1 < argc)
+		{
+			outputColor = argv[++i];
+			if (strcmp(outputColor, "rgb") && strcmp(outputColor, "ycbcr") && strcmp(outputColor, "luminance"))
+			{
+				PrintUsage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (0 == strcmp(argv[i], "--luma-only"))
+		{
+			filterChroma = false;
+		}
+		else if (0 == strcmp(argv[i], "--platform") && i + 1 < argc)
+		{
+			platformNumber = atoi(argv[++i]);
+		}
+		else if (0 == strcmp(argv[i], "--device") && i + 1 < argc)
+		{
+			deviceNumber = atoi(argv[++i]);
+		}
+		else if (0 == strcmp(argv[i], "--output") && i + 1 < argc)
+		{
+			outputPattern = argv[++i];
+		}
+		else if (0 == strcmp(argv[i], "--batch") && i + 2 < argc)
+		{
+			batchInputDir = argv[++i];
+			batchOutputDir = argv[++i];
+		}
+		else if (0 == strcmp(argv[i], "--threads") && i + 1 < argc)
+		{
+			batchThreads = atoi(argv[++i]);
+		}
+		else if (0 == strcmp(argv[i], "--cache-size") && i + 1 < argc)
+		{
+			cacheSizeMb = atol(argv[++i]);
+		}
+		else if (0 == strcmp(argv[i], "--cache-dir") && i + 1 < argc)
+		{
+			cacheDir = argv[++i];
+		}
+		else if (0 == strcmp(argv[i], "--cache-disk-size") && i + 1 < argc)
+		{
+			cacheDiskSizeMb = atol(argv[++i]);
+		}
+		else if (0 == strcmp(argv[i], "--dirty-rects"))
+		{
+			dirtyRects = true;
+		}
+		else if (0 == strcmp(argv[i], "--roi") && i + 1 < argc)
+		{
+			if (numRois == MAX_ROI_RECTS)
+			{
+				printf("At most %d regions of interest\n", MAX_ROI_RECTS);
+				exit(EXIT_FAILURE);
+			}
+			roiTexts[numRois++] = argv[++i];
+		}
+		else if (0 == strcmp(argv[i], "--realtime") && i + 1 < argc)
+		{
+			realtimeFps = atof(argv[++i]);
+			if (realtimeFps <= 0.0)
+			{
+				PrintUsage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else
+		{
+			PrintUsage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// In pipe mode stdout carries the frames: keep it for them and send all
+	// other output to stderr. Without a terminal on stdin, take the first
+	// platform and device unless selected otherwise.
+	int pipeOutputFd = -1;
+	if (pipeWidth > 0)
+	{
+		pipeOutputFd = dup(STDOUT_FILENO);
+		if (pipeOutputFd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+			exit(EXIT_FAILURE);
+		if (platformNumber <= 0)
+			platformNumber = 1;
+		if (deviceNumber <= 0)
+			deviceNumber = 1;
+	}
+
 	float filter [] = {
 		1, 2, 1,
 		2, 4, 2,
@@ -592,11 +4465,24 @@ int main(void)
 	for (int i = 0; i < 9; ++i) {
 		filter [i] /= 16.0f;
 	}
+
+	// Colour stages fused into the float kernels
+	bool luminanceOutput = (0 == strcmp(outputColor, "luminance"));
+	char colorOptions[64];
+	sprintf(colorOptions, "%s%s%s", linearize ? " -DLINEARIZE_SRGB" : "",
+			luminanceOutput ? " -DOUTPUT_LUMINANCE" : "", strcmp(outputColor, "ycbcr") ? "" : " -DOUTPUT_YCBCR");
+
+	// Integer weights scaled by a power of two allow the fixed-point kernels,
+	// which have no colour stages
+	int fixedFilter [9];
+	int fixedPointShift = colorOptions[0] ? -1 : GetFixedPointWeights(filter, 9, fixedFilter);
+	char buildOptions[128];
+	strcpy(buildOptions, colorOptions);
+	if (fixedPointShift >= 0)
+		sprintf(buildOptions, "-DFIXED_ACCUM=%s", GetFixedPointAccumulator(fixedFilter, 9, fixedPointShift));
 	
-	GLFWwindow* window;
-	glfwSetErrorCallback(error_callback);
-	if (!glfwInit())
-		exit(EXIT_FAILURE);
+	GLContext glContext;
+	memset(&glContext, 0, sizeof(glContext));
 	
 	cl_platform_id platform = 0;
     cl_device_id device = 0;
@@ -620,107 +4506,557 @@ int main(void)
 
     // OpenCL initializations
     // Select an OpenCL platform and device
-    SelectOpenCLPlatformAndDevice(&platform, &device);
+    SelectOpenCLPlatformAndDevice(&platform, &device, platformNumber, deviceNumber);
 
     // Print the names of the selected platform and device
     printf("\nUsing platform "); PrintPlatformName(platform);
     printf(" and device "); PrintDeviceName(device);
     printf("\n");
+
+	// Results of the buffer kernels, on every path that uses them
+	ResultCache resultCacheStorage;
+	ResultCache* resultCache = NULL;
+	if (cacheSizeMb > 0 || cacheDir)
+	{
+		if (!InitResultCache(&resultCacheStorage, (size_t)(cacheSizeMb > 0 ? cacheSizeMb : 0) << 20, cacheDir,
+							 (size_t)(cacheDiskSizeMb > 0 ? cacheDiskSizeMb : 0) << 20))
+			exit(EXIT_FAILURE);
+		resultCache = &resultCacheStorage;
+	}
+
+	if (pipeWidth > 0 && 0 == strcmp(pipeFormat, "yuv420p"))
+		exit(RunYuvPipeMode(platform, device, pipeWidth, pipeHeight, YUV_LAYOUT_I420, filterChroma, pipeOutputFd, filter, buildOptions));
+	if (pipeWidth > 0 && 0 == strcmp(pipeFormat, "nv12"))
+		exit(RunYuvPipeMode(platform, device, pipeWidth, pipeHeight, YUV_LAYOUT_NV12, filterChroma, pipeOutputFd, filter, buildOptions));
+	if (pipeWidth > 0)
+	{
+		int pipeChannels = (0 == strcmp(pipeFormat, "rgba")) ? 4 : ((0 == strcmp(pipeFormat, "gray8")) ? 1 : 3);
+		exit(RunPipeMode(platform, device, pipeWidth, pipeHeight, pipeChannels, luminanceOutput, pipeOutputFd, filter, fixedFilter, fixedPointShift, buildOptions,
+						 resultCache));
+	}
+	if (batchInputDir)
+		exit(RunBatchMode(platform, device, batchInputDir, batchOutputDir, gray ? 1 : 3, luminanceOutput, batchThreads,
+						  filter, fixedFilter, fixedPointShift, buildOptions, resultCache));
 	
-	glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
-	window = glfwCreateWindow(512, 512, "Simple example", NULL, NULL);
-	
-	if (!window) {
-		glfwTerminate();
+	int width = 512;
+	int height = 512;
+
+	PixelRect rois[MAX_ROI_RECTS];
+	for (int i = 0; i < numRois; i++)
+	{
+		if (!ParseRoi(roiTexts[i], width, height, &rois[i]))
+		{
+			printf("\nInvalid region of interest %s, the output is %dx%d pixels", roiTexts[i], width, height);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (numRois > 0 && dirtyRects)
+	{
+		printf("\n--roi and --dirty-rects can not be combined");
 		exit(EXIT_FAILURE);
 	}
-	glfwMakeContextCurrent(window);
-	glfwSetKeyCallback(window, key_callback);
 
-	int width, height;
-	glfwGetFramebufferSize(window, &width, &height);
+	if (headless)
+	{
+		if (!CreateHeadlessGLContext(&glContext, width, height))
+		{
+			DestroyGLContext(&glContext);
+			exit(EXIT_FAILURE);
+		}
+	}
+	else
+	{
+		glfwSetErrorCallback(error_callback);
+		if (!glfwInit())
+			exit(EXIT_FAILURE);
+
+		glContext.backend = GL_BACKEND_GLFW;
+		glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
+		glContext.window = glfwCreateWindow(width, height, "Simple example", NULL, NULL);
+		
+		if (!glContext.window) {
+			glfwTerminate();
+			exit(EXIT_FAILURE);
+		}
+		glfwMakeContextCurrent(glContext.window);
+		glfwSetKeyCallback(glContext.window, key_callback);
+
+		glfwGetFramebufferSize(glContext.window, &width, &height);
+	}
 	
-	context = CreateOpenCLContext(platform, device);
+	// Devices without cl_khr_gl_sharing get a plain context and exchange
+	// pixels with GL through host memory
+	bool glSharing = DeviceSupportsExtension(device, "cl_khr_gl_sharing");
+	if (!glSharing)
+		printf("\nDevice lacks cl_khr_gl_sharing, copying through host memory");
+
+	context = CreateOpenCLContext(platform, device, glSharing ? &glContext : NULL);
     queue = CreateOpenCLQueue(device, context);
 	
 	sourceCode = LoadOpenCLSourceFromFile("OpenCLKernels.cl", &sourceCodeLength);
-    program = CreateAndBuildProgramFromSource(context, sourceCode, sourceCodeLength);
-	filterKernel = CreateKernel(program, "Filter");
+    program = CreateAndBuildProgramFromSource(context, sourceCode, sourceCodeLength, buildOptions);
+	int filterRadius = GetFilterRadius(buildOptions);
+	// Without image support neither samplers nor GL texture sharing are
+	// available, so the buffer based kernels are used instead.
+	cl_bool imageSupport = DeviceSupportsImages(device);
+
+	// On CPU devices let every work-item compute a row segment: the adjacent
+	// outputs map onto SIMD lanes and share their input loads. The buffer
+	// kernels are created per thread by the filter engine.
+	int pixelsPerWorkItem = 1;
+	if (imageSupport && gray)
+	{
+		filterKernel = CreateKernel(program, "FilterGray");
+	}
+	else if (imageSupport && (GetDeviceType(device) & CL_DEVICE_TYPE_CPU))
+	{
+		pixelsPerWorkItem = PIXELS_PER_WI;
+		filterKernel = CreateKernel(program, "FilterRow");
+	}
+	else if (imageSupport)
+	{
+		filterKernel = CreateKernel(program, "Filter");
+	}
 	
+	// Input and output pixels go through pinned staging memory, device memory
+	// objects are recycled through the memory pool
+	StagingPool stagingPool;
+	InitStagingPool(&stagingPool, context, queue);
+
+	DeviceMemoryPool memoryPool;
+	InitDeviceMemoryPool(&memoryPool, context, device);
+
+	// Texture uploads go through a ring of pixel buffer objects
+	PboRing pboRing;
+	InitPboRing(&pboRing);
+
 	GLuint texture;
 	GLuint texture2;
-	RgbImage theTexMap1(filename);
-	RgbImage theTexMap2(filename);
-    texture = loadTextureFromFile(theTexMap1, 1);
+	RgbImage theTexMap1;
+	StagingBuffer* inputStaging = NULL;
+
+	// A frame sequence replaces the input bitmap. Its first frame is copied
+	// into staging memory and sizes the input texture and images. Gray input
+	// stays single channel from the file to the output texture.
+	int numChannels = gray ? 1 : 3;
+	FrameSource frameSource;
+	bool frameSourceOpen = false;
+	Frame* frame = NULL;
+	if (sequencePattern)
+		frameSourceOpen = OpenBmpSequence(&frameSource, sequencePattern, firstFrame, MAX_QUEUED_FRAMES, numChannels);
+	else if (rawFramesPath)
+		frameSourceOpen = OpenRawFrameFile(&frameSource, rawFramesPath, rawFrameWidth, rawFrameHeight, MAX_QUEUED_FRAMES, numChannels);
+
+	if ((sequencePattern || rawFramesPath) && (!frameSourceOpen || NULL == (frame = AcquireFrame(&frameSource))))
+	{
+		printf("\nNo frames to filter");
+		exit(EXIT_FAILURE);
+	}
+
+	if (frame)
+	{
+		size_t frameSize = frame->image.GetNumBytesPerRow() * frame->image.GetNumRows();
+		inputStaging = AcquireStagingBuffer(&stagingPool, frameSize);
+		memcpy(inputStaging->hostPtr, frame->pixels, frameSize);
+		theTexMap1.AttachImageData((unsigned char*)inputStaging->hostPtr, frame->image.GetNumRows(), frame->image.GetNumCols(), numChannels);
+	}
+	else if (RgbImage::IsRawImageFileName(inputPath))
+	{
+		// Raw image files are mapped instead of read: opening costs a few
+		// system calls and the pixels come from the page cache when touched
+		if (!theTexMap1.MapRawImageFile(inputPath))
+			exit(EXIT_FAILURE);
+		if (theTexMap1.GetNumChannels() != numChannels)
+		{
+			printf("\n%s has %d channel(s), use --gray for gray raw image files", inputPath, theTexMap1.GetNumChannels());
+			exit(EXIT_FAILURE);
+		}
+	}
+	else
+	{
+		inputStaging = LoadImageFileToStaging(&stagingPool, inputPath, numChannels, &theTexMap1);
+	}
+	int inputLevels = imageSupport ? GetMipLevelCount(theTexMap1.GetNumCols(), theTexMap1.GetNumRows()) : 1;
+    texture = loadTextureFromFile(theTexMap1, 1, &pboRing, inputLevels);
 	texture2 = loadTexture(1, width, height);
 	
 	// Create OpenCL buffers on device
-	cl_mem image = clCreateFromGLTexture2D(context, CL_MEM_READ_ONLY, GL_TEXTURE_2D, 0, texture, &clError);
-	CHECK_OCL_ERR(clError);
-	
-	cl_mem filterWeightsBuffer = clCreateBuffer (context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof (float) * 9, filter, &clError);
-	CHECK_OCL_ERR(clError);
-		
-    cl_mem buffer = clCreateFromGLTexture2D(context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, texture2, &clError);
-	CHECK_OCL_ERR(clError);
-	
-	runKernel(queue, filterKernel, image, filterWeightsBuffer, buffer, width, height);
+	cl_mem image = 0;
+	cl_mem buffer = 0;
+	cl_mem filterWeightsBuffer = 0;
+
+	FilterEngine engine;
+	memset(&engine, 0, sizeof(engine));
+
+	InteropMode interopMode = glSharing ? INTEROP_GL_SHARING : INTEROP_HOST_COPY;
+	HostCopyInterop hostCopy;
+	InitHostCopyInterop(&hostCopy);
+	cl_mem copyImage = 0;
+	cl_mem copyBuffer = 0;
+	cl_mem mappedBuffer = 0;
 
-	while (!glfwWindowShouldClose(window))
+	if (imageSupport)
 	{
-		float ratio;
-		ratio = width / (float) height;
-		glViewport(0, 0, width, height);
-		glClear(GL_COLOR_BUFFER_BIT);
-		
-		glMatrixMode(GL_PROJECTION);
-		glLoadIdentity();
-		glOrtho(-ratio, ratio, -1.f, 1.f, 1.f, -1.f);
-		glMatrixMode(GL_MODELVIEW);
-		glLoadIdentity();
-		glRotatef(0.f, 0.f, 0.f, 1.f);
-		
-		//runKernel(queue, filterKernel, image, filterWeightsBuffer, buffer, width, height);
-		
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	   	glEnable(GL_TEXTURE_2D);
-	   	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+		filterWeightsBuffer = AcquirePooledBuffer(&memoryPool, CL_MEM_READ_ONLY, sizeof (float) * 9);
+		CopyHostToDevice(filter, filterWeightsBuffer, sizeof (float) * 9, queue, CL_TRUE);
+
+		// Build the mip chain of the input texture on the device
+		int inputWidth = theTexMap1.GetNumCols();
+		int inputHeight = theTexMap1.GetNumRows();
+		int inputPixelSize = GetTexturePixelSize(theTexMap1);
+		cl_kernel downsampleKernel = CreateKernel(program, "DownsampleGaussian");
+		if (glSharing)
+		{
+			BuildTexturePyramid(context, queue, downsampleKernel, texture, inputLevels, inputWidth, inputHeight);
+		}
+		else
+		{
+			StagingBuffer* pixelStaging = AcquireStagingBuffer(&stagingPool, (size_t)inputWidth * inputHeight * inputPixelSize);
+			CopyImageToTexturePixels(theTexMap1, (unsigned char*)pixelStaging->hostPtr);
+			BuildTexturePyramidHostCopy(&memoryPool, queue, downsampleKernel, &pboRing, texture, pixelStaging->hostPtr, inputPixelSize,
+										inputLevels, inputWidth, inputHeight);
+			ReleaseStagingBuffer(&stagingPool, pixelStaging);
+		}
+		ReleaseKernel(&downsampleKernel);
+
+		// Images for the host copy path, which is also timed against sharing
+		cl_image_format format;
+		format.image_channel_order = (1 == inputPixelSize) ? CL_R : CL_RGBA;
+		format.image_channel_data_type = CL_UNORM_INT8;
+		copyImage = AcquirePooledImage(&memoryPool, CL_MEM_READ_ONLY, &format, inputWidth, inputHeight);
+		format.image_channel_order = CL_RGBA;
+		copyBuffer = AcquirePooledImage(&memoryPool, CL_MEM_WRITE_ONLY, &format, width, height);
+
+		if (glSharing)
+		{
+			image = clCreateFromGLTexture2D(context, CL_MEM_READ_ONLY, GL_TEXTURE_2D, 0, texture, &clError);
+			CHECK_OCL_ERR(clError);
+
+			buffer = clCreateFromGLTexture2D(context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, texture2, &clError);
+			CHECK_OCL_ERR(clError);
+
+			// Sharing is not always the faster path: some drivers implement
+			// acquire/release as copies behind a full pipeline flush. One
+			// untimed frame of each path first, so the lazy driver work of the
+			// first launch, acquire and PBO upload is not timed.
+			runKernel(queue, filterKernel, image, filterWeightsBuffer, buffer, width, height, pixelsPerWorkItem);
+			runKernelHostCopy(queue, filterKernel, &hostCopy, &pboRing, texture, copyImage, inputWidth, inputHeight, inputPixelSize,
+							  filterWeightsBuffer, copyBuffer, texture2, width, height, pixelsPerWorkItem);
+			glFinish();
+
+			double sharingTime = GetTimeMs();
+			for (int i = 0; i < INTEROP_BENCHMARK_FRAMES; i++)
+				runKernel(queue, filterKernel, image, filterWeightsBuffer, buffer, width, height, pixelsPerWorkItem);
+			glFinish();
+			sharingTime = (GetTimeMs() - sharingTime) / INTEROP_BENCHMARK_FRAMES;
+
+			double hostCopyTime = GetTimeMs();
+			for (int i = 0; i < INTEROP_BENCHMARK_FRAMES; i++)
+				runKernelHostCopy(queue, filterKernel, &hostCopy, &pboRing, texture, copyImage, inputWidth, inputHeight, inputPixelSize,
+								  filterWeightsBuffer, copyBuffer, texture2, width, height, pixelsPerWorkItem);
+			glFinish();
+			hostCopyTime = (GetTimeMs() - hostCopyTime) / INTEROP_BENCHMARK_FRAMES;
+
+			interopMode = (hostCopyTime < sharingTime) ? INTEROP_HOST_COPY : INTEROP_GL_SHARING;
+			printf("\nGL sharing %.3f ms per frame, host copy %.3f ms per frame, using %s",
+				   sharingTime, hostCopyTime, (INTEROP_GL_SHARING == interopMode) ? "GL sharing" : "host copy");
+		}
+	}
+	else
+	{
+		// Filter the packed RGB data of the bitmap into an RGBA buffer and
+		// upload the result to the output texture from the host. The fixed-
+		// point kernels take the integer weights.
+		InitFilterEngine(&engine, context, device, program, &memoryPool, filter, fixedFilter, fixedPointShift, 9, GetDefaultQueueMode(device));
+		engine.outputPixelSize = luminanceOutput ? 1 : 4;
+		engine.resultCache = resultCache;
+
+		// The pages of a mapped input file are aligned for CL_MEM_USE_HOST_PTR:
+		// devices sharing host memory filter them in place
+		if (theTexMap1.IsMapped())
+		{
+			mappedBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+										  theTexMap1.GetNumRows() * theTexMap1.GetNumBytesPerRow(), theTexMap1.ImageData(), &clError);
+			CHECK_OCL_ERR(clError);
+		}
+	}
+
+	// The degraded quality of the real-time mode filters with the centre row
+	// and column of the weights only, 5 of the 9 taps. The kernels skip the
+	// reads of the corner texels too, FilterRow those of the rows off centre.
+	cl_program degradedProgram = 0;
+	cl_kernel degradedKernel = 0;
+	cl_mem degradedWeightsBuffer = 0;
+	FilterEngine degradedEngine;
+	memset(&degradedEngine, 0, sizeof(degradedEngine));
+
+	if (realtimeFps > 0.0 && !headless)
+	{
+		// Every corner weight moves in halves to its two neighbours in the
+		// centre row and column, so the weights keep their sum and the binomial
+		// filter becomes 3/16 around 4/16
+		float degradedFilter[9];
+		memcpy(degradedFilter, filter, sizeof(degradedFilter));
+		const int corners[] = { 0, 2, 6, 8 };
+		for (int i = 0; i < 4; i++)
+		{
+			int row = corners[i] / 3;
+			int col = corners[i] % 3;
+			degradedFilter[row * 3 + 1] += 0.5f * filter[corners[i]];
+			degradedFilter[3 + col] += 0.5f * filter[corners[i]];
+			degradedFilter[corners[i]] = 0.0f;
+		}
+
+		int degradedFixedFilter[9];
+		int degradedShift = (fixedPointShift < 0) ? -1 : GetFixedPointWeights(degradedFilter, 9, degradedFixedFilter);
+		char degradedOptions[160];
+		if (degradedShift >= 0)
+			sprintf(degradedOptions, "-DFILTER_CROSS -DFIXED_ACCUM=%s", GetFixedPointAccumulator(degradedFixedFilter, 9, degradedShift));
+		else
+			sprintf(degradedOptions, "-DFILTER_CROSS%s", colorOptions);
+		degradedProgram = CreateAndBuildProgramFromSource(context, sourceCode, sourceCodeLength, degradedOptions);
+
+		if (imageSupport)
+		{
+			degradedKernel = CreateKernel(degradedProgram, gray ? "FilterGray" : ((pixelsPerWorkItem > 1) ? "FilterRow" : "Filter"));
+			degradedWeightsBuffer = AcquirePooledBuffer(&memoryPool, CL_MEM_READ_ONLY, sizeof(float) * 9);
+			CopyHostToDevice(degradedFilter, degradedWeightsBuffer, sizeof(float) * 9, queue, CL_TRUE);
+		}
+		else
+		{
+			InitFilterEngine(&degradedEngine, context, device, degradedProgram, &memoryPool, degradedFilter, degradedFixedFilter, degradedShift, 9, engine.queueMode);
+			degradedEngine.outputPixelSize = engine.outputPixelSize;
+		}
+	}
+
+	FilterTargets targets;
+	targets.queue = queue;
+	targets.imageSupport = imageSupport;
+	targets.interopMode = interopMode;
+	targets.image = image;
+	targets.buffer = buffer;
+	targets.copyImage = copyImage;
+	targets.copyBuffer = copyBuffer;
+	targets.hostCopy = &hostCopy;
+	targets.pboRing = &pboRing;
+	targets.inputTexture = texture;
+	targets.inputWidth = theTexMap1.GetNumCols();
+	targets.inputHeight = theTexMap1.GetNumRows();
+	targets.inputPixelSize = GetTexturePixelSize(theTexMap1);
+	targets.mappedImage = &theTexMap1;
+	targets.mappedBuffer = mappedBuffer;
+	targets.outputTexture = texture2;
+	targets.width = width;
+	targets.height = height;
+	targets.pixelsPerWorkItem = pixelsPerWorkItem;
+	targets.rectPixels = NULL;
+	targets.rectPixelsSize = 0;
+
+	double startTime = GetTimeMs();
+	for (int i = 0; i < iterations; i++)
+	{
+		if (numRois > 0)
+			FilterRoisToTexture(&targets, filterKernel, filterWeightsBuffer, &engine, &theTexMap1, rois, numRois, filterRadius);
+		else
+			FilterToTexture(&targets, filterKernel, filterWeightsBuffer, &engine, &theTexMap1);
+	}
+	glFinish();
+	printf("\nFiltered %d frame(s) of %dx%d pixels, %.3f ms per frame\n", iterations, width, height, (GetTimeMs() - startTime) / iterations);
+
+	// Gray input and luminance output are written as single channel files
+	int outputChannels = (gray || luminanceOutput) ? 1 : 3;
 
-	   	glBegin(GL_QUADS);
+	DisplayPipeline displayPipeline;
+	memset(&displayPipeline, 0, sizeof(displayPipeline));
+	FrameTimeStats frameStats;
+	InitFrameTimeStats(&frameStats);
 
-	   	glTexCoord2f(0.0, 0.0);
-	   	glVertex3f(-1.0, -1.0, 0.0);
+	if (!headless)
+	{
+		if (!InitDisplayPipeline(&displayPipeline))
+			exit(EXIT_FAILURE);
 
-	   	glTexCoord2f(0.0, 1.0);
-	   	glVertex3f(-1.0, 1.0, 0.0);
+		glfwSwapInterval(swapInterval);
+		glViewport(0, 0, width, height);
+	}
 
-	   	glTexCoord2f(1.0, 1.0);
-	   	glVertex3f(1.0, 1.0, 0.0);
+	// The first frame of a sequence was filtered above, the others are
+	// filtered as they come out of the decoder
+	if (frame)
+	{
+		// With dirty rectangles a copy of the previous frame finds the pixels
+		// that changed, only they are uploaded and their footprint refiltered
+		RgbImage* previousFrame = NULL;
+		DirtyRegion dirtyRegion;
+		long dirtyArea = 0;
+		if (dirtyRects)
+		{
+			previousFrame = new RgbImage(frame->image.GetNumRows(), frame->image.GetNumCols(), numChannels);
+			memcpy(previousFrame->ImageData(), frame->image.ImageData(), frame->image.GetNumBytesPerRow() * frame->image.GetNumRows());
+		}
+
+		long numFrames = 0;
+		startTime = GetTimeMs();
+		do
+		{
+			if (numFrames > 0 && previousFrame)
+			{
+				dirtyArea += FindDirtyRects(*previousFrame, frame->image, &dirtyRegion);
+				CopyDirtyRects(*previousFrame, frame->image, &dirtyRegion);
+				UploadDirtyRects(&targets, frame->image, &dirtyRegion);
+				FilterDirtyRects(&targets, filterKernel, filterWeightsBuffer, &engine, &frame->image, &dirtyRegion, filterRadius);
+			}
+			else if (numFrames > 0)
+			{
+				if (imageSupport)
+					UploadImageToTexture(&pboRing, texture, frame->image);
+				if (numRois > 0)
+					FilterRoisToTexture(&targets, filterKernel, filterWeightsBuffer, &engine, &frame->image, rois, numRois, filterRadius);
+				else
+					FilterToTexture(&targets, filterKernel, filterWeightsBuffer, &engine, &frame->image);
+			}
+			long frameIndex = frame->index;
+			ReleaseFrame(&frameSource, frame);
+			numFrames++;
+
+			if (outputPattern)
+			{
+				char outputPath[1100];
+				snprintf(outputPath, sizeof(outputPath), outputPattern, frameIndex);
+				if (numRois > 0)
+					WriteRoisToFiles(&targets, rois, numRois, outputChannels, outputPath);
+				else if (!WriteTextureToFile(texture2, width, height, outputChannels, outputPath))
+					printf("\nUnable to write %s", outputPath);
+			}
+
+			if (!headless)
+			{
+				DrawTexture(&displayPipeline, texture2);
+				glfwSwapBuffers(glContext.window);
+				glfwPollEvents();
+				if (glfwWindowShouldClose(glContext.window))
+					break;
+			}
+		} while ((frame = AcquireFrame(&frameSource)));
+		glFinish();
+
+		// Decoder waits mean the filter is the bottleneck, filter waits the decoder
+		printf("\nFiltered %ld frames of the sequence, %.3f ms per frame (decoder waited %ld times, filter waited %ld times)\n",
+			   numFrames, (GetTimeMs() - startTime) / numFrames, frameSource.decoderWaits, frameSource.consumerWaits);
+
+		if (previousFrame)
+		{
+			if (numFrames > 1)
+				printf("Dirty rectangles covered %.1f%% of the frames after the first\n",
+					   100.0 * dirtyArea / ((double)(numFrames - 1) * previousFrame->GetNumCols() * previousFrame->GetNumRows()));
+			delete previousFrame;
+		}
+	}
+	else if (headless || outputPattern)
+	{
+		const char* outputPath = outputPattern ? outputPattern : "output.bmp";
+		if (numRois > 0)
+			WriteRoisToFiles(&targets, rois, numRois, outputChannels, outputPath);
+		else if (!WriteTextureToFile(texture2, width, height, outputChannels, outputPath))
+			printf("\nUnable to write %s", outputPath);
+	}
 
-	   	glTexCoord2f(1.0, 0.0);
-	   	glVertex3f(1.0, -1.0, 0.0);
+	FramePacer pacer;
+	InitFramePacer(&pacer, (realtimeFps > 0.0) ? realtimeFps : 60.0);
 
-	   	glEnd();
+	// The output already holds the full quality result of a single input,
+	// the first real-time frame shows it instead of filtering it again
+	bool outputFiltered = !(sequencePattern || rawFramesPath) && 0 == numRois;
 
-	   	glFlush();
-	   	glDisable(GL_TEXTURE_2D);
-		glfwSwapBuffers(window);
+	double lastFrameTime = GetTimeMs();
+	while (!headless && !glfwWindowShouldClose(glContext.window))
+	{
+		double frameStartTime = GetTimeMs();
+
+		if (realtimeFps > 0.0 && outputFiltered)
+		{
+			outputFiltered = false;
+		}
+		else if (realtimeFps > 0.0 && BeginPacedFrame(&pacer))
+		{
+			if (FILTER_QUALITY_FULL == pacer.quality)
+				FilterToTexture(&targets, filterKernel, filterWeightsBuffer, &engine, &theTexMap1);
+			else
+				FilterToTexture(&targets, degradedKernel, degradedWeightsBuffer, &degradedEngine, &theTexMap1);
+
+			EndPacedFrame(&pacer, GetTimeMs() - frameStartTime);
+		}
+
+		DrawTexture(&displayPipeline, texture2);
+		glfwSwapBuffers(glContext.window);
 		glfwPollEvents();
+
+		if (realtimeFps > 0.0)
+			WaitForNextFrame(&pacer, frameStartTime);
+
+		double now = GetTimeMs();
+		AddFrameTime(&frameStats, now - lastFrameTime);
+		lastFrameTime = now;
+		if (0 == frameStats.totalFrames % FRAME_TIME_WINDOW)
+			PrintFrameTimeHistogram(&frameStats, stdout);
+	}
+
+	if (realtimeFps > 0.0 && !headless)
+		PrintFramePacerStats(&pacer);
+
+	if (frameStatsPath && frameStats.count)
+	{
+		FILE* frameStatsFile = fopen(frameStatsPath, "w");
+		if (frameStatsFile)
+		{
+			PrintFrameTimeHistogram(&frameStats, frameStatsFile);
+			fclose(frameStatsFile);
+		}
+		else
+		{
+			printf("\nUnable to write %s", frameStatsPath);
+		}
 	}
 	
 	
-	clReleaseMemObject(image);
-	clReleaseMemObject(filterWeightsBuffer);
-	clReleaseMemObject(buffer);
+	if (frameSourceOpen)
+		CloseFrameSource(&frameSource);
+
+	ReleaseDeviceBuffer(&mappedBuffer);
+	theTexMap1.Reset();
+	if (inputStaging)
+		ReleaseStagingBuffer(&stagingPool, inputStaging);
+	ReleaseStagingPool(&stagingPool);
+
+	ReleaseDisplayPipeline(&displayPipeline);
+	ReleaseHostCopyInterop(&hostCopy);
+	free(targets.rectPixels);
+	ReleasePboRing(&pboRing);
+	ReleaseFilterEngine(&engine);
+	ReleaseFilterEngine(&degradedEngine);
+	if (resultCache)
+	{
+		PrintResultCacheStats(resultCache);
+		ReleaseResultCache(resultCache);
+	}
+	ReleaseThreadResources();
+	ReleasePooledMemObject(&memoryPool, &image);
+	ReleasePooledMemObject(&memoryPool, &filterWeightsBuffer);
+	ReleasePooledMemObject(&memoryPool, &buffer);
+	ReleasePooledMemObject(&memoryPool, &copyImage);
+	ReleasePooledMemObject(&memoryPool, &copyBuffer);
+	ReleasePooledMemObject(&memoryPool, &degradedWeightsBuffer);
+	ReleaseDeviceMemoryPool(&memoryPool);
 	
 	if (sourceCode)
         free(sourceCode);
 	ReleaseKernel(&filterKernel);
+	ReleaseKernel(&degradedKernel);
     ReleaseProgram(&program);
+    ReleaseProgram(&degradedProgram);
 	ReleaseOpenCLQueue(&queue);
     ReleaseOpenCLContext(&context);
 
-	glfwDestroyWindow(window);
-	glfwTerminate();
+	DestroyGLContext(&glContext);
 	exit(EXIT_SUCCESS);
 }
\ No newline at end of file
@@ -0,0 +1,106 @@
+///////////////////////////////////////////////////////////////////////////////
+// Round trips images through WriteQoiFile and LoadQoiFile. The images start
+// with a color and then mix in black pixels, which hash to the same index
+// entry as the transparent black of a never written one, with colors that the
+// encoder refers to by QOI_OP_INDEX and QOI_OP_RUN chunks.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../RgbImage.h"
+
+static bool RoundTrip(const char* name, RgbImage& image)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/RgbImageQoiTest.%d.qoi", (int)getpid());
+
+    if (!image.WriteQoiFile(path))
+    {
+        printf("%s: unable to write %s\n", name, path);
+        return false;
+    }
+
+    RgbImage loaded;
+    bool ok = loaded.LoadQoiFile(path, 0, 0, image.GetNumChannels());
+    unlink(path);
+    if (!ok || loaded.GetNumRows() != image.GetNumRows() || loaded.GetNumCols() != image.GetNumCols())
+    {
+        printf("%s: unable to load the written file\n", name);
+        return false;
+    }
+
+    long rowSize = image.GetNumChannels() * image.GetNumCols();
+    long numWrong = 0;
+    for (long row = 0; row < image.GetNumRows(); row++)
+    {
+        const unsigned char* expected = (const unsigned char*)image.ImageData() + row * image.GetNumBytesPerRow();
+        const unsigned char* actual = (const unsigned char*)loaded.ImageData() + row * loaded.GetNumBytesPerRow();
+        for (long i = 0; i < rowSize; i += image.GetNumChannels())
+        {
+            if (0 != memcmp(expected + i, actual + i, image.GetNumChannels()))
+                numWrong++;
+        }
+    }
+
+    if (numWrong > 0)
+    {
+        printf("%s: %ld of %ld pixels differ\n", name, numWrong, image.GetNumRows() * image.GetNumCols());
+        return false;
+    }
+
+    printf("%s: ok\n", name);
+    return true;
+}
+
+static void SetPixel(RgbImage& image, long row, long col, unsigned char r, unsigned char g, unsigned char b)
+{
+    unsigned char* pixel = (unsigned char*)image.ImageData() + row * image.GetNumBytesPerRow() + col * image.GetNumChannels();
+    pixel[0] = r;
+    if (image.GetNumChannels() == 3)
+    {
+        pixel[1] = g;
+        pixel[2] = b;
+    }
+}
+
+int main(void)
+{
+    bool ok = true;
+
+    // A black run at the start would put opaque black into the decoder's
+    // index, so black first follows a color here
+    static const unsigned char row[8][3] =
+    {
+        {200, 10, 10}, {0, 0, 0}, {1, 1, 1}, {200, 10, 10},
+        {1, 1, 1}, {0, 0, 0}, {30, 90, 250}, {1, 1, 1}
+    };
+    RgbImage small(1, 8);
+    for (int i = 0; i < 8; i++)
+        SetPixel(small, 0, i, row[i][0], row[i][1], row[i][2]);
+    ok = RoundTrip("8 pixels", small) && ok;
+
+    // Random pixels from a small palette with black, so every chunk type
+    // occurs, in RGB and gray
+    static const unsigned char palette[6][3] =
+    {
+        {0, 0, 0}, {0, 0, 0}, {255, 255, 255}, {1, 2, 0}, {120, 60, 30}, {121, 61, 31}
+    };
+    for (int numChannels = 1; numChannels <= 3; numChannels += 2)
+    {
+        RgbImage image(37, 53, numChannels);
+        srand(12345);
+        for (long r = 0; r < image.GetNumRows(); r++)
+        {
+            for (long c = 0; c < image.GetNumCols(); c++)
+            {
+                int color = (rand() % 4 == 0) ? rand() % 6 : 0;
+                SetPixel(image, r, c, palette[color][0], palette[color][1], palette[color][2]);
+            }
+        }
+        SetPixel(image, image.GetNumRows() - 1, 0, 255, 255, 255);   // the first pixel in the file
+        ok = RoundTrip((numChannels == 1) ? "gray" : "RGB", image) && ok;
+    }
+
+    return ok ? 0 : 1;
+}